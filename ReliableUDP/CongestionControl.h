@@ -0,0 +1,484 @@
+/*
+ * FILE: CongestionControl.h
+ * PROJECT: Reliable UDP File Transfer
+ * PROGRAMMER: Manreet & Bhawanjeet
+ * FIRST VERSION: 17/10/2026
+ * DESCRIPTION:
+ * Congestion controllers for ReliableConnection. Each one is driven by the
+ * acked bytes, lost bytes and round trip times the reliability system
+ * reports every update, and answers with a congestion window and a pacing
+ * rate. AIMD and CUBIC are loss based window controllers, BBR builds a model
+ * of the path (bottleneck bandwidth and minimum rtt) and paces at it.
+ */
+#ifndef CONGESTION_CONTROL_H
+#define CONGESTION_CONTROL_H
+
+#include "Net.h"
+
+#include <math.h>
+#include <string.h>
+
+namespace net
+{
+	const int InitialWindowPackets = 10;	// initial congestion window (RFC 6928)
+	const int MinimumWindowPackets = 2;
+	const float InitialRoundTripTime = 0.1f;	// rtt assumed for pacing until the first ack
+
+	const double BbrHighGain = 2.885;			// 2 / ln 2, doubles the delivery rate every round
+	const double BbrMinSampleInterval = 0.05;	// shortest delivery rate sample, longer than the gap between ack bursts
+
+	// additive increase, multiplicative decrease (Reno style)
+	//  + slow start doubles the window every round trip until the first loss
+	//  + after that the window grows by one packet per round trip and halves on loss
+	//  + losses within one round trip of a reduction belong to the same event and are not counted again
+
+	class AimdCongestionControl : public CongestionControl
+	{
+	public:
+
+		AimdCongestionControl()
+		{
+			Reset();
+		}
+
+		const char* GetName() const
+		{
+			return "aimd";
+		}
+
+		void Reset()
+		{
+			cwnd = InitialWindowPackets * packet_size;
+			ssthresh = 1.0e12;
+			recovery_end = 0.0;
+			rtt = 0.0f;
+		}
+
+		void Update(const CongestionSample& sample)
+		{
+			rtt = sample.rtt;
+
+			if (sample.lost_bytes > 0 && sample.time >= recovery_end)
+			{
+				cwnd = std::max(cwnd * 0.5, (double)MinimumWindowPackets * packet_size);
+				ssthresh = cwnd;
+				recovery_end = sample.time + std::max(rtt, InitialRoundTripTime);
+				return;
+			}
+
+			if (sample.acked_bytes <= 0)
+				return;
+
+			if (cwnd < ssthresh)
+				cwnd += sample.acked_bytes;
+			else
+				cwnd += (double)packet_size * sample.acked_bytes / cwnd;
+		}
+
+		double GetCongestionWindow() const
+		{
+			return cwnd;
+		}
+
+		double GetPacingRate() const
+		{
+			const double gain = cwnd < ssthresh ? 2.0 : 1.25;
+			return gain * cwnd / (rtt > 0.0f ? rtt : InitialRoundTripTime);
+		}
+
+	private:
+
+		double cwnd;			// bytes allowed in flight
+		double ssthresh;		// slow start ends here
+		double recovery_end;	// losses before this time belong to the last reduction
+		float rtt;
+	};
+
+	// CUBIC (RFC 9438)
+	//  + after a loss the window grows along a cubic curve centred on the size it had when the loss happened (w_max):
+	//    fast while far below it, flat near it, then probing beyond it
+	//  + never grows slower than the AIMD window would (the "Reno friendly" region)
+
+	class CubicCongestionControl : public CongestionControl
+	{
+	public:
+
+		CubicCongestionControl()
+		{
+			Reset();
+		}
+
+		const char* GetName() const
+		{
+			return "cubic";
+		}
+
+		void Reset()
+		{
+			cwnd = InitialWindowPackets * packet_size;
+			ssthresh = 1.0e12;
+			w_max = 0.0;
+			w_last_max = 0.0;
+			w_est = 0.0;
+			k = 0.0;
+			epoch_start = -1.0;
+			recovery_end = 0.0;
+			rtt = 0.0f;
+		}
+
+		void Update(const CongestionSample& sample)
+		{
+			const double C = 0.4;
+			const double Beta = 0.7;
+
+			rtt = sample.rtt;
+
+			if (sample.lost_bytes > 0 && sample.time >= recovery_end)
+			{
+				// fast convergence: give up some of w_max when losses come before we got back to it
+
+				w_max = cwnd < w_last_max ? cwnd * (1.0 + Beta) / 2.0 : cwnd;
+				w_last_max = cwnd;
+				cwnd = std::max(cwnd * Beta, (double)MinimumWindowPackets * packet_size);
+				ssthresh = cwnd;
+				epoch_start = -1.0;
+				recovery_end = sample.time + std::max(rtt, InitialRoundTripTime);
+				return;
+			}
+
+			if (sample.acked_bytes <= 0)
+				return;
+
+			if (cwnd < ssthresh)
+			{
+				cwnd += sample.acked_bytes;
+				return;
+			}
+
+			if (epoch_start < 0.0)
+			{
+				epoch_start = sample.time;
+				w_est = cwnd;
+				if (w_max < cwnd)
+					w_max = cwnd;
+				k = cbrt((w_max - cwnd) / packet_size / C);
+			}
+
+			// window (in packets) the cubic curve asks for one round trip from now
+
+			const double t = sample.time - epoch_start + rtt;
+			double target = (C * (t - k) * (t - k) * (t - k)) * packet_size + w_max;
+
+			w_est += (double)packet_size * (3.0 * (1.0 - Beta) / (1.0 + Beta)) * sample.acked_bytes / cwnd;
+			if (target < w_est)
+				target = w_est;
+			if (target > cwnd * 1.5)
+				target = cwnd * 1.5;
+
+			if (target > cwnd)
+				cwnd += (target - cwnd) * sample.acked_bytes / cwnd;
+		}
+
+		double GetCongestionWindow() const
+		{
+			return cwnd;
+		}
+
+		double GetPacingRate() const
+		{
+			const double gain = cwnd < ssthresh ? 2.0 : 1.25;
+			return gain * cwnd / (rtt > 0.0f ? rtt : InitialRoundTripTime);
+		}
+
+	private:
+
+		double cwnd;			// bytes allowed in flight
+		double ssthresh;		// slow start ends here
+		double w_max;			// window at the last loss, the centre of the cubic curve
+		double w_last_max;		// w_max before the last loss (fast convergence)
+		double w_est;			// window AIMD would have reached since the epoch started
+		double k;				// seconds from epoch start until the curve is back at w_max
+		double epoch_start;		// start of the current growth epoch (-1 before the first ack after a loss)
+		double recovery_end;
+		float rtt;
+	};
+
+	// BBR style model based control
+	//  + bottleneck bandwidth is the highest delivery rate seen over the last ten rounds, min rtt the lowest rtt
+	//    seen over ten seconds, and their product is the bandwidth delay product (BDP)
+	//  + startup paces at 2.89x the bandwidth estimate until it stops growing, drain empties the queue that built,
+	//    then probe bandwidth cycles the pacing gain (1.25, 0.75, then 1) around the estimate
+	//  + every ten seconds probe rtt shrinks the window to four packets to refresh the min rtt
+	//  + acks that arrive in bursts (delayed or aggregated acks) would starve a window of exactly the BDP,
+	//    so the window also covers the largest burst of acks beyond the estimated rate seen lately
+	//  + loss is not a signal by itself, it only shows up through lower delivery rates
+
+	class BbrCongestionControl : public CongestionControl
+	{
+	public:
+
+		BbrCongestionControl()
+		{
+			Reset();
+		}
+
+		const char* GetName() const
+		{
+			return "bbr";
+		}
+
+		void Reset()
+		{
+			state = Startup;
+			pacing_gain = BbrHighGain;
+			cwnd_gain = BbrHighGain;
+			for (int i = 0; i < BandwidthWindowRounds; ++i)
+			{
+				bandwidth_samples[i] = 0.0;
+				extra_acked_samples[i] = 0.0;
+			}
+			extra_acked = 0.0;
+			aggregation_start = 0.0;
+			aggregation_acked = 0.0;
+			bottleneck_bandwidth = 0.0;
+			min_rtt = 0.0f;
+			min_rtt_time = 0.0;
+			delivered = 0.0;
+			round_delivered = 0.0;
+			round_start = -1.0;
+			round_count = 0;
+			full_bandwidth = 0.0;
+			full_bandwidth_rounds = 0;
+			filled_pipe = false;
+			cycle_index = 0;
+			cycle_start = 0.0;
+			probe_rtt_done = 0.0;
+			bytes_in_flight = 0;
+		}
+
+		void Update(const CongestionSample& sample)
+		{
+			bytes_in_flight = sample.bytes_in_flight;
+			delivered += sample.acked_bytes;
+
+			if (round_start < 0.0)
+			{
+				round_start = sample.time;
+				cycle_start = sample.time;
+			}
+
+			// min rtt, refreshed by probe rtt once it is too old
+
+			if (sample.min_rtt_sample > 0.0f && (min_rtt == 0.0f || sample.min_rtt_sample <= min_rtt))
+			{
+				min_rtt = sample.min_rtt_sample;
+				min_rtt_time = sample.time;
+			}
+
+			// one delivery rate sample per round (at least BbrMinSampleInterval, so bursts of acks average out)
+
+			const double round_length = std::max((double)min_rtt, BbrMinSampleInterval);
+			if (sample.time - round_start >= round_length)
+			{
+				const double rate = (delivered - round_delivered) / (sample.time - round_start);
+				round_count++;
+				bandwidth_samples[round_count % BandwidthWindowRounds] = rate;
+				extra_acked_samples[round_count % BandwidthWindowRounds] = 0.0;
+				bottleneck_bandwidth = 0.0;
+				for (int i = 0; i < BandwidthWindowRounds; ++i)
+					bottleneck_bandwidth = std::max(bottleneck_bandwidth, bandwidth_samples[i]);
+				round_start = sample.time;
+				round_delivered = delivered;
+				CheckFullPipe();
+			}
+
+			UpdateAckAggregation(sample);
+			UpdateState(sample.time);
+		}
+
+		double GetCongestionWindow() const
+		{
+			const double minimum = 4.0 * packet_size;
+			if (state == ProbeRtt)
+				return minimum;
+			if (bottleneck_bandwidth <= 0.0 || min_rtt <= 0.0f)
+				return std::max((double)InitialWindowPackets * packet_size, minimum);
+			return std::max(cwnd_gain * GetBandwidthDelayProduct() + extra_acked, minimum);
+		}
+
+		double GetPacingRate() const
+		{
+			if (bottleneck_bandwidth <= 0.0)
+				return BbrHighGain * InitialWindowPackets * packet_size / (min_rtt > 0.0f ? min_rtt : InitialRoundTripTime);
+			return pacing_gain * bottleneck_bandwidth;
+		}
+
+		double GetBottleneckBandwidth() const
+		{
+			return bottleneck_bandwidth;
+		}
+
+		float GetMinRoundTripTime() const
+		{
+			return min_rtt;
+		}
+
+	private:
+
+		enum State
+		{
+			Startup,
+			Drain,
+			ProbeBandwidth,
+			ProbeRtt
+		};
+
+		static const int BandwidthWindowRounds = 10;
+		static const int GainCycleLength = 8;
+
+		double GetBandwidthDelayProduct() const
+		{
+			return bottleneck_bandwidth * min_rtt;
+		}
+
+		// bytes acked beyond what the bandwidth estimate explains since the current burst of acks started
+
+		void UpdateAckAggregation(const CongestionSample& sample)
+		{
+			if (sample.acked_bytes <= 0 || bottleneck_bandwidth <= 0.0)
+				return;
+			const double expected = bottleneck_bandwidth * (sample.time - aggregation_start);
+			if (aggregation_acked <= expected)
+			{
+				aggregation_start = sample.time;
+				aggregation_acked = 0.0;
+			}
+			aggregation_acked += sample.acked_bytes;
+			const double extra = aggregation_acked - bottleneck_bandwidth * (sample.time - aggregation_start);
+			double& round_extra = extra_acked_samples[round_count % BandwidthWindowRounds];
+			round_extra = std::max(round_extra, extra);
+			extra_acked = 0.0;
+			for (int i = 0; i < BandwidthWindowRounds; ++i)
+				extra_acked = std::max(extra_acked, extra_acked_samples[i]);
+		}
+
+		// the pipe is full once three rounds in a row fail to raise the bandwidth estimate by 25%
+
+		void CheckFullPipe()
+		{
+			if (filled_pipe)
+				return;
+			if (bottleneck_bandwidth >= full_bandwidth * 1.25)
+			{
+				full_bandwidth = bottleneck_bandwidth;
+				full_bandwidth_rounds = 0;
+				return;
+			}
+			if (++full_bandwidth_rounds >= 3)
+				filled_pipe = true;
+		}
+
+		void UpdateState(double time)
+		{
+			const double ProbeRttInterval = 10.0;
+			const double ProbeRttDuration = 0.2;
+			const double cycle_gains[GainCycleLength] = { 1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0 };
+
+			switch (state)
+			{
+			case Startup:
+				if (filled_pipe)
+				{
+					state = Drain;
+					pacing_gain = 1.0 / BbrHighGain;
+					cwnd_gain = BbrHighGain;
+				}
+				break;
+
+			case Drain:
+				if (bytes_in_flight <= GetBandwidthDelayProduct())
+					EnterProbeBandwidth(time);
+				break;
+
+			case ProbeBandwidth:
+				if (time - cycle_start > std::max((double)min_rtt, BbrMinSampleInterval))
+				{
+					cycle_index = (cycle_index + 1) % GainCycleLength;
+					cycle_start = time;
+					pacing_gain = cycle_gains[cycle_index];
+				}
+				break;
+
+			case ProbeRtt:
+				if (time >= probe_rtt_done)
+				{
+					min_rtt_time = time;
+					if (filled_pipe)
+						EnterProbeBandwidth(time);
+					else
+					{
+						state = Startup;
+						pacing_gain = BbrHighGain;
+						cwnd_gain = BbrHighGain;
+					}
+				}
+				return;
+			}
+
+			if (min_rtt > 0.0f && time - min_rtt_time > ProbeRttInterval)
+			{
+				state = ProbeRtt;
+				pacing_gain = 1.0;
+				probe_rtt_done = time + std::max(ProbeRttDuration, (double)min_rtt);
+				min_rtt = 0.0f;		// the next samples, taken with an empty queue, set it again
+			}
+		}
+
+		void EnterProbeBandwidth(double time)
+		{
+			state = ProbeBandwidth;
+			cwnd_gain = 2.0;
+			cycle_index = 1;	// start past the probing phase, the queue was just drained
+			cycle_start = time;
+			pacing_gain = 0.75;
+		}
+
+		State state;
+		double pacing_gain;
+		double cwnd_gain;
+		double bandwidth_samples[BandwidthWindowRounds];	// delivery rate per round, indexed by round % window
+		double bottleneck_bandwidth;	// bytes per second, max of the samples
+		double extra_acked_samples[BandwidthWindowRounds];	// largest ack burst per round
+		double extra_acked;				// max of the ack burst samples
+		double aggregation_start;		// start of the current ack burst
+		double aggregation_acked;		// bytes acked since then
+		float min_rtt;
+		double min_rtt_time;			// when min_rtt was last lowered or confirmed
+		double delivered;				// total bytes acked
+		double round_delivered;			// delivered at the start of this round
+		double round_start;
+		int round_count;
+		double full_bandwidth;			// bandwidth estimate startup is trying to beat
+		int full_bandwidth_rounds;		// rounds without a 25% gain
+		bool filled_pipe;
+		int cycle_index;
+		double cycle_start;
+		double probe_rtt_done;
+		int bytes_in_flight;
+	};
+
+	// creates a controller by name ("aimd", "cubic" or "bbr"), NULL for an unknown name
+
+	inline CongestionControl* CreateCongestionControl(const char* name)
+	{
+		if (strcmp(name, "aimd") == 0)
+			return new AimdCongestionControl();
+		if (strcmp(name, "cubic") == 0)
+			return new CubicCongestionControl();
+		if (strcmp(name, "bbr") == 0)
+			return new BbrCongestionControl();
+		return NULL;
+	}
+}
+
+#endif
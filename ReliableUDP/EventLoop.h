@@ -0,0 +1,263 @@
+/*
+ * FILE: EventLoop.h
+ * PROJECT: Reliable UDP File Transfer
+ * PROGRAMMER: Manreet & Bhawanjeet
+ * FIRST VERSION: 17/10/2026
+ * DESCRIPTION:
+ * Building blocks for the event driven main loop: a hashed timer wheel for
+ * periodic work (resends, keepalives, stats) and a token bucket that paces
+ * sends. The loop itself waits on the socket with Connection::WaitForPacket
+ * for as long as the next timer or send allows.
+ */
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "Net.h"
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <functional>
+
+namespace net
+{
+	// hashed timer wheel
+	//  + time is cut into ticks of "resolution" seconds, a timer lives in slot (expiry tick % slot count)
+	//  + timers more than one turn of the wheel away stay in their slot until their turn comes round
+	//  + schedule and cancel are O(1), advancing costs O(ticks passed + timers fired)
+
+	class TimerWheel
+	{
+	public:
+
+		typedef std::function<void()> Callback;
+
+		TimerWheel(double resolution = 0.001, int slot_count = 256)
+		{
+			assert(resolution > 0.0);
+			assert(slot_count > 0);
+			this->resolution = resolution;
+			slots.resize(slot_count);
+			current_tick = 0;
+		}
+
+		// sets the wheel to the current time, call before scheduling anything
+
+		void Start(double time)
+		{
+			current_tick = ToTick(time);
+		}
+
+		// runs the callback after delay seconds, then every period seconds if period > 0. returns an id for Cancel
+
+		int Schedule(double delay, const Callback& callback, double period = 0.0)
+		{
+			int id;
+			if (free_timers.empty())
+			{
+				id = (int)timers.size();
+				timers.push_back(Timer());
+			}
+			else
+			{
+				id = free_timers.back();
+				free_timers.pop_back();
+			}
+			Timer& timer = timers[id];
+			timer.callback = callback;
+			timer.period = period;
+			timer.active = true;
+			Insert(id, current_tick + TicksFor(delay));
+			return id;
+		}
+
+		// the slot entry is dropped lazily when the wheel next passes it
+
+		void Cancel(int id)
+		{
+			if (id >= 0 && id < (int)timers.size())
+				timers[id].active = false;
+		}
+
+		// fires every timer that is due at this time
+
+		void Advance(double time)
+		{
+			const uint64_t target_tick = ToTick(time);
+			if (target_tick <= current_tick)
+				return;
+			uint64_t ticks = target_tick - current_tick;
+			if (ticks > slots.size())
+				ticks = slots.size();	// one full turn visits every slot
+			for (uint64_t i = 1; i <= ticks; ++i)
+				CollectExpired(slots[(current_tick + i) % slots.size()], target_tick);
+			current_tick = target_tick;
+
+			for (size_t i = 0; i < expired.size(); ++i)
+			{
+				const int id = expired[i];
+				Timer& timer = timers[id];
+				if (!timer.active)
+				{
+					free_timers.push_back(id);
+					continue;
+				}
+				Callback callback = timer.callback;
+				if (timer.period > 0.0)
+					Insert(id, current_tick + TicksFor(timer.period));
+				else
+				{
+					timer.active = false;
+					free_timers.push_back(id);
+				}
+				callback();
+			}
+			expired.clear();
+		}
+
+		// seconds until the next timer is due (a large number if there are none)
+
+		double GetTimeUntilNext(double time) const
+		{
+			uint64_t next_tick = UINT64_MAX;
+			for (size_t i = 0; i < timers.size(); ++i)
+				if (timers[i].active && timers[i].expiry_tick < next_tick)
+					next_tick = timers[i].expiry_tick;
+			if (next_tick == UINT64_MAX)
+				return 1.0e9;
+			const double wait = next_tick * resolution - time;
+			return wait > 0.0 ? wait : 0.0;
+		}
+
+	private:
+
+		struct Timer
+		{
+			uint64_t expiry_tick = 0;
+			double period = 0.0;
+			bool active = false;
+			Callback callback;
+		};
+
+		uint64_t ToTick(double time) const
+		{
+			return (uint64_t)(time / resolution);
+		}
+
+		uint64_t TicksFor(double delay) const
+		{
+			const uint64_t ticks = (uint64_t)ceil(delay / resolution);
+			return ticks > 0 ? ticks : 1;
+		}
+
+		void Insert(int id, uint64_t expiry_tick)
+		{
+			timers[id].expiry_tick = expiry_tick;
+			slots[expiry_tick % slots.size()].push_back(id);
+		}
+
+		// moves due (and cancelled) timers out of a slot, later rounds stay put
+
+		void CollectExpired(std::vector<int>& slot, uint64_t target_tick)
+		{
+			size_t kept = 0;
+			for (size_t i = 0; i < slot.size(); ++i)
+			{
+				const int id = slot[i];
+				if (!timers[id].active || timers[id].expiry_tick <= target_tick)
+					expired.push_back(id);
+				else
+					slot[kept++] = id;
+			}
+			slot.resize(kept);
+		}
+
+		double resolution;						// seconds per tick
+		uint64_t current_tick;					// last tick processed
+		std::vector<Timer> timers;				// indexed by timer id
+		std::vector<int> free_timers;			// ids ready for reuse
+		std::vector<std::vector<int> > slots;	// timer ids per slot
+		std::vector<int> expired;				// scratch list for Advance
+	};
+
+	// token bucket pacing
+	//  + tokens (bytes) drip in at "rate" per second, up to "burst" bytes
+	//  + a send may go out when enough tokens are available, so sends are spread evenly instead of bunching on a tick
+
+	class TokenBucket
+	{
+	public:
+
+		TokenBucket(double rate = 0.0, double burst = 0.0)
+		{
+			this->rate = rate;
+			this->burst = burst;
+			tokens = burst;
+			last_time = 0.0;
+			started = false;
+		}
+
+		void SetRate(double rate, double burst)
+		{
+			this->rate = rate;
+			this->burst = burst;
+			if (tokens > burst)
+				tokens = burst;
+		}
+
+		// adds the tokens earned since the last update
+
+		void Update(double time)
+		{
+			if (started && time > last_time)
+			{
+				tokens += (time - last_time) * rate;
+				if (tokens > burst)
+					tokens = burst;
+			}
+			last_time = time;
+			started = true;
+		}
+
+		bool CanConsume(double amount) const
+		{
+			return tokens >= amount;
+		}
+
+		void Consume(double amount)
+		{
+			tokens -= amount;
+		}
+
+		// seconds until "amount" tokens are available (counting from the last update)
+
+		double GetTimeUntil(double amount) const
+		{
+			if (tokens >= amount)
+				return 0.0;
+			if (rate <= 0.0)
+				return 1.0e9;
+			return (amount - tokens) / rate;
+		}
+
+		double GetTokens() const
+		{
+			return tokens;
+		}
+
+		double GetRate() const
+		{
+			return rate;
+		}
+
+	private:
+
+		double rate;			// bytes per second
+		double burst;			// bucket size in bytes
+		double tokens;			// bytes that may be sent right now
+		double last_time;
+		bool started;
+	};
+}
+
+#endif
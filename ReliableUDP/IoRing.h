@@ -0,0 +1,345 @@
+/*
+ * FILE: IoRing.h
+ * PROJECT: Reliable UDP File Transfer
+ * PROGRAMMER: Manreet & Bhawanjeet
+ * FIRST VERSION: 17/10/2026
+ * DESCRIPTION:
+ * A small io_uring engine on the raw system calls (no liburing): the
+ * submission and completion rings, registered files and buffers, and a ring
+ * of provided buffers for multishot receives. The socket takes its datagrams
+ * through one and the file sink writes through another. Where io_uring is
+ * missing (other platforms, kernels before 6.0, or a sandbox that forbids it)
+ * Open fails and both keep their plain system calls.
+ */
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// multishot receives into provided buffers need linux 6.0. define NET_IO_URING 0 to stay on the plain calls
+
+#ifndef NET_IO_URING
+#if defined(__linux__) && defined(IORING_RECV_MULTISHOT) && defined(IORING_FEAT_EXT_ARG)
+#define NET_IO_URING 1
+#else
+#define NET_IO_URING 0
+#endif
+#endif
+
+#if NET_IO_URING
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace net
+{
+	// io_uring on the raw system calls
+	//  + the kernel reads submissions from one ring and posts completions to another, both mapped into this process,
+	//    so a batch of operations costs one io_uring_enter and completions are read without any system call
+	//  + files and buffers registered up front are looked up once, not on every operation
+	//  + a ring of provided buffers lets a multishot receive pick a buffer of its own for each datagram
+	//  + not thread safe: one thread submits and reaps
+
+	class IoRing
+	{
+	public:
+
+		IoRing()
+		{
+			fd = -1;
+			ring = NULL;
+			ring_size = 0;
+			submissions = NULL;
+			submissions_size = 0;
+			buffers = NULL;
+			buffers_size = 0;
+			buffer_entries = 0;
+			buffer_tail = 0;
+		}
+
+		~IoRing()
+		{
+			Close();
+		}
+
+		// room for "entries" submissions (a power of two) and "completions" completions (0: twice as many)
+
+		bool Open(unsigned int entries, unsigned int completions = 0)
+		{
+			assert(!IsOpen());
+			io_uring_params params;
+			memset(&params, 0, sizeof(params));
+			if (completions > 0)
+			{
+				params.flags |= IORING_SETUP_CQSIZE;
+				params.cq_entries = completions;
+			}
+
+			// completions are posted when this thread next enters the kernel, instead of interrupting it
+
+			params.flags |= IORING_SETUP_COOP_TASKRUN;
+			fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+			if (fd < 0 && errno == EINVAL)
+			{
+				params.flags &= ~IORING_SETUP_COOP_TASKRUN;
+				fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+			}
+			if (fd < 0)
+			{
+				fd = -1;
+				return false;
+			}
+			if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+			{
+				Close();
+				return false;
+			}
+
+			// the submission and completion rings share one mapping, the submission entries have their own
+
+			const size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+			const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			ring_size = sq_size > cq_size ? sq_size : cq_size;
+			void* mapped = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+			if (mapped == MAP_FAILED)
+			{
+				Close();
+				return false;
+			}
+			ring = (unsigned char*)mapped;
+			submissions_size = params.sq_entries * sizeof(io_uring_sqe);
+			mapped = mmap(NULL, submissions_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+			if (mapped == MAP_FAILED)
+			{
+				Close();
+				return false;
+			}
+			submissions = (io_uring_sqe*)mapped;
+
+			sq_head = (unsigned int*)(ring + params.sq_off.head);
+			sq_tail = (unsigned int*)(ring + params.sq_off.tail);
+			sq_mask = *(unsigned int*)(ring + params.sq_off.ring_mask);
+			sq_entries = params.sq_entries;
+			cq_head = (unsigned int*)(ring + params.cq_off.head);
+			cq_tail = (unsigned int*)(ring + params.cq_off.tail);
+			cq_mask = *(unsigned int*)(ring + params.cq_off.ring_mask);
+			completions_ring = (io_uring_cqe*)(ring + params.cq_off.cqes);
+
+			// submission i always uses entry i, the indirection array is filled once
+
+			unsigned int* array = (unsigned int*)(ring + params.sq_off.array);
+			for (unsigned int i = 0; i < sq_entries; ++i)
+				array[i] = i;
+			pending = 0;
+			return true;
+		}
+
+		// the kernel tears a ring down in the background once it is closed, so what is still running is cancelled
+		// first and the files and buffers are taken back here: nothing writes into the buffers afterwards, and a
+		// registered socket is really closed (its port free to bind again) when its owner closes it
+
+		void Close()
+		{
+			if (fd >= 0)
+			{
+				io_uring_sync_cancel_reg cancel;
+				memset(&cancel, 0, sizeof(cancel));
+				cancel.flags = IORING_ASYNC_CANCEL_ANY;
+				cancel.timeout.tv_sec = -1;
+				cancel.timeout.tv_nsec = -1;
+				syscall(__NR_io_uring_register, fd, IORING_REGISTER_SYNC_CANCEL, &cancel, 1);
+				syscall(__NR_io_uring_register, fd, IORING_UNREGISTER_FILES, NULL, 0);
+			}
+			if (fd >= 0 && buffers)
+			{
+				io_uring_buf_reg registration;
+				memset(&registration, 0, sizeof(registration));
+				registration.bgid = buffer_group;
+				syscall(__NR_io_uring_register, fd, IORING_UNREGISTER_PBUF_RING, &registration, 1);
+			}
+			if (fd >= 0)
+				close(fd);
+			fd = -1;
+			if (ring)
+				munmap(ring, ring_size);
+			ring = NULL;
+			if (submissions)
+				munmap(submissions, submissions_size);
+			submissions = NULL;
+			if (buffers)
+				munmap(buffers, buffers_size);
+			buffers = NULL;
+			buffer_entries = 0;
+		}
+
+		bool IsOpen() const
+		{
+			return fd >= 0;
+		}
+
+		// the next submission entry, cleared, or NULL while every entry is queued and not submitted yet
+
+		io_uring_sqe* GetSubmission()
+		{
+			assert(IsOpen());
+			const unsigned int tail = *sq_tail + pending;
+			if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+				return NULL;
+			io_uring_sqe* submission = &submissions[tail & sq_mask];
+			memset(submission, 0, sizeof(io_uring_sqe));
+			pending++;
+			return submission;
+		}
+
+		// hands the kernel what was queued, then waits until "wait" completions are ready or "timeout" seconds
+		// pass (no limit if negative). false on an error, not on a timeout or a signal
+
+		bool Submit(unsigned int wait = 0, double timeout = -1.0)
+		{
+			assert(IsOpen());
+			const unsigned int submitted = pending;
+			if (submitted > 0)
+				__atomic_store_n(sq_tail, *sq_tail + submitted, __ATOMIC_RELEASE);
+			pending = 0;
+			if (submitted == 0 && wait == 0)
+				return true;
+			unsigned int flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+			io_uring_getevents_arg arg;
+			timespec limit;
+			void* argument = NULL;
+			size_t argument_size = 0;
+			if (wait > 0 && timeout >= 0.0)
+			{
+				limit.tv_sec = (time_t)timeout;
+				limit.tv_nsec = (long)((timeout - (double)limit.tv_sec) * 1000000000.0);
+				memset(&arg, 0, sizeof(arg));
+				arg.ts = (uint64_t)(uintptr_t)&limit;
+				flags |= IORING_ENTER_EXT_ARG;
+				argument = &arg;
+				argument_size = sizeof(arg);
+			}
+			const int result = (int)syscall(__NR_io_uring_enter, fd, submitted, wait, flags, argument, argument_size);
+			return result >= 0 || errno == ETIME || errno == EINTR;
+		}
+
+		// the oldest completion not seen yet, or NULL. it stays valid until SeeCompletion
+
+		io_uring_cqe* PeekCompletion()
+		{
+			assert(IsOpen());
+			const unsigned int head = *cq_head;
+			if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+				return NULL;
+			return &completions_ring[head & cq_mask];
+		}
+
+		void SeeCompletion()
+		{
+			__atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+		}
+
+		unsigned int GetCompletionCount() const
+		{
+			return IsOpen() ? __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) - *cq_head : 0;
+		}
+
+		// files an operation then names by index, with IOSQE_FIXED_FILE
+
+		bool RegisterFiles(const int files[], unsigned int count)
+		{
+			return syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, files, count) == 0;
+		}
+
+		// buffers the fixed reads and writes name by index (buf_index), pinned while the ring is open
+
+		bool RegisterBuffers(const iovec vectors[], unsigned int count)
+		{
+			return syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, vectors, count) == 0;
+		}
+
+		// a ring of "entries" (a power of two) buffers for receives with IOSQE_BUFFER_SELECT in "group"
+
+		bool RegisterBufferRing(unsigned short group, unsigned int entries)
+		{
+			assert(!buffers);
+			assert(entries > 0 && (entries & (entries - 1)) == 0);
+			buffers_size = entries * sizeof(io_uring_buf);
+			void* mapped = mmap(NULL, buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+			if (mapped == MAP_FAILED)
+				return false;
+			io_uring_buf_reg registration;
+			memset(&registration, 0, sizeof(registration));
+			registration.ring_addr = (uint64_t)(uintptr_t)mapped;
+			registration.ring_entries = entries;
+			registration.bgid = group;
+			if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0)
+			{
+				munmap(mapped, buffers_size);
+				return false;
+			}
+			buffers = (io_uring_buf_ring*)mapped;
+			buffer_entries = entries;
+			buffer_group = group;
+			buffer_tail = 0;
+			return true;
+		}
+
+		// queues a buffer for the receives to pick, CommitBuffers makes the queued ones visible to the kernel
+
+		void ProvideBuffer(void* data, unsigned int size, unsigned short id)
+		{
+			assert(buffers);
+
+			// the entries are indexed by hand: in c++ the header's flexible array "bufs" lands 8 bytes too far in
+
+			io_uring_buf& buffer = ((io_uring_buf*)buffers)[buffer_tail & (buffer_entries - 1)];
+			buffer.addr = (uint64_t)(uintptr_t)data;
+			buffer.len = size;
+			buffer.bid = id;
+			buffer_tail++;
+		}
+
+		void CommitBuffers()
+		{
+			assert(buffers);
+			__atomic_store_n(&buffers->tail, buffer_tail, __ATOMIC_RELEASE);
+		}
+
+	private:
+
+		int fd;
+		unsigned char* ring;			// submission and completion ring headers, and the completions
+		size_t ring_size;
+		io_uring_sqe* submissions;
+		size_t submissions_size;
+		unsigned int* sq_head;
+		unsigned int* sq_tail;
+		unsigned int sq_mask;
+		unsigned int sq_entries;
+		unsigned int pending;			// entries handed out by GetSubmission and not submitted yet
+		unsigned int* cq_head;
+		unsigned int* cq_tail;
+		unsigned int cq_mask;
+		io_uring_cqe* completions_ring;
+		io_uring_buf_ring* buffers;		// provided buffers, NULL until RegisterBufferRing
+		size_t buffers_size;
+		unsigned int buffer_entries;
+		unsigned short buffer_group;
+		unsigned short buffer_tail;		// next entry ProvideBuffer fills
+	};
+}
+
+#endif
+
+#endif
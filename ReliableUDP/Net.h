@@ -26,13 +26,19 @@
 #if PLATFORM == PLATFORM_WINDOWS
 
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #pragma comment( lib, "wsock32.lib" )
 
 #elif PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 
 #else
 
@@ -44,11 +50,52 @@
 #include <vector>
 #include <map>
 #include <stack>
-#include <list>
 #include <algorithm>
 #include <functional>
+#include <chrono>
+#include <random>
+#include <memory>
 
-const int PacketSizeHack = 256 + 128;
+#include "IoRing.h"
+
+const int MaxDatagramSize = 9000 - 28;	// largest datagram we send: a 9000 byte jumbo frame minus IP and UDP headers
+const int BaseDatagramSize = 1200;		// datagram size assumed to fit every path until path mtu discovery finds more
+const int MaxBatchSize = 32;			// most datagrams moved by one batched send or receive
+const int SocketBufferSize = 4 * 1024 * 1024;	// kernel send/receive buffer asked for (the os may grant less)
+const int MaxOffloadSize = 65507;		// most udp payload bytes in one offloaded send, or one coalesced receive
+const int MaxOffloadSegments = 64;		// most datagrams the kernel splits one offloaded send into
+const int RingBufferCount = 64;			// buffers the io_uring receive keeps posted (NET_IO_URING, see IoRing.h)
+const int RingReceiveHeadroom = NET_IO_URING ? 64 : 0;	// room in front of each datagram for what the kernel puts there
+
+// sendmmsg / recvmmsg move a whole batch of datagrams per syscall, other platforms loop over sendto / recvfrom
+
+#if PLATFORM == PLATFORM_UNIX && defined(__linux__)
+#define NET_BATCH_SYSCALLS 1
+#else
+#define NET_BATCH_SYSCALLS 0
+#endif
+
+// SO_REUSEPORT lets several sockets bind one port, and linux spreads the datagrams over them by peer address.
+// elsewhere (or where it only shares the port without spreading the load) a server keeps one socket
+
+#if PLATFORM == PLATFORM_UNIX && defined(__linux__) && defined(SO_REUSEPORT)
+#define NET_REUSE_PORT 1
+#else
+#define NET_REUSE_PORT 0
+#endif
+
+// udp offload (linux 5.0 and later): a run of equally sized datagrams goes to the kernel as one buffer it splits
+// itself (UDP_SEGMENT), and datagrams of one peer that arrive together come back coalesced in one buffer along with
+// their size (UDP_GRO). each layer of the stack is then walked once per run instead of once per datagram.
+// define NET_UDP_OFFLOAD 0 to keep every datagram separate
+
+#ifndef NET_UDP_OFFLOAD
+#if NET_BATCH_SYSCALLS && defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define NET_UDP_OFFLOAD 1
+#else
+#define NET_UDP_OFFLOAD 0
+#endif
+#endif
 
 namespace net
 {
@@ -68,6 +115,207 @@ namespace net
 
 #endif
 
+	// keeps the calling thread on one core, so the sockets and sessions it owns stay in that core's caches
+
+	inline bool PinThread(int core)
+	{
+#if PLATFORM == PLATFORM_WINDOWS
+		return core < (int)sizeof(DWORD_PTR) * 8 && SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core) != 0;
+#elif PLATFORM == PLATFORM_UNIX && defined(__linux__)
+		cpu_set_t cores;
+		CPU_ZERO(&cores);
+		CPU_SET(core, &cores);
+		return pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores) == 0;
+#else
+		(void)core;
+		return false;
+#endif
+	}
+
+	// monotonic time in seconds (steady clock), used to timestamp packets
+
+	inline double GetTime()
+	{
+		return std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// a batch of equally sized packet buffers, allocated once and reused for every send and receive
+	//  + packet sizes are only known at runtime (path mtu), so staging lives on the heap instead of the stack
+	//  + the buffers are not cleared: the os only commits the pages that are written, so a connection that never
+	//    fills a whole batch of jumbo datagrams (most of a server's sessions) doesn't pay for one
+
+	class PacketBatch
+	{
+	public:
+
+		PacketBatch(int count, int packet_size)
+		{
+			assert(count > 0);
+			assert(packet_size > 0);
+			this->packet_size = packet_size;
+			data.reset(new unsigned char[(size_t)count * packet_size]);
+			pointers.resize(count);
+			for (int i = 0; i < count; ++i)
+				pointers[i] = &data[(size_t)i * packet_size];
+		}
+
+		unsigned char* operator[](int index)
+		{
+			assert(index >= 0 && index < (int)pointers.size());
+			return pointers[index];
+		}
+
+		// pointer to each buffer, in the form the batched send and receive functions take
+
+		unsigned char* const* GetPointers() const
+		{
+			return &pointers[0];
+		}
+
+		int GetPacketSize() const
+		{
+			return packet_size;
+		}
+
+		int GetCount() const
+		{
+			return (int)pointers.size();
+		}
+
+	private:
+
+		int packet_size;
+		std::unique_ptr<unsigned char[]> data;
+		std::vector<unsigned char*> pointers;
+	};
+
+	// fixed size packet buffers, recycled instead of freed
+	//  + a buffer is reference counted: a received datagram is handed on to a retransmission window slot by taking a
+	//    reference, not by copying it, and a buffer holding several coalesced datagrams is shared by their messages
+	//  + a buffer goes back to the pool it came from when its last reference is released, wherever that happens
+	//  + buffers are allocated a block at a time as they are first needed and only freed with the pool, so a busy
+	//    connection stops allocating once its working set is reached. the pool has to outlive its buffers
+	//  + not thread safe: a pool belongs to one connection, or to one session table and the connections attached to it
+
+	class PacketPool
+	{
+	public:
+
+		PacketPool(int buffer_size, int buffers_per_block = 64)
+		{
+			assert(buffer_size > 0);
+			assert(buffers_per_block > 0);
+			this->buffer_size = buffer_size;
+			this->buffers_per_block = buffers_per_block;
+			stride = HeaderSize + (buffer_size + HeaderSize - 1) / HeaderSize * HeaderSize;
+		}
+
+		// a buffer with one reference, the caller's
+
+		unsigned char* Acquire()
+		{
+			if (free_buffers.empty())
+			{
+				blocks.emplace_back(new unsigned char[(size_t)buffers_per_block * stride]);	// not cleared, see PacketBatch
+				unsigned char* block = blocks.back().get();
+				for (int i = buffers_per_block - 1; i >= 0; --i)
+				{
+					unsigned char* buffer = block + (size_t)i * stride + HeaderSize;
+					GetHeader(buffer)->pool = this;
+					free_buffers.push_back(buffer);
+				}
+			}
+			unsigned char* buffer = free_buffers.back();
+			free_buffers.pop_back();
+			GetHeader(buffer)->references = 1;
+			return buffer;
+		}
+
+		// makes "buffer" safe to write into again: if anyone else still holds it, it is let go and a fresh one taken
+
+		void Recycle(unsigned char*& buffer)
+		{
+			if (buffer && GetHeader(buffer)->references > 1)
+			{
+				Release(buffer);
+				buffer = NULL;
+			}
+			if (!buffer)
+				buffer = Acquire();
+		}
+
+		static void AddReference(unsigned char* buffer)
+		{
+			GetHeader(buffer)->references++;
+		}
+
+		static void Release(unsigned char* buffer)
+		{
+			if (!buffer)
+				return;
+			Header* header = GetHeader(buffer);
+			assert(header->references > 0);
+			if (--header->references == 0)
+				header->pool->free_buffers.push_back(buffer);
+		}
+
+		// size of the buffers of whichever pool "buffer" came from
+
+		static int GetBufferSize(const unsigned char* buffer)
+		{
+			return GetHeader(buffer)->pool->buffer_size;
+		}
+
+		int GetBufferSize() const
+		{
+			return buffer_size;
+		}
+
+		// buffers acquired and not released yet
+
+		int GetBuffersInUse() const
+		{
+			return (int)(blocks.size() * buffers_per_block - free_buffers.size());
+		}
+
+	private:
+
+		// kept just in front of each buffer, padded so the buffers stay 16 byte aligned
+		struct Header
+		{
+			PacketPool* pool;
+			int references;
+		};
+
+		static const int HeaderSize = 16;
+
+		static Header* GetHeader(const unsigned char* buffer)
+		{
+			return (Header*)(buffer - HeaderSize);
+		}
+
+		int buffer_size;
+		int buffers_per_block;
+		int stride;								// header and buffer, rounded up to a multiple of HeaderSize
+		std::vector<std::unique_ptr<unsigned char[]>> blocks;
+		std::vector<unsigned char*> free_buffers;
+	};
+
+	// a received packet left where it landed: "size" bytes, "offset" bytes into a pool buffer. it is only good until
+	// the next receive, unless the reader keeps it with a reference to the buffer
+
+	struct ReceivedPacket
+	{
+		unsigned char* buffer;
+		int offset;
+		int size;
+
+		const unsigned char* GetData() const
+		{
+			return buffer + offset;
+		}
+	};
+
 	// internet address
 
 	class Address
@@ -175,6 +423,14 @@ namespace net
 		Socket()
 		{
 			socket = 0;
+			segmentation = false;
+			coalescing = false;
+#if NET_IO_URING
+			ringPool = NULL;
+			ringArmed = false;
+			for (int i = 0; i < RingBufferCount; ++i)
+				ringBuffers[i] = NULL;
+#endif
 		}
 
 		~Socket()
@@ -182,7 +438,9 @@ namespace net
 			Close();
 		}
 
-		bool Open(unsigned short port)
+		// with sharePort several sockets can bind the same port (NET_REUSE_PORT), each gets its share of the peers
+
+		bool Open(unsigned short port, bool sharePort = false)
 		{
 			assert(!IsOpen());
 
@@ -197,6 +455,23 @@ namespace net
 				return false;
 			}
 
+			if (sharePort)
+			{
+#if NET_REUSE_PORT
+				int reusePort = 1;
+				if (setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &reusePort, sizeof(reusePort)) != 0)
+				{
+					printf("failed to share port %d\n", port);
+					Close();
+					return false;
+				}
+#else
+				printf("sharing a port is not supported on this platform\n");
+				Close();
+				return false;
+#endif
+			}
+
 			// bind to port
 
 			sockaddr_in address;
@@ -233,6 +508,35 @@ namespace net
 				return false;
 			}
 
+#endif
+
+			// big kernel buffers: with prompt acks the sender opens its window quickly, and a default
+			// sized receive buffer overflows long before the congestion controller sees any loss
+
+			int bufferSize = SocketBufferSize;
+			setsockopt(socket, SOL_SOCKET, SO_RCVBUF, (const char*)&bufferSize, sizeof(bufferSize));
+			setsockopt(socket, SOL_SOCKET, SO_SNDBUF, (const char*)&bufferSize, sizeof(bufferSize));
+
+			// segmentation offload is asked for per send (the segment size follows the path mtu), here it is only
+			// checked for. a kernel or device that turns it down later gets the datagrams one by one instead
+
+#if NET_UDP_OFFLOAD
+			int segment = 0;
+			segmentation = setsockopt(socket, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0;
+#endif
+
+			// never fragment: a datagram too large for the path is dropped (or refused locally), which path mtu probes rely on
+
+#if PLATFORM == PLATFORM_UNIX && defined(IP_MTU_DISCOVER)
+
+			int discover = IP_PMTUDISC_PROBE;
+			setsockopt(socket, IPPROTO_IP, IP_MTU_DISCOVER, &discover, sizeof(discover));
+
+#elif PLATFORM == PLATFORM_WINDOWS
+
+			DWORD dontFragment = 1;
+			setsockopt(socket, IPPROTO_IP, IP_DONTFRAGMENT, (const char*)&dontFragment, sizeof(dontFragment));
+
 #endif
 
 			return true;
@@ -240,6 +544,7 @@ namespace net
 
 		void Close()
 		{
+			DisableRing();
 			if (socket != 0)
 			{
 #if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
@@ -249,6 +554,8 @@ namespace net
 #endif
 				socket = 0;
 			}
+			segmentation = false;
+			coalescing = false;
 		}
 
 		bool IsOpen() const
@@ -256,6 +563,76 @@ namespace net
 			return socket != 0;
 		}
 
+		// from now on datagrams of one peer may come back from ReceiveBatch coalesced in one buffer, which then has
+		// to be MaxOffloadSize bytes. false if the platform can't, every datagram stays in a buffer of its own
+
+		bool EnableReceiveOffload()
+		{
+#if NET_UDP_OFFLOAD
+			int enable = 1;
+			if (!coalescing && socket != 0)
+				coalescing = setsockopt(socket, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0;
+#endif
+			return coalescing;
+		}
+
+		bool IsReceiveOffloadEnabled() const
+		{
+			return coalescing;
+		}
+
+		// the io_uring engine: one multishot receive keeps reading the socket into buffers from "pool", and the
+		// datagrams are then taken from the completion ring without a system call (ReceiveInPlace), while Wait
+		// sleeps in io_uring_enter instead of poll. call after EnableReceiveOffload. false if the kernel doesn't
+		// offer it, ReceiveBatch and Wait then stay on recvmmsg and poll. the pool has to outlive the socket
+
+		bool EnableRing(PacketPool* pool)
+		{
+#if NET_IO_URING
+			assert(pool && pool->GetBufferSize() > RingReceiveHeadroom);
+			if (ring.IsOpen() || socket == 0)
+				return ring.IsOpen();
+			if (!ring.Open(8, RingBufferCount * 2) || !ring.RegisterFiles(&socket, 1) || !ring.RegisterBufferRing(0, RingBufferCount))
+			{
+				ring.Close();
+				return false;
+			}
+			ringPool = pool;
+			for (int i = 0; i < RingBufferCount; ++i)
+			{
+				ringBuffers[i] = pool->Acquire();
+				ring.ProvideBuffer(ringBuffers[i], pool->GetBufferSize(), (unsigned short)i);
+			}
+			ring.CommitBuffers();
+
+			// every datagram lands behind a header, its sender and (with receive offload) its segment size
+
+			memset(&ringMessage, 0, sizeof(ringMessage));
+			ringMessage.msg_namelen = sizeof(sockaddr_in);
+			ringMessage.msg_controllen = coalescing ? CMSG_SPACE(sizeof(int)) : 0;
+			ringPayload = (int)(sizeof(io_uring_recvmsg_out) + ringMessage.msg_namelen + ringMessage.msg_controllen);
+			assert(ringPayload <= RingReceiveHeadroom);
+			if (!ArmRing())
+			{
+				DisableRing();
+				return false;
+			}
+			return true;
+#else
+			(void)pool;
+			return false;
+#endif
+		}
+
+		bool IsRingEnabled() const
+		{
+#if NET_IO_URING
+			return ring.IsOpen();
+#else
+			return false;
+#endif
+		}
+
 		bool Send(const Address& destination, const void* data, int size)
 		{
 			assert(data);
@@ -305,80 +682,482 @@ namespace net
 			return received_bytes;
 		}
 
-	private:
+		// sends a batch of datagrams to one destination. returns how many were sent (stops at the first failure).
+		// with segmentation offload a run of datagrams of one size (the last may be shorter) is a single message,
+		// its datagrams gathered straight from their buffers and split again by the kernel
 
-		int socket;
-	};
+		int SendBatch(const Address& destination, const unsigned char* const data[], const int sizes[], int count)
+		{
+			assert(data);
+			assert(sizes);
+			assert(count >= 0 && count <= MaxBatchSize);
 
-	// connection
+			if (socket == 0)
+				return 0;
 
-	class Connection
-	{
-	public:
+#if NET_BATCH_SYSCALLS
 
-		enum Mode
-		{
-			None,
-			Client,
-			Server
-		};
+			assert(destination.GetAddress() != 0);
+			assert(destination.GetPort() != 0);
 
-		Connection(unsigned int protocolId, float timeout)
-		{
-			this->protocolId = protocolId;
-			this->timeout = timeout;
-			mode = None;
-			running = false;
-			ClearData();
-		}
+			sockaddr_in address;
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(destination.GetAddress());
+			address.sin_port = htons((unsigned short)destination.GetPort());
 
-		virtual ~Connection()
-		{
-			if (IsRunning())
-				Stop();
-		}
+			iovec vectors[MaxBatchSize];
+			mmsghdr messages[MaxBatchSize];
+			int firsts[MaxBatchSize + 1];	// datagram each message starts with
+			int message_count = 0;
+#if NET_UDP_OFFLOAD
+			union
+			{
+				char buffer[CMSG_SPACE(sizeof(uint16_t))];
+				cmsghdr align;
+			} controls[MaxBatchSize];
+#endif
+			memset(messages, 0, sizeof(mmsghdr) * count);
+			for (int i = 0; i < count;)
+			{
+				int run = 1;
+#if NET_UDP_OFFLOAD
+				int bytes = sizes[i];
+				while (segmentation && i + run < count && run < MaxOffloadSegments && sizes[i + run - 1] == sizes[i] &&
+					sizes[i + run] <= sizes[i] && bytes + sizes[i + run] <= MaxOffloadSize)
+					bytes += sizes[i + run++];
+#endif
+				for (int j = i; j < i + run; ++j)
+				{
+					assert(sizes[j] > 0);
+					vectors[j].iov_base = (void*)data[j];
+					vectors[j].iov_len = sizes[j];
+				}
+				msghdr& message = messages[message_count].msg_hdr;
+				message.msg_name = &address;
+				message.msg_namelen = sizeof(sockaddr_in);
+				message.msg_iov = &vectors[i];
+				message.msg_iovlen = run;
+#if NET_UDP_OFFLOAD
+				if (run > 1)
+				{
+					message.msg_control = controls[message_count].buffer;
+					message.msg_controllen = sizeof(controls[message_count].buffer);
+					cmsghdr* control = CMSG_FIRSTHDR(&message);
+					control->cmsg_level = SOL_UDP;
+					control->cmsg_type = UDP_SEGMENT;
+					control->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+					const uint16_t segment = (uint16_t)sizes[i];
+					memcpy(CMSG_DATA(control), &segment, sizeof(segment));
+				}
+#endif
+				firsts[message_count++] = i;
+				i += run;
+			}
+			firsts[message_count] = count;
 
-		bool Start(int port)
-		{
-			assert(!running);
-			printf("start connection on port %d\n", port);
-			if (!socket.Open(port))
-				return false;
-			running = true;
-			OnStart();
-			return true;
-		}
+			// the kernel may take part of the batch, keep going until it is all out or it refuses
 
-		void Stop()
-		{
-			assert(running);
-			printf("stop connection\n");
-			bool connected = IsConnected();
-			ClearData();
-			socket.Close();
-			running = false;
-			if (connected)
-				OnDisconnect();
-			OnStop();
-		}
+			int sent = 0;
+			while (sent < message_count)
+			{
+				int result = sendmmsg(socket, messages + sent, message_count - sent, 0);
+				if (result <= 0)
+				{
+#if NET_UDP_OFFLOAD
+					// a device without checksum offload (EIO) or an older kernel turns a run down: send it unsplit
+					if (messages[sent].msg_hdr.msg_iovlen > 1 && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP))
+					{
+						segmentation = false;
+						return firsts[sent] + SendBatch(destination, data + firsts[sent], sizes + firsts[sent], count - firsts[sent]);
+					}
+#endif
+					break;
+				}
+				sent += result;
+			}
+			return firsts[sent];
 
-		bool IsRunning() const
-		{
-			return running;
-		}
+#else
 
-		void Listen()
-		{
-			printf("server listening for connection\n");
-			bool connected = IsConnected();
-			ClearData();
-			if (connected)
-				OnDisconnect();
-			mode = Server;
-			state = Listening;
+			for (int i = 0; i < count; ++i)
+			{
+				if (!Send(destination, data[i], sizes[i]))
+					return i;
+			}
+			return count;
+
+#endif
 		}
 
-		void Connect(const Address& address)
+		// receives up to count datagrams into buffers of "size" bytes each. returns how many were received.
+		// with receive offload a buffer may hold several datagrams of its sender back to back: "segments" gets the
+		// size of each (the last may be shorter), for a single datagram it is its own size
+
+		int ReceiveBatch(Address senders[], unsigned char* const data[], int size, int sizes[], int count, int segments[] = NULL)
+		{
+			assert(senders);
+			assert(data);
+			assert(sizes);
+			assert(size > 0);
+			assert(count >= 0 && count <= MaxBatchSize);
+			assert(!coalescing || (segments && size >= MaxOffloadSize));
+			assert(!IsRingEnabled());
+
+			if (socket == 0)
+				return 0;
+
+#if NET_BATCH_SYSCALLS
+
+			sockaddr_in from[MaxBatchSize];
+			iovec vectors[MaxBatchSize];
+			mmsghdr messages[MaxBatchSize];
+#if NET_UDP_OFFLOAD
+			union
+			{
+				char buffer[CMSG_SPACE(sizeof(int))];
+				cmsghdr align;
+			} controls[MaxBatchSize];
+#endif
+			memset(messages, 0, sizeof(mmsghdr) * count);
+			for (int i = 0; i < count; ++i)
+			{
+				vectors[i].iov_base = data[i];
+				vectors[i].iov_len = size;
+				messages[i].msg_hdr.msg_name = &from[i];
+				messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+				messages[i].msg_hdr.msg_iov = &vectors[i];
+				messages[i].msg_hdr.msg_iovlen = 1;
+#if NET_UDP_OFFLOAD
+				if (coalescing)
+				{
+					messages[i].msg_hdr.msg_control = controls[i].buffer;
+					messages[i].msg_hdr.msg_controllen = sizeof(controls[i].buffer);
+				}
+#endif
+			}
+
+			int received = recvmmsg(socket, messages, count, MSG_DONTWAIT, NULL);
+			if (received <= 0)
+				return 0;
+
+			for (int i = 0; i < received; ++i)
+			{
+				sizes[i] = (int)messages[i].msg_len;
+				senders[i] = Address(ntohl(from[i].sin_addr.s_addr), ntohs(from[i].sin_port));
+				if (segments)
+					segments[i] = coalescing ? ReadSegmentSize(messages[i].msg_hdr, sizes[i]) : sizes[i];
+			}
+			return received;
+
+#else
+
+			int received = 0;
+			while (received < count)
+			{
+				int bytes = Receive(senders[received], data[received], size);
+				if (bytes <= 0)
+					break;
+				if (segments)
+					segments[received] = bytes;
+				sizes[received++] = bytes;
+			}
+			return received;
+
+#endif
+		}
+
+		// with the ring: takes up to count datagrams the multishot receive has already placed in pool buffers. each
+		// buffer goes to data[i] in place of the one there (which is released), its datagram starts offsets[i] bytes
+		// in. sizes and segments as for ReceiveBatch. returns how many were taken
+
+		int ReceiveInPlace(Address senders[], unsigned char* data[], int offsets[], int sizes[], int segments[], int count)
+		{
+			assert(count >= 0 && count <= MaxBatchSize);
+#if NET_IO_URING
+			if (!ring.IsOpen())
+				return 0;
+			int received = 0;
+			bool provided = false;
+			io_uring_cqe* completion;
+			while (received < count && (completion = ring.PeekCompletion()) != NULL)
+			{
+				const int result = completion->res;
+				const unsigned int flags = completion->flags;
+				ring.SeeCompletion();
+				if (!(flags & IORING_CQE_F_MORE))
+					ringArmed = false;		// out of buffers (or an error) ended it, armed again below
+				if (!(flags & IORING_CQE_F_BUFFER))
+					continue;
+
+				// the kernel is done with this buffer, a fresh one takes its place in the ring
+
+				const unsigned short id = (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT);
+				unsigned char* buffer = ringBuffers[id];
+				ringBuffers[id] = ringPool->Acquire();
+				ring.ProvideBuffer(ringBuffers[id], ringPool->GetBufferSize(), id);
+				provided = true;
+
+				const io_uring_recvmsg_out* out = (const io_uring_recvmsg_out*)buffer;
+				if (result < ringPayload || out->payloadlen == 0 || (out->flags & MSG_TRUNC) || out->namelen < sizeof(sockaddr_in))
+				{
+					PacketPool::Release(buffer);
+					continue;
+				}
+				sockaddr_in from;
+				memcpy(&from, buffer + sizeof(io_uring_recvmsg_out), sizeof(from));
+				PacketPool::Release(data[received]);
+				data[received] = buffer;
+				offsets[received] = ringPayload;
+				sizes[received] = (int)out->payloadlen;
+				senders[received] = Address(ntohl(from.sin_addr.s_addr), ntohs(from.sin_port));
+				segments[received] = sizes[received];
+				if (coalescing)
+				{
+					msghdr message;
+					memset(&message, 0, sizeof(message));
+					message.msg_control = buffer + sizeof(io_uring_recvmsg_out) + ringMessage.msg_namelen;
+					message.msg_controllen = out->controllen;
+					segments[received] = ReadSegmentSize(message, sizes[received]);
+				}
+				received++;
+			}
+			if (provided)
+				ring.CommitBuffers();
+			if (!ringArmed)
+				ArmRing();
+			return received;
+#else
+			(void)senders; (void)data; (void)offsets; (void)sizes; (void)segments;
+			return 0;
+#endif
+		}
+
+		// blocks until a datagram is ready to read or the timeout (seconds) runs out. returns true if readable
+
+		bool Wait(float timeout)
+		{
+			if (socket == 0)
+				return false;
+
+#if NET_IO_URING
+			if (ring.IsOpen())
+			{
+				if (!ringArmed)
+					ArmRing();
+				if (ring.GetCompletionCount() == 0)
+					ring.Submit(1, timeout > 0.0f ? timeout : 0.0);
+				return ring.GetCompletionCount() > 0;
+			}
+#endif
+
+			int timeout_ms = timeout > 0.0f ? (int)(timeout * 1000.0f + 0.999f) : 0;
+
+#if PLATFORM == PLATFORM_WINDOWS
+			WSAPOLLFD descriptor;
+			descriptor.fd = socket;
+			descriptor.events = POLLRDNORM;
+			descriptor.revents = 0;
+			int result = WSAPoll(&descriptor, 1, timeout_ms);
+#else
+			pollfd descriptor;
+			descriptor.fd = socket;
+			descriptor.events = POLLIN;
+			descriptor.revents = 0;
+			int result = poll(&descriptor, 1, timeout_ms);
+#endif
+
+			return result > 0;
+		}
+
+	private:
+
+#if NET_BATCH_SYSCALLS
+
+		// the size of each datagram of a coalesced receive, from its UDP_GRO control message ("size" if none)
+
+		static int ReadSegmentSize(msghdr& message, int size)
+		{
+#if NET_UDP_OFFLOAD
+			for (cmsghdr* control = CMSG_FIRSTHDR(&message); control; control = CMSG_NXTHDR(&message, control))
+			{
+				if (control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO)
+				{
+					int segment = 0;
+					memcpy(&segment, CMSG_DATA(control), sizeof(segment));
+					if (segment > 0)
+						return segment;
+				}
+			}
+#else
+			(void)message;
+#endif
+			return size;
+		}
+
+#endif
+
+#if NET_IO_URING
+
+		// (re)starts the multishot receive on the registered socket
+
+		bool ArmRing()
+		{
+			io_uring_sqe* submission = ring.GetSubmission();
+			if (!submission)
+				return false;
+			submission->opcode = IORING_OP_RECVMSG;
+			submission->fd = 0;
+			submission->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+			submission->ioprio = IORING_RECV_MULTISHOT;
+			submission->addr = (uint64_t)(uintptr_t)&ringMessage;
+			submission->len = 1;
+			submission->buf_group = 0;
+			ringArmed = ring.Submit();
+			return ringArmed;
+		}
+
+#endif
+
+		// the ring goes first, so nothing lands in the buffers once they are back in the pool
+
+		void DisableRing()
+		{
+#if NET_IO_URING
+			ring.Close();
+			for (int i = 0; i < RingBufferCount; ++i)
+			{
+				PacketPool::Release(ringBuffers[i]);
+				ringBuffers[i] = NULL;
+			}
+			ringPool = NULL;
+			ringArmed = false;
+#endif
+		}
+
+		int socket;
+		bool segmentation;		// runs of datagrams go out as one send, split by the kernel (UDP_SEGMENT)
+		bool coalescing;		// a receive may return several datagrams of one sender (UDP_GRO)
+#if NET_IO_URING
+		IoRing ring;			// open while the io_uring engine reads the socket
+		PacketPool* ringPool;	// where the posted buffers come from
+		unsigned char* ringBuffers[RingBufferCount];	// posted to the ring, by buffer id
+		msghdr ringMessage;		// what the multishot receive fills in front of each datagram: sender, control data
+		int ringPayload;		// where the datagram starts in a ring buffer
+		bool ringArmed;			// the multishot receive is running
+#endif
+	};
+
+	// connection
+	//  + every datagram starts with the protocol id and a connection id the client picks at random when it connects
+	//  + a connection either owns its socket, or is attached to a socket it shares with others (the server's
+	//    sessions, see SessionTable), which hands it the datagrams from its peer
+
+	class Connection
+	{
+	public:
+
+		enum Mode
+		{
+			None,
+			Client,
+			Server
+		};
+
+		static const int ProtocolHeaderSize = 8;	// protocol id + connection id
+
+		Connection(unsigned int protocolId, float timeout, int max_packet_size = MaxDatagramSize)
+			: sendBatch(MaxBatchSize, max_packet_size), pool(std::make_shared<PacketPool>(max_packet_size))
+		{
+			assert(max_packet_size > ProtocolHeaderSize && max_packet_size <= MaxDatagramSize);
+			this->protocolId = protocolId;
+			this->timeout = timeout;
+			this->max_packet_size = max_packet_size;
+			mode = None;
+			running = false;
+			sharedSocket = NULL;
+			for (int i = 0; i < MaxBatchSize; ++i)
+				receiveBuffers[i] = NULL;
+			ClearData();
+		}
+
+		virtual ~Connection()
+		{
+			if (IsRunning())
+				Stop();
+			ReleaseReceiveBuffers();
+		}
+
+		bool Start(int port)
+		{
+			assert(!running);
+			printf("start connection on port %d\n", port);
+			if (!socket.Open(port))
+				return false;
+			const int size = (socket.EnableReceiveOffload() ? MaxOffloadSize : max_packet_size) + RingReceiveHeadroom;
+			if (pool->GetBufferSize() < size)
+				SetPacketPool(std::make_shared<PacketPool>(size));
+			socket.EnableRing(pool.get());
+			running = true;
+			OnStart();
+			return true;
+		}
+
+		// attaches the connection, already connected to "address", to a socket it doesn't own. it sends through
+		// that socket, and reads only what Deliver hands it. the datagrams handed over come from "sharedPool",
+		// which the connection then takes its buffers from as well
+
+		void Attach(Socket& shared, const Address& address, unsigned int connectionId, const std::shared_ptr<PacketPool>& sharedPool = nullptr)
+		{
+			assert(!running);
+			if (sharedPool)
+				SetPacketPool(sharedPool);
+			sharedSocket = &shared;
+			running = true;
+			OnStart();
+			ClearData();
+			mode = Server;
+			state = Connected;
+			this->address = address;
+			this->connectionId = connectionId;
+			OnConnect();
+		}
+
+		void Stop()
+		{
+			assert(running);
+			bool connected = IsConnected();
+			ClearData();
+			if (sharedSocket)
+				sharedSocket = NULL;
+			else
+			{
+				printf("stop connection\n");
+				socket.Close();
+				ReleaseReceiveBuffers();
+			}
+			running = false;
+			if (connected)
+				OnDisconnect();
+			OnStop();
+		}
+
+		bool IsRunning() const
+		{
+			return running;
+		}
+
+		void Listen()
+		{
+			printf("server listening for connection\n");
+			bool connected = IsConnected();
+			ClearData();
+			if (connected)
+				OnDisconnect();
+			mode = Server;
+			state = Listening;
+		}
+
+		void Connect(const Address& address)
 		{
 			printf("client connecting to %d.%d.%d.%d:%d\n",
 				address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort());
@@ -389,6 +1168,7 @@ namespace net
 			mode = Client;
 			state = Connecting;
 			this->address = address;
+			connectionId = NewConnectionId();
 		}
 
 		bool IsConnecting() const
@@ -416,6 +1196,16 @@ namespace net
 			return mode;
 		}
 
+		const Address& GetAddress() const
+		{
+			return address;
+		}
+
+		unsigned int GetConnectionId() const
+		{
+			return connectionId;
+		}
+
 		virtual void Update(float deltaTime)
 		{
 			assert(running);
@@ -443,94 +1233,357 @@ namespace net
 		virtual bool SendPacket(const unsigned char data[], int size)
 		{
 			assert(running);
+			assert(size <= max_packet_size - ProtocolHeaderSize);
 			if (address.GetAddress() == 0)
 				return false;
-			unsigned char packet[PacketSizeHack + 4];
-			packet[0] = (unsigned char)(protocolId >> 24);
-			packet[1] = (unsigned char)((protocolId >> 16) & 0xFF);
-			packet[2] = (unsigned char)((protocolId >> 8) & 0xFF);
-			packet[3] = (unsigned char)((protocolId) & 0xFF);
-			std::memcpy(&packet[4], data, size);
-			return socket.Send(address, packet, size + 4);
+			unsigned char* packet = sendBatch[0];
+			WriteProtocolHeader(packet);
+			std::memcpy(&packet[ProtocolHeaderSize], data, size);
+			return GetSocket().Send(address, packet, size + ProtocolHeaderSize);
 		}
 
 		virtual int ReceivePacket(unsigned char data[], int size)
+		{
+			unsigned char* const packets[1] = { data };
+			int sizes[1] = { 0 };
+			return Connection::ReceivePackets(packets, sizes, size, 1) > 0 ? sizes[0] : 0;
+		}
+
+		// batched versions of SendPacket / ReceivePacket: one syscall moves up to MaxBatchSize packets
+
+		virtual int SendPackets(const unsigned char* const data[], const int sizes[], int count)
 		{
 			assert(running);
-			unsigned char packet[PacketSizeHack + 4];
-			Address sender;
-			int bytes_read = socket.Receive(sender, packet, size + 4);
-			if (bytes_read == 0)
-				return 0;
-			if (bytes_read <= 4)
+			assert(count <= MaxBatchSize);
+			if (address.GetAddress() == 0)
 				return 0;
-			if (packet[0] != (unsigned char)(protocolId >> 24) ||
-				packet[1] != (unsigned char)((protocolId >> 16) & 0xFF) ||
-				packet[2] != (unsigned char)((protocolId >> 8) & 0xFF) ||
-				packet[3] != (unsigned char)(protocolId & 0xFF))
+			int batch_sizes[MaxBatchSize];
+			for (int i = 0; i < count; ++i)
+			{
+				assert(sizes[i] <= max_packet_size - ProtocolHeaderSize);
+				unsigned char* packet = sendBatch[i];
+				WriteProtocolHeader(packet);
+				std::memcpy(&packet[ProtocolHeaderSize], data[i], sizes[i]);
+				batch_sizes[i] = sizes[i] + ProtocolHeaderSize;
+			}
+			return GetSocket().SendBatch(address, sendBatch.GetPointers(), batch_sizes, count);
+		}
+
+		// SendPackets without the copy: each packet has ProtocolHeaderSize bytes of headroom in front of it, the
+		// protocol header is written there and the datagram goes out straight from the caller's buffer
+
+		int SendPacketsInPlace(unsigned char* const packets[], const int sizes[], int count)
+		{
+			assert(running);
+			assert(count <= MaxBatchSize);
+			if (address.GetAddress() == 0)
 				return 0;
-			if (mode == Server && !IsConnected())
+			const unsigned char* datagrams[MaxBatchSize];
+			int batch_sizes[MaxBatchSize];
+			for (int i = 0; i < count; ++i)
 			{
-				printf("server accepts connection from client %d.%d.%d.%d:%d\n",
-					sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort());
-				state = Connected;
-				address = sender;
-				OnConnect();
+				assert(sizes[i] <= max_packet_size - ProtocolHeaderSize);
+				unsigned char* datagram = packets[i] - ProtocolHeaderSize;
+				WriteProtocolHeader(datagram);
+				datagrams[i] = datagram;
+				batch_sizes[i] = sizes[i] + ProtocolHeaderSize;
 			}
-			if (sender == address)
+			return GetSocket().SendBatch(address, datagrams, batch_sizes, count);
+		}
+
+		// fills data[0..n-1] and sizes[0..n-1] with the packets accepted from one batch and returns n.
+		// datagrams from other senders or protocols are dropped, so n can be less than the number read
+
+		virtual int ReceivePackets(unsigned char* const data[], int sizes[], int size, int count)
+		{
+			ReceivedPacket packets[MaxBatchSize];
+			int received = ReceivePacketsInPlace(packets, count);
+			int accepted = 0;
+			for (int i = 0; i < received; ++i)
 			{
-				if (mode == Client && state == Connecting)
+				if (packets[i].size > size)
+					continue;
+				std::memcpy(data[accepted], packets[i].GetData(), packets[i].size);
+				sizes[accepted++] = packets[i].size;
+			}
+			return accepted;
+		}
+
+		// ReceivePackets without the copy: the packets stay in the pool buffers they were received into, and the
+		// next receive reuses those buffers (unless a reader kept a reference). a buffer of datagrams the socket
+		// coalesced is split by their size here; what doesn't fit in "packets" is handed out by the next call
+
+		int ReceivePacketsInPlace(ReceivedPacket packets[], int count)
+		{
+			assert(running);
+			assert(count <= MaxBatchSize);
+			int accepted = 0;
+			bool read = false;
+			while (accepted < count)
+			{
+				if (delivered_read == delivered_count)
 				{
-					printf("client completes connection with server\n");
-					state = Connected;
-					OnConnect();
+					// one socket read per call, and only before anything is handed out: it reuses the buffers
+					if (sharedSocket || read || accepted > 0 || !ReceiveBatch())
+						break;
+					read = true;
+					continue;
+				}
+				DeliveredPacket& packet = delivered[delivered_read];
+				const int offset = packet.offset;
+				const int bytes = std::min(packet.segment, packet.end - offset);
+				packet.offset += bytes;
+				if (packet.offset >= packet.end)
+					delivered_read++;
+				if (bytes <= max_packet_size && AcceptPacket(packet.sender, packet.buffer + offset, bytes))
+				{
+					packets[accepted].buffer = packet.buffer;
+					packets[accepted].offset = offset + ProtocolHeaderSize;
+					packets[accepted].size = bytes - ProtocolHeaderSize;
+					accepted++;
 				}
-				timeoutAccumulator = 0.0f;
-				memcpy(data, &packet[4], bytes_read - 4);
-				return bytes_read - 4;
 			}
-			return 0;
+			return accepted;
 		}
 
-		int GetHeaderSize() const
+		// hands an attached connection "size" bytes the shared socket received from its peer, "offset" bytes into the
+		// buffer: one datagram, or several of "segment" bytes (the last may be shorter) coalesced by receive offload.
+		// they are not copied, so the buffer has to stay as it is until ReceivePacket(s) has read them (the
+		// connection may take a reference to keep it longer). false once MaxBatchSize buffers are waiting
+
+		bool Deliver(unsigned char* buffer, int offset, int size, int segment)
 		{
-			return 4;
+			assert(sharedSocket);
+			assert(segment > 0);
+			if (delivered_read == delivered_count)
+				delivered_read = delivered_count = 0;
+			if (delivered_count == MaxBatchSize)
+				return false;
+			DeliveredPacket& packet = delivered[delivered_count++];
+			packet.buffer = buffer;
+			packet.sender = address;
+			packet.end = offset + size;
+			packet.segment = segment;
+			packet.offset = offset;
+			return true;
 		}
 
-	protected:
-
-		virtual void OnStart() {}
-		virtual void OnStop() {}
-		virtual void OnConnect() {}
-		virtual void OnDisconnect() {}
+		const std::shared_ptr<PacketPool>& GetPacketPool() const
+		{
+			return pool;
+		}
 
-	private:
+		// forgets delivered datagrams that were not read (their buffer is about to be reused)
 
-		void ClearData()
+		void ClearDelivered()
 		{
-			state = Disconnected;
-			timeoutAccumulator = 0.0f;
-			address = Address();
+			delivered_read = delivered_count = 0;
 		}
 
-		enum State
+		// largest datagram this connection sends or accepts, header included
+
+		int GetMaxPacketSize() const
 		{
-			Disconnected,
-			Listening,
-			Connecting,
-			ConnectFail,
-			Connected
-		};
+			return max_packet_size;
+		}
 
-		unsigned int protocolId;
+		int GetHeaderSize() const
+		{
+			return ProtocolHeaderSize;
+		}
+
+		// sleeps until a packet arrives or the timeout (seconds) runs out, so receives are handled as soon as they land.
+		// an attached connection doesn't wait, the owner of the socket does
+
+		bool WaitForPacket(float timeout)
+		{
+			assert(running);
+			if (sharedSocket || delivered_read < delivered_count)
+				return delivered_read < delivered_count;
+			return socket.Wait(timeout);
+		}
+
+		// the connection id of a datagram, 0 if it is too short to carry a payload or belongs to another protocol
+
+		static unsigned int ReadConnectionId(const unsigned char packet[], int size, unsigned int protocolId)
+		{
+			if (size <= ProtocolHeaderSize)
+				return 0;
+			if (packet[0] != (unsigned char)(protocolId >> 24) ||
+				packet[1] != (unsigned char)((protocolId >> 16) & 0xFF) ||
+				packet[2] != (unsigned char)((protocolId >> 8) & 0xFF) ||
+				packet[3] != (unsigned char)(protocolId & 0xFF))
+				return 0;
+			return ((unsigned int)packet[4] << 24) | ((unsigned int)packet[5] << 16) |
+				((unsigned int)packet[6] << 8) | (unsigned int)packet[7];
+		}
+
+	protected:
+
+		virtual void OnStart() {}
+		virtual void OnStop() {}
+		virtual void OnConnect() {}
+		virtual void OnDisconnect() {}
+
+		// the pool received packets land in, set while stopped. the buffers taken from the old one go back first
+
+		virtual void SetPacketPool(const std::shared_ptr<PacketPool>& packetPool)
+		{
+			assert(!running);
+			assert(packetPool && packetPool->GetBufferSize() >= max_packet_size);
+			ReleaseReceiveBuffers();
+			pool = packetPool;
+		}
+
+	private:
+
+		// random and never 0, so a client that reconnects from the same port is told apart from its last connection
+
+		static unsigned int NewConnectionId()
+		{
+			static std::mt19937 generator(std::random_device{}());
+			unsigned int id = 0;
+			while (id == 0)
+				id = (unsigned int)generator();
+			return id;
+		}
+
+		Socket& GetSocket()
+		{
+			return sharedSocket ? *sharedSocket : socket;
+		}
+
+		void WriteProtocolHeader(unsigned char packet[]) const
+		{
+			packet[0] = (unsigned char)(protocolId >> 24);
+			packet[1] = (unsigned char)((protocolId >> 16) & 0xFF);
+			packet[2] = (unsigned char)((protocolId >> 8) & 0xFF);
+			packet[3] = (unsigned char)((protocolId) & 0xFF);
+			packet[4] = (unsigned char)(connectionId >> 24);
+			packet[5] = (unsigned char)((connectionId >> 16) & 0xFF);
+			packet[6] = (unsigned char)((connectionId >> 8) & 0xFF);
+			packet[7] = (unsigned char)((connectionId) & 0xFF);
+		}
+
+		// checks the protocol id, connection id and sender of a received datagram, the payload is left where it is
+
+		bool AcceptPacket(const Address& sender, const unsigned char packet[], int bytes_read)
+		{
+			unsigned int id = ReadConnectionId(packet, bytes_read, protocolId);
+			if (id == 0)
+				return false;
+			if (mode == Server && !IsConnected())
+			{
+				printf("server accepts connection from client %d.%d.%d.%d:%d\n",
+					sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort());
+				state = Connected;
+				address = sender;
+				connectionId = id;
+				OnConnect();
+			}
+			if (sender == address && id == connectionId)
+			{
+				if (mode == Client && state == Connecting)
+				{
+					printf("client completes connection with server\n");
+					state = Connected;
+					OnConnect();
+				}
+				timeoutAccumulator = 0.0f;
+				return true;
+			}
+			return false;
+		}
+
+		// reads a batch from the connection's own socket into the delivered list, false if nothing came in
+
+		bool ReceiveBatch()
+		{
+			Address senders[MaxBatchSize];
+			int offsets[MaxBatchSize];
+			int sizes[MaxBatchSize];
+			int segments[MaxBatchSize];
+			int received;
+			if (socket.IsRingEnabled())
+				received = socket.ReceiveInPlace(senders, receiveBuffers, offsets, sizes, segments, MaxBatchSize);
+			else
+			{
+				for (int i = 0; i < MaxBatchSize; ++i)
+					pool->Recycle(receiveBuffers[i]);
+				const int size = socket.IsReceiveOffloadEnabled() ? pool->GetBufferSize() : std::min(max_packet_size, pool->GetBufferSize());
+				received = socket.ReceiveBatch(senders, receiveBuffers, size, sizes, MaxBatchSize, segments);
+				for (int i = 0; i < received; ++i)
+					offsets[i] = 0;
+			}
+			delivered_read = delivered_count = 0;
+			for (int i = 0; i < received; ++i)
+			{
+				DeliveredPacket& packet = delivered[delivered_count++];
+				packet.buffer = receiveBuffers[i];
+				packet.sender = senders[i];
+				packet.end = offsets[i] + sizes[i];
+				packet.segment = segments[i] > 0 ? segments[i] : sizes[i];
+				packet.offset = offsets[i];
+			}
+			return received > 0;
+		}
+
+		void ReleaseReceiveBuffers()
+		{
+			for (int i = 0; i < MaxBatchSize; ++i)
+			{
+				PacketPool::Release(receiveBuffers[i]);
+				receiveBuffers[i] = NULL;
+			}
+			delivered_read = delivered_count = 0;
+		}
+
+		void ClearData()
+		{
+			state = Disconnected;
+			timeoutAccumulator = 0.0f;
+			address = Address();
+			connectionId = 0;
+			delivered_read = delivered_count = 0;
+		}
+
+		enum State
+		{
+			Disconnected,
+			Listening,
+			Connecting,
+			ConnectFail,
+			Connected
+		};
+
+		// a received buffer still being split into datagrams
+		struct DeliveredPacket
+		{
+			unsigned char* buffer;
+			Address sender;
+			int end;				// where its datagrams end in the buffer
+			int segment;			// size of each datagram in it, the last may be shorter
+			int offset;				// where the next datagram starts
+		};
+
+		unsigned int protocolId;
 		float timeout;
 
 		bool running;
 		Mode mode;
 		State state;
 		Socket socket;
+		Socket* sharedSocket;			// set while attached, the socket belongs to someone else
 		float timeoutAccumulator;
 		Address address;
+		unsigned int connectionId;
+		int max_packet_size;
+		PacketBatch sendBatch;			// staging for outgoing datagrams
+		std::shared_ptr<PacketPool> pool;	// where incoming datagrams land, shared with the session table when attached
+		unsigned char* receiveBuffers[MaxBatchSize];	// taken from the pool (or the socket's ring) as batches come in
+		DeliveredPacket delivered[MaxBatchSize];	// received (or handed over when attached), not read yet
+		int delivered_count;
+		int delivered_read;
 	};
 
 	// packet queue to store information about sent and received packets sorted in sequence order
@@ -539,7 +1592,7 @@ namespace net
 	struct PacketData
 	{
 		unsigned int sequence;			// packet sequence number
-		float time;					    // time offset since packet was sent or received (depending on context)
+		double time;					// time the packet was sent or received (depending on context), from GetTime
 		int size;						// packet size in bytes
 	};
 
@@ -553,62 +1606,291 @@ namespace net
 			);
 	}
 
-	class PacketQueue : public std::list<PacketData>
+	inline unsigned int sequence_difference(unsigned int newer, unsigned int older, unsigned int max_sequence)
+	{
+		return newer >= older ? newer - older : newer + (max_sequence - older) + 1;
+	}
+
+	// fixed capacity ring buffer of packet data indexed by sequence
+	//  + each sequence maps to slot (sequence % capacity), slots are tagged with the sequence they hold
+	//  + insert, lookup and remove by sequence are O(1), and nothing is allocated after construction
+	//  + front is the oldest sequence held, entries are visited from front to back in sequence order
+	//  + the capacity is a power of two that divides max_sequence + 1 (or is larger than it) so slot order follows sequence order across wrap
+
+	const unsigned int DefaultPacketQueueCapacity = 16384;
+
+	class PacketQueue
 	{
 	public:
 
-		bool exists(unsigned int sequence)
+		PacketQueue(unsigned int capacity = DefaultPacketQueueCapacity, unsigned int max_sequence = 0xFFFFFFFF)
 		{
-			for (iterator itor = begin(); itor != end(); ++itor)
-				if (itor->sequence == sequence)
-					return true;
-			return false;
+			assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+			assert(((max_sequence + 1) & (capacity - 1)) == 0 || max_sequence < capacity);
+			this->capacity = capacity;
+			this->max_sequence = max_sequence;
+			max_span = capacity < max_sequence / 2 ? capacity : max_sequence / 2;
+			slots.resize(capacity);
+			clear();
+		}
+
+		void clear()
+		{
+			for (size_t i = 0; i < slots.size(); ++i)
+				slots[i].valid = false;
+			count = 0;
+			head = 0;
+			tail = 0;
+		}
+
+		bool empty() const
+		{
+			return count == 0;
+		}
+
+		size_t size() const
+		{
+			return count;
+		}
+
+		bool exists(unsigned int sequence) const
+		{
+			return find(sequence) != NULL;
+		}
+
+		PacketData* find(unsigned int sequence)
+		{
+			Slot& slot = slots[sequence & (capacity - 1)];
+			return slot.valid && slot.data.sequence == sequence ? &slot.data : NULL;
+		}
+
+		const PacketData* find(unsigned int sequence) const
+		{
+			const Slot& slot = slots[sequence & (capacity - 1)];
+			return slot.valid && slot.data.sequence == sequence ? &slot.data : NULL;
+		}
+
+		// true if the sequence can be inserted without the queue spanning more than capacity sequences
+		// (or half the sequence space, past which "more recent" is ambiguous)
+
+		bool fits(unsigned int sequence) const
+		{
+			if (empty())
+				return true;
+			if (sequence_more_recent(sequence, tail, max_sequence))
+				return sequence_difference(sequence, head, max_sequence) < max_span;
+			if (sequence_more_recent(head, sequence, max_sequence))
+				return sequence_difference(tail, sequence, max_sequence) < max_span;
+			return true;
 		}
 
-		void insert_sorted(const PacketData& p, unsigned int max_sequence)
+		// inserts in sequence order, returns false if the sequence is already held or doesn't fit (pop_front to make room)
+
+		bool insert(const PacketData& p)
 		{
+			assert(p.sequence <= max_sequence);
+			if (!fits(p.sequence) || exists(p.sequence))
+				return false;
 			if (empty())
 			{
-				push_back(p);
+				head = p.sequence;
+				tail = p.sequence;
 			}
-			else
+			else if (sequence_more_recent(p.sequence, tail, max_sequence))
+				tail = p.sequence;
+			else if (sequence_more_recent(head, p.sequence, max_sequence))
+				head = p.sequence;
+			Slot& slot = slots[p.sequence & (capacity - 1)];
+			slot.data = p;
+			slot.valid = true;
+			count++;
+			return true;
+		}
+
+		bool remove(unsigned int sequence)
+		{
+			Slot& slot = slots[sequence & (capacity - 1)];
+			if (!slot.valid || slot.data.sequence != sequence)
+				return false;
+			slot.valid = false;
+			count--;
+			if (sequence == head)
+				AdvanceHead();
+			return true;
+		}
+
+		PacketData& front()
+		{
+			assert(!empty());
+			return slots[head & (capacity - 1)].data;
+		}
+
+		void pop_front()
+		{
+			assert(!empty());
+			slots[head & (capacity - 1)].valid = false;
+			count--;
+			AdvanceHead();
+		}
+
+		unsigned int get_capacity() const
+		{
+			return capacity;
+		}
+
+		// visits entries from front to back
+
+		class iterator
+		{
+		public:
+
+			iterator(PacketQueue* queue, unsigned int sequence, size_t remaining)
+				: queue(queue), sequence(sequence), remaining(remaining)
 			{
-				if (!sequence_more_recent(p.sequence, front().sequence, max_sequence))
-				{
-					push_front(p);
-				}
-				else if (sequence_more_recent(p.sequence, back().sequence, max_sequence))
-				{
-					push_back(p);
-				}
-				else
-				{
-					for (PacketQueue::iterator itor = begin(); itor != end(); itor++)
-					{
-						assert(itor->sequence != p.sequence);
-						if (sequence_more_recent(itor->sequence, p.sequence, max_sequence))
-						{
-							insert(itor, p);
-							break;
-						}
-					}
-				}
+				SkipEmpty();
+			}
+
+			PacketData& operator*() const { return queue->slots[sequence & (queue->capacity - 1)].data; }
+			PacketData* operator->() const { return &**this; }
+			bool operator==(const iterator& other) const { return remaining == other.remaining; }
+			bool operator!=(const iterator& other) const { return remaining != other.remaining; }
+
+			iterator& operator++()
+			{
+				remaining--;
+				sequence = next_sequence(sequence, queue->max_sequence);
+				SkipEmpty();
+				return *this;
+			}
+
+		private:
+
+			void SkipEmpty()
+			{
+				while (remaining > 0 && queue->find(sequence) == NULL)
+					sequence = next_sequence(sequence, queue->max_sequence);
 			}
+
+			PacketQueue* queue;
+			unsigned int sequence;
+			size_t remaining;
+		};
+
+		iterator begin()
+		{
+			return iterator(this, head, count);
+		}
+
+		iterator end()
+		{
+			return iterator(this, head, 0);
 		}
 
 		void verify_sorted(unsigned int max_sequence)
 		{
-			PacketQueue::iterator prev = end();
-			for (PacketQueue::iterator itor = begin(); itor != end(); itor++)
+			bool first = true;
+			unsigned int prev = 0;
+			size_t visited = 0;
+			for (iterator itor = begin(); itor != end(); ++itor)
 			{
 				assert(itor->sequence <= max_sequence);
-				if (prev != end())
-				{
-					assert(sequence_more_recent(itor->sequence, prev->sequence, max_sequence));
-					prev = itor;
-				}
+				if (!first)
+					assert(sequence_more_recent(itor->sequence, prev, max_sequence));
+				prev = itor->sequence;
+				first = false;
+				visited++;
+			}
+			assert(visited == count);
+		}
+
+	private:
+
+		static unsigned int next_sequence(unsigned int sequence, unsigned int max_sequence)
+		{
+			return sequence == max_sequence ? 0 : sequence + 1;
+		}
+
+		// moves head forward to the next valid slot, skipping holes left by remove (amortized O(1))
+
+		void AdvanceHead()
+		{
+			if (count == 0)
+			{
+				head = tail;
+				return;
 			}
+			do
+			{
+				head = next_sequence(head, max_sequence);
+			} while (!exists(head));
+		}
+
+		struct Slot
+		{
+			PacketData data;
+			bool valid;
+		};
+
+		unsigned int capacity;
+		unsigned int max_sequence;
+		unsigned int max_span;		// most sequences from head to tail
+		std::vector<Slot> slots;
+		size_t count;				// number of valid slots
+		unsigned int head;			// oldest sequence held (when not empty)
+		unsigned int tail;			// newest sequence inserted (when not empty)
+	};
+
+	// congestion control interface
+	//  + a controller sees what the reliability system reported each update (acked bytes, lost bytes, rtt)
+	//  + it answers with a congestion window (bytes allowed in flight) and a pacing rate (bytes per second)
+	//  + implementations live in CongestionControl.h, the reliable connection only knows this interface
+
+	struct CongestionSample
+	{
+		int acked_bytes;		// bytes newly acked since the last update
+		int lost_bytes;			// bytes declared lost since the last update
+		int bytes_in_flight;	// bytes sent and neither acked nor lost
+		float rtt;				// smoothed round trip time (seconds)
+		float min_rtt_sample;	// smallest raw round trip time measured since the last update (0 if nothing was acked)
+		double time;
+	};
+
+	class CongestionControl
+	{
+	public:
+
+		virtual ~CongestionControl() {}
+
+		virtual const char* GetName() const = 0;
+
+		virtual void Reset() = 0;
+
+		virtual void Update(const CongestionSample& sample) = 0;
+
+		virtual double GetCongestionWindow() const = 0;
+
+		virtual double GetPacingRate() const = 0;
+
+		// datagram size the window is counted in, set once path mtu discovery has settled
+
+		void SetPacketSize(int packet_size)
+		{
+			this->packet_size = packet_size;
+		}
+
+		int GetPacketSize() const
+		{
+			return packet_size;
+		}
+
+	protected:
+
+		CongestionControl()
+		{
+			packet_size = BaseDatagramSize;
 		}
+
+		int packet_size;
 	};
 
 	// reliability system to support reliable connection
@@ -619,7 +1901,9 @@ namespace net
 	{
 	public:
 
-		ReliabilitySystem(unsigned int max_sequence = 0xFFFFFFFF)
+		ReliabilitySystem(unsigned int max_sequence = 0xFFFFFFFF, unsigned int queue_capacity = DefaultPacketQueueCapacity)
+			: sentQueue(queue_capacity, max_sequence), pendingAckQueue(queue_capacity, max_sequence),
+			  receivedQueue(queue_capacity, max_sequence), ackedQueue(queue_capacity, max_sequence)
 		{
 			this->rtt_maximum = rtt_maximum;
 			this->max_sequence = max_sequence;
@@ -634,6 +1918,15 @@ namespace net
 			receivedQueue.clear();
 			pendingAckQueue.clear();
 			ackedQueue.clear();
+			sent_queue_bytes = 0;
+			acked_queue_bytes = 0;
+			bytes_in_flight = 0;
+			acked_bytes = 0;
+			lost_bytes = 0;
+			min_rtt_sample = 0.0f;
+			largest_acked = 0;
+			has_acked = false;
+			reordering_allowance = 0;
 			sent_packets = 0;
 			recv_packets = 0;
 			lost_packets = 0;
@@ -656,10 +1949,16 @@ namespace net
 			assert(!pendingAckQueue.exists(local_sequence));
 			PacketData data;
 			data.sequence = local_sequence;
-			data.time = 0.0f;
+			data.time = GetTime();
 			data.size = size;
-			sentQueue.push_back(data);
-			pendingAckQueue.push_back(data);
+			while (!sentQueue.fits(data.sequence))
+				PopSentQueue();
+			while (!pendingAckQueue.fits(data.sequence))
+				PopPendingAckQueue();
+			sentQueue.insert(data);
+			sent_queue_bytes += size;
+			pendingAckQueue.insert(data);
+			bytes_in_flight += size;
 			sent_packets++;
 			local_sequence++;
 			if (local_sequence > max_sequence)
@@ -673,9 +1972,11 @@ namespace net
 				return;
 			PacketData data;
 			data.sequence = sequence;
-			data.time = 0.0f;
+			data.time = GetTime();
 			data.size = size;
-			receivedQueue.push_back(data);
+			while (!receivedQueue.fits(sequence) && sequence_more_recent(sequence, receivedQueue.front().sequence, max_sequence))
+				receivedQueue.pop_front();
+			receivedQueue.insert(data);		// fails only for a packet too old to be acked anyway
 			if (sequence_more_recent(sequence, remote_sequence, max_sequence))
 				remote_sequence = sequence;
 		}
@@ -685,15 +1986,59 @@ namespace net
 			return generate_ack_bits(GetRemoteSequence(), receivedQueue, max_sequence);
 		}
 
-		void ProcessAck(unsigned int ack, unsigned int ack_bits)
+		// acks the packet "ack" and the 32 packets before it whose bits are set, each one is a direct lookup
+
+		// ack_delay is how long the peer held the ack for "ack" before sending it, it is taken off that rtt sample
+
+		void ProcessAck(unsigned int ack, unsigned int ack_bits, float ack_delay = 0.0f)
 		{
-			process_ack(ack, ack_bits, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, max_sequence);
+			if (pendingAckQueue.empty())
+				return;
+
+			unsigned int sequence = ack;
+			for (int bit_index = -1; bit_index < 32; ++bit_index)
+			{
+				if (bit_index >= 0)
+				{
+					sequence = sequence == 0 ? max_sequence : sequence - 1;
+					if (((ack_bits >> bit_index) & 1) == 0)
+						continue;
+				}
+
+				PacketData* data = pendingAckQueue.find(sequence);
+				if (!data)
+					continue;
+
+				float rtt_sample = (float)(GetTime() - data->time);
+				if (bit_index < 0 && rtt_sample > ack_delay)
+					rtt_sample -= ack_delay;
+				rtt += (rtt_sample - rtt) * 0.1f;
+				if (min_rtt_sample == 0.0f || rtt_sample < min_rtt_sample)
+					min_rtt_sample = rtt_sample;
+				if (!has_acked || sequence_more_recent(sequence, largest_acked, max_sequence))
+					largest_acked = sequence;
+				has_acked = true;
+
+				while (!ackedQueue.fits(sequence) && sequence_more_recent(sequence, ackedQueue.front().sequence, max_sequence))
+					PopAckedQueue();
+				if (ackedQueue.insert(*data))
+					acked_queue_bytes += data->size;
+				acks.push_back(sequence);
+				acked_packets++;
+				acked_bytes += data->size;
+				bytes_in_flight -= data->size;
+				pendingAckQueue.remove(sequence);
+			}
 		}
 
-		void Update(float deltaTime)
+		// packets carry timestamps, so there is no per-packet aging here: only expired entries at the front are touched
+
+		void Update()
 		{
 			acks.clear();
-			AdvanceQueueTime(deltaTime);
+			acked_bytes = 0;
+			lost_bytes = 0;
+			min_rtt_sample = 0.0f;
 			UpdateQueues();
 			UpdateStats();
 #ifdef NET_UNIT_TEST
@@ -739,229 +2084,1624 @@ namespace net
 		static unsigned int generate_ack_bits(unsigned int ack, const PacketQueue& received_queue, unsigned int max_sequence)
 		{
 			unsigned int ack_bits = 0;
-			for (PacketQueue::const_iterator itor = received_queue.begin(); itor != received_queue.end(); itor++)
+			unsigned int sequence = ack;
+			for (int bit_index = 0; bit_index < 32; ++bit_index)
 			{
-				if (itor->sequence == ack || sequence_more_recent(itor->sequence, ack, max_sequence))
-					break;
-				int bit_index = bit_index_for_sequence(itor->sequence, ack, max_sequence);
-				if (bit_index <= 31)
-					ack_bits |= 1 << bit_index;
+				sequence = sequence == 0 ? max_sequence : sequence - 1;
+				if (received_queue.exists(sequence))
+					ack_bits |= 1u << bit_index;
 			}
 			return ack_bits;
 		}
 
-		static void process_ack(unsigned int ack, unsigned int ack_bits,
-			PacketQueue& pending_ack_queue, PacketQueue& acked_queue,
-			std::vector<unsigned int>& acks, unsigned int& acked_packets,
-			float& rtt, unsigned int max_sequence)
-		{
-			if (pending_ack_queue.empty())
-				return;
+		// data accessors
 
-			PacketQueue::iterator itor = pending_ack_queue.begin();
-			while (itor != pending_ack_queue.end())
-			{
-				bool acked = false;
+		unsigned int GetLocalSequence() const
+		{
+			return local_sequence;
+		}
 
-				if (itor->sequence == ack)
-				{
-					acked = true;
-				}
-				else if (!sequence_more_recent(itor->sequence, ack, max_sequence))
+		unsigned int GetRemoteSequence() const
+		{
+			return remote_sequence;
+		}
+
+		unsigned int GetMaxSequence() const
+		{
+			return max_sequence;
+		}
+
+		void GetAcks(unsigned int** acks, int& count)
+		{
+			*acks = this->acks.empty() ? NULL : &this->acks[0];
+			count = (int)this->acks.size();
+		}
+
+		unsigned int GetSentPackets() const
+		{
+			return sent_packets;
+		}
+
+		unsigned int GetReceivedPackets() const
+		{
+			return recv_packets;
+		}
+
+		unsigned int GetLostPackets() const
+		{
+			return lost_packets;
+		}
+
+		unsigned int GetAckedPackets() const
+		{
+			return acked_packets;
+		}
+
+		float GetSentBandwidth() const
+		{
+			return sent_bandwidth;
+		}
+
+		float GetAckedBandwidth() const
+		{
+			return acked_bandwidth;
+		}
+
+		float GetRoundTripTime() const
+		{
+			return rtt;
+		}
+
+		// packets after one that may be acked before it, on top of PacketThreshold, before it counts as lost.
+		// forward error correction raises this so a packet that is rebuilt from a repair is acked, not lost
+
+		void SetReorderingAllowance(unsigned int packets)
+		{
+			reordering_allowance = packets;
+		}
+
+		// what happened since the last update, for congestion control (cleared each update, like the acks)
+
+		void GetCongestionSample(CongestionSample& sample) const
+		{
+			sample.acked_bytes = acked_bytes;
+			sample.lost_bytes = lost_bytes;
+			sample.bytes_in_flight = bytes_in_flight;
+			sample.rtt = rtt;
+			sample.min_rtt_sample = min_rtt_sample;
+			sample.time = GetTime();
+		}
+
+		int GetBytesInFlight() const
+		{
+			return bytes_in_flight;
+		}
+
+		int GetHeaderSize() const
+		{
+			return 12;
+		}
+
+	protected:
+
+		void UpdateQueues()
+		{
+			const float epsilon = 0.001f;
+			const double time = GetTime();
+
+			while (sentQueue.size() && time - sentQueue.front().time > rtt_maximum + epsilon)
+				PopSentQueue();
+
+			if (receivedQueue.size())
+			{
+				const unsigned int latest_sequence = remote_sequence;
+				const unsigned int minimum_sequence = latest_sequence >= 34 ? (latest_sequence - 34) : max_sequence - (34 - latest_sequence);
+				while (receivedQueue.size() && !sequence_more_recent(receivedQueue.front().sequence, minimum_sequence, max_sequence))
+					receivedQueue.pop_front();
+			}
+
+			while (ackedQueue.size() && time - ackedQueue.front().time > rtt_maximum * 2 - epsilon)
+				PopAckedQueue();
+
+			// a packet is lost once it times out, or once a packet sent PacketThreshold (plus the reordering allowance) later has been acked
+
+			const unsigned int PacketThreshold = 3;
+			while (pendingAckQueue.size() && time - pendingAckQueue.front().time > rtt_maximum + epsilon)
+				PopPendingAckQueue();
+			while (pendingAckQueue.size() && has_acked &&
+				   sequence_more_recent(largest_acked, pendingAckQueue.front().sequence, max_sequence) &&
+				   sequence_difference(largest_acked, pendingAckQueue.front().sequence, max_sequence) >= PacketThreshold + reordering_allowance)
+				PopPendingAckQueue();
+		}
+
+		// bandwidth comes from running byte totals kept as packets enter and leave the queues
+
+		void UpdateStats()
+		{
+			float sent_bytes_per_second = sent_queue_bytes / rtt_maximum;
+			float acked_bytes_per_second = acked_queue_bytes / (rtt_maximum * 2);
+			sent_bandwidth = sent_bytes_per_second * (8 / 1000.0f);
+			acked_bandwidth = acked_bytes_per_second * (8 / 1000.0f);
+		}
+
+		void PopSentQueue()
+		{
+			sent_queue_bytes -= sentQueue.front().size;
+			sentQueue.pop_front();
+		}
+
+		void PopAckedQueue()
+		{
+			acked_queue_bytes -= ackedQueue.front().size;
+			ackedQueue.pop_front();
+		}
+
+		// the packet at the front of the pending ack queue is given up on as lost
+
+		void PopPendingAckQueue()
+		{
+			bytes_in_flight -= pendingAckQueue.front().size;
+			lost_bytes += pendingAckQueue.front().size;
+			lost_packets++;
+			pendingAckQueue.pop_front();
+		}
+
+	private:
+
+		unsigned int max_sequence;			// maximum sequence value before wrap around (used to test sequence wrap at low # values)
+		unsigned int local_sequence;		// local sequence number for most recently sent packet
+		unsigned int remote_sequence;		// remote sequence number for most recently received packet
+
+		unsigned int sent_packets;			// total number of packets sent
+		unsigned int recv_packets;			// total number of packets received
+		unsigned int lost_packets;			// total number of packets lost
+		unsigned int acked_packets;			// total number of packets acked
+
+		float sent_bandwidth;				// approximate sent bandwidth over the last second
+		float acked_bandwidth;				// approximate acked bandwidth over the last second
+		float rtt;							// estimated round trip time
+		float rtt_maximum;					// maximum expected round trip time (hard coded to one second for the moment)
+		unsigned int sent_queue_bytes;		// bytes of the packets currently in sentQueue
+		unsigned int acked_queue_bytes;		// bytes of the packets currently in ackedQueue
+		int bytes_in_flight;				// bytes of the packets currently in pendingAckQueue
+		int acked_bytes;					// bytes acked since the last update
+		int lost_bytes;						// bytes declared lost since the last update
+		float min_rtt_sample;				// smallest raw rtt sample since the last update (0 if none)
+		unsigned int largest_acked;			// most recent sequence acked
+		bool has_acked;
+		unsigned int reordering_allowance;	// extra packets on top of PacketThreshold
+
+		std::vector<unsigned int> acks;		// acked packets from last set of packet receives. cleared each update!
+
+		PacketQueue sentQueue;				// sent packets used to calculate sent bandwidth (kept until rtt_maximum)
+		PacketQueue pendingAckQueue;		// sent packets which have not been acked yet (kept until rtt_maximum * 2 )
+		PacketQueue receivedQueue;			// received packets for determining acks to send (kept up to most recent recv sequence - 32)
+		PacketQueue ackedQueue;				// acked packets (kept until rtt_maximum * 2)
+	};
+
+	// sliding window retransmission (selective repeat) built on the packet acks from the reliability system
+	//  + each message gets a message id and is kept in the send window until a packet carrying it is acked
+	//  + a message is resent in a new packet when its retransmission timeout expires, or as soon as
+	//    three packets sent after it have been acked (duplicate ack signal)
+	//  + the receiving side buffers out of order messages and hands them out in message id order
+	//  + a queued message lives in a send pool buffer, behind "headroom" free bytes where the sender writes its headers
+	//    in place. the caller can build it there (ReserveMessage, CommitMessage) so it is never copied, a resend goes out
+	//    of the same buffer again, and the buffer goes back to the pool once the message has left the window
+	//  + a received message is not copied at all: its slot keeps a reference to the pool buffer it arrived in.
+	//    one that has to wait for an earlier message is moved to a buffer of its own size if it would otherwise hold
+	//    on to a much larger one (see CompactHeldMessages)
+
+	class RetransmissionSystem
+	{
+	public:
+
+		RetransmissionSystem(int window_size = 256, int max_message_size = BaseDatagramSize, unsigned int max_sequence = 0xFFFFFFFF, int headroom = 0)
+			: sendPool(headroom + max_message_size), compactPool(max_message_size, 16)
+		{
+			assert(window_size > 0 && (window_size & (window_size - 1)) == 0);
+			assert(headroom >= 0);
+			this->window_size = window_size;
+			this->max_message_size = max_message_size;
+			this->max_sequence = max_sequence;
+			this->headroom = headroom;
+			delivered_buffer = NULL;
+			sendSlots.resize(window_size);
+			receiveSlots.resize(window_size);
+			packetMessages.resize(window_size * 4);
+			resendList.reserve(window_size);
+			Reset();
+		}
+
+		~RetransmissionSystem()
+		{
+			ReleaseBuffers();
+		}
+
+		void Reset()
+		{
+			ReleaseBuffers();
+			send_base = 0;
+			next_message_id = 0;
+			receive_base = 0;
+			buffered_messages = 0;
+			rto = MinimumRTO;
+			highest_acked_sequence = 0;
+			have_acked_sequence = false;
+			resent_messages = 0;
+			reordering_allowance = 0;
+			for (size_t i = 0; i < sendSlots.size(); ++i)
+				sendSlots[i] = SendSlot();
+			for (size_t i = 0; i < receiveSlots.size(); ++i)
+				receiveSlots[i] = ReceiveSlot();
+			for (size_t i = 0; i < packetMessages.size(); ++i)
+				packetMessages[i] = PacketMessage();
+			resendList.clear();
+		}
+
+		bool CanSend() const
+		{
+			return next_message_id - send_base < (unsigned int)window_size;
+		}
+
+		// copies a new message into the send window and returns its message id
+
+		unsigned int QueueMessage(const unsigned char data[], int size)
+		{
+			unsigned char* message = ReserveMessage();
+			std::memcpy(message, data, size);
+			return CommitMessage(message, size);
+		}
+
+		// a buffer of max_message_size bytes (with headroom in front) to build the next message in. it is handed back
+		// with CommitMessage or CancelMessage, on this thread, but may be filled on another one in between
+
+		unsigned char* ReserveMessage()
+		{
+			return sendPool.Acquire() + headroom;
+		}
+
+		// stores a message built in a reserved buffer in the send window, without copying it, and returns its message id
+
+		unsigned int CommitMessage(unsigned char* message, int size)
+		{
+			assert(CanSend());
+			assert(size > 0 && size <= max_message_size);
+			unsigned int id = next_message_id++;
+			SendSlot& slot = sendSlots[id & (window_size - 1)];
+			slot.id = id;
+			slot.buffer = message - headroom;
+			slot.size = size;
+			slot.sent = false;
+			slot.acked = false;
+			slot.retries = 0;
+			return id;
+		}
+
+		// gives a reserved buffer back unsent
+
+		void CancelMessage(unsigned char* message)
+		{
+			PacketPool::Release(message - headroom);
+		}
+
+		const unsigned char* GetMessageData(unsigned int id, int& size) const
+		{
+			const SendSlot& slot = sendSlots[id & (window_size - 1)];
+			assert(slot.id == id);
+			size = slot.size;
+			return GetSendBuffer(id);
+		}
+
+		// the queued message with "headroom" bytes in front of it the caller may write its headers to
+
+		unsigned char* GetMessageBuffer(unsigned int id, int& size)
+		{
+			const SendSlot& slot = sendSlots[id & (window_size - 1)];
+			assert(slot.id == id);
+			size = slot.size;
+			return GetSendBuffer(id);
+		}
+
+		// records that a message went out (again) in the packet with this sequence number
+
+		void MessageSent(unsigned int id, unsigned int packet_sequence)
+		{
+			SendSlot& slot = sendSlots[id & (window_size - 1)];
+			assert(slot.id == id);
+			slot.packet_sequence = packet_sequence;
+			slot.send_time = GetTime();
+			slot.sent = true;
+			PacketMessage& entry = packetMessages[packet_sequence % packetMessages.size()];
+			entry.sequence = packet_sequence;
+			entry.message_id = id;
+			entry.valid = true;
+		}
+
+		void ProcessAcks(const unsigned int* acks, int count)
+		{
+			for (int i = 0; i < count; ++i)
+			{
+				unsigned int sequence = acks[i];
+				if (!have_acked_sequence || sequence_more_recent(sequence, highest_acked_sequence, max_sequence))
 				{
-					int bit_index = bit_index_for_sequence(itor->sequence, ack, max_sequence);
-					if (bit_index <= 31)
-						acked = (ack_bits >> bit_index) & 1;
+					highest_acked_sequence = sequence;
+					have_acked_sequence = true;
 				}
+				PacketMessage& entry = packetMessages[sequence % packetMessages.size()];
+				if (!entry.valid || entry.sequence != sequence)
+					continue;
+				entry.valid = false;
+				if (entry.message_id - send_base >= next_message_id - send_base)
+					continue;	// acked through an earlier packet and already out of the window
+				SendSlot& slot = sendSlots[entry.message_id & (window_size - 1)];
+				if (slot.id == entry.message_id)
+					slot.acked = true;
+			}
+			while (send_base != next_message_id && sendSlots[send_base & (window_size - 1)].acked)
+			{
+				SendSlot& slot = sendSlots[send_base & (window_size - 1)];
+				PacketPool::Release(slot.buffer);
+				slot.buffer = NULL;
+				send_base++;
+			}
+		}
 
-				if (acked)
-				{
-					rtt += (itor->time - rtt) * 0.1f;
+		// packets after a message that may be acked before it, on top of DuplicateAckThreshold, before it is resent.
+		// forward error correction raises this so a lost message can be rebuilt before it is sent again
+
+		void SetReorderingAllowance(unsigned int packets)
+		{
+			reordering_allowance = packets;
+		}
 
-					acked_queue.insert_sorted(*itor, max_sequence);
-					acks.push_back(itor->sequence);
-					acked_packets++;
-					itor = pending_ack_queue.erase(itor);
+		// works out which messages are due to be resent, see GetResendList
+
+		void Update(float rtt)
+		{
+			const double time = GetTime();
+			rto = rtt * 2.0f + MinimumRTO;
+			if (rto > MaximumRTO)
+				rto = MaximumRTO;
+			resendList.clear();
+			for (unsigned int id = send_base; id != next_message_id; ++id)
+			{
+				SendSlot& slot = sendSlots[id & (window_size - 1)];
+				if (slot.acked)
+					continue;
+				if (!slot.sent)
+				{
+					resendList.push_back(id);
+					continue;
 				}
-				else
-					++itor;
+				const int backoff = slot.retries < 4 ? slot.retries : 4;
+				const bool timed_out = time - slot.send_time > rto * (1 << backoff);
+				const bool duplicate_acks = have_acked_sequence && sequence_more_recent(highest_acked_sequence, slot.packet_sequence, max_sequence) &&
+					sequence_difference(highest_acked_sequence, slot.packet_sequence, max_sequence) >= DuplicateAckThreshold + reordering_allowance;
+				if (timed_out || duplicate_acks)
+				{
+					if (timed_out)
+						slot.retries++;
+					resendList.push_back(id);
+					resent_messages++;
+				}
+			}
+		}
+
+		const std::vector<unsigned int>& GetResendList() const
+		{
+			return resendList;
+		}
+
+		// buffers a received message, "size" bytes at "offset" in a pool buffer the slot takes a reference to.
+		// returns false for duplicates and messages outside the window
+
+		bool MessageReceived(unsigned int id, unsigned char* buffer, int offset, int size)
+		{
+			if (id - receive_base >= (unsigned int)window_size || size <= 0 || size > max_message_size)
+				return false;
+			ReceiveSlot& slot = receiveSlots[id & (window_size - 1)];
+			if (slot.id == id && (slot.valid || slot.delivered))
+				return false;
+			slot.id = id;
+			slot.size = size;
+			slot.valid = true;
+			slot.delivered = false;
+			slot.buffer = buffer;
+			slot.offset = offset;
+			PacketPool::AddReference(buffer);
+			buffered_messages++;
+			return true;
+		}
+
+		// moves the messages still buffered (waiting for an earlier one) out of receive buffers more than twice their
+		// size, e.g. one of several datagrams the socket coalesced, so they don't keep the whole buffer from the pool.
+		// meant for when the socket has been drained: until then they are usually read right away
+
+		void CompactHeldMessages()
+		{
+			if (buffered_messages == 0)
+				return;
+			for (size_t i = 0; i < receiveSlots.size(); ++i)
+			{
+				ReceiveSlot& slot = receiveSlots[i];
+				if (!slot.valid || PacketPool::GetBufferSize(slot.buffer) <= 2 * compactPool.GetBufferSize())
+					continue;
+				unsigned char* buffer = compactPool.Acquire();
+				std::memcpy(buffer, slot.buffer + slot.offset, slot.size);
+				PacketPool::Release(slot.buffer);
+				slot.buffer = buffer;
+				slot.offset = 0;
+			}
+		}
+
+		// the next message in order, NULL if it hasn't arrived yet. it stays valid until the next read
+
+		const unsigned char* ReadMessage(int& size)
+		{
+			ReleaseDelivered();
+			ReceiveSlot& slot = receiveSlots[receive_base & (window_size - 1)];
+			if (!slot.valid || slot.id != receive_base)
+				return NULL;
+			return DeliverMessage(slot, size);
+		}
+
+		// the oldest buffered message even if earlier ones are still missing, NULL if none is waiting.
+		// messages handed out ahead of time are remembered, so they are neither delivered again nor block ReadMessage
+
+		const unsigned char* ReadAnyMessage(int& size)
+		{
+			ReleaseDelivered();
+			if (buffered_messages == 0)
+				return NULL;
+			for (unsigned int id = receive_base; id != receive_base + (unsigned int)window_size; ++id)
+			{
+				ReceiveSlot& slot = receiveSlots[id & (window_size - 1)];
+				if (slot.valid && slot.id == id)
+					return DeliverMessage(slot, size);
 			}
+			return NULL;
 		}
 
 		// data accessors
 
-		unsigned int GetLocalSequence() const
+		int GetMessagesInFlight() const
 		{
-			return local_sequence;
+			return (int)(next_message_id - send_base);
 		}
 
-		unsigned int GetRemoteSequence() const
+		unsigned int GetResentMessages() const
+		{
+			return resent_messages;
+		}
+
+		// total number of messages queued (the id the next one gets)
+
+		unsigned int GetQueuedMessages() const
+		{
+			return next_message_id;
+		}
+
+		float GetRetransmissionTimeout() const
+		{
+			return rto;
+		}
+
+		int GetMaxMessageSize() const
+		{
+			return max_message_size;
+		}
+
+		int GetHeadroom() const
+		{
+			return headroom;
+		}
+
+	private:
+
+		const float MinimumRTO = 0.1f;
+		const float MaximumRTO = 2.0f;
+		const unsigned int DuplicateAckThreshold = 3;
+
+		struct SendSlot
+		{
+			unsigned int id = 0;
+			unsigned char* buffer = NULL;		// send pool buffer the message is in, headroom first
+			unsigned int packet_sequence = 0;	// packet that most recently carried this message
+			double send_time = 0.0;
+			int size = 0;
+			int retries = 0;					// timeouts so far, backs off the rto
+			bool sent = false;
+			bool acked = false;
+		};
+
+		struct ReceiveSlot
+		{
+			unsigned int id = 0;
+			unsigned char* buffer = NULL;	// pool buffer the message is in, referenced until it is read
+			int offset = 0;				// where in the buffer the message starts
+			int size = 0;
+			bool valid = false;			// buffered, waiting to be read
+			bool delivered = false;		// already read (possibly ahead of receive_base)
+		};
+
+		struct PacketMessage
+		{
+			unsigned int sequence = 0;
+			unsigned int message_id = 0;
+			bool valid = false;
+		};
+
+		unsigned char* GetSendBuffer(unsigned int id) const
+		{
+			return sendSlots[id & (window_size - 1)].buffer + headroom;
+		}
+
+		// hands a buffered message out (its buffer is held until the next read) and moves receive_base past everything already delivered
+
+		const unsigned char* DeliverMessage(ReceiveSlot& slot, int& size)
+		{
+			const unsigned char* message = slot.buffer + slot.offset;
+			size = slot.size;
+			delivered_buffer = slot.buffer;
+			slot.buffer = NULL;
+			slot.valid = false;
+			slot.delivered = true;
+			buffered_messages--;
+			while (true)
+			{
+				const ReceiveSlot& base = receiveSlots[receive_base & (window_size - 1)];
+				if (base.id != receive_base || !base.delivered)
+					break;
+				receive_base++;
+			}
+			return message;
+		}
+
+		void ReleaseDelivered()
+		{
+			PacketPool::Release(delivered_buffer);
+			delivered_buffer = NULL;
+		}
+
+		// gives every queued and received message buffer back to its pool
+
+		void ReleaseBuffers()
+		{
+			ReleaseDelivered();
+			for (size_t i = 0; i < sendSlots.size(); ++i)
+			{
+				PacketPool::Release(sendSlots[i].buffer);
+				sendSlots[i].buffer = NULL;
+			}
+			for (size_t i = 0; i < receiveSlots.size(); ++i)
+			{
+				PacketPool::Release(receiveSlots[i].buffer);
+				receiveSlots[i].buffer = NULL;
+			}
+		}
+
+		int window_size;						// maximum number of unacked messages (power of two)
+		int max_message_size;
+		unsigned int max_sequence;
+		int headroom;							// free bytes in front of each queued message, for headers
+
+		unsigned int send_base;					// oldest unacked message id
+		unsigned int next_message_id;			// id given to the next queued message
+		unsigned int receive_base;				// next message id to hand out in order
+		int buffered_messages;					// received messages not read yet
+
+		float rto;								// current retransmission timeout
+		unsigned int highest_acked_sequence;	// most recent packet sequence acked by the other side
+		bool have_acked_sequence;
+		unsigned int resent_messages;			// total number of message retransmissions
+		unsigned int reordering_allowance;		// extra packets on top of DuplicateAckThreshold
+
+		std::vector<SendSlot> sendSlots;
+		std::vector<ReceiveSlot> receiveSlots;
+		PacketPool sendPool;					// buffers of the queued messages, and those reserved to build one in
+		PacketPool compactPool;					// message sized buffers for the messages CompactHeldMessages moves
+		unsigned char* delivered_buffer;		// buffer of the message read last, released with the next read
+		std::vector<PacketMessage> packetMessages;	// packet sequence -> message id for packets in flight
+		std::vector<unsigned int> resendList;
+	};
+
+	// packetization layer path mtu discovery (in the spirit of RFC 8899)
+	//  + starts from a base size every path is assumed to carry, then probes larger datagrams padded with a probe frame
+	//  + a probe is confirmed when the packet carrying it is acked, and the size fails after MaxProbes tries go unacked
+	//  + the common ethernet and jumbo frame sizes are tried first, then a binary search closes the remaining gap
+	//  + sockets never fragment, so an oversized probe is simply dropped (or refused by the local interface at once)
+
+	class PathMtuDiscovery
+	{
+	public:
+
+		PathMtuDiscovery(int base_size = BaseDatagramSize, int max_size = MaxDatagramSize)
+		{
+			assert(base_size > 0 && base_size <= max_size);
+			this->base_size = base_size;
+			this->max_size = max_size;
+			Reset();
+		}
+
+		void Reset()
+		{
+			confirmed_size = base_size;
+			failed_size = max_size + 1;
+			probe_size = 0;
+			probe_sequence = 0;
+			probe_count = 0;
+			probe_time = 0.0;
+			in_flight = false;
+			searching = false;
+		}
+
+		void Start()
+		{
+			Reset();
+			searching = true;
+			probe_size = NextProbeSize();
+			if (probe_size == 0)
+				searching = false;
+		}
+
+		// size of the next probe to send, 0 while a probe is in flight or when there is nothing left to search
+
+		int GetProbeSize() const
+		{
+			return searching && !in_flight ? probe_size : 0;
+		}
+
+		void ProbeSent(unsigned int sequence, double time)
+		{
+			assert(searching);
+			probe_sequence = sequence;
+			probe_time = time;
+			probe_count++;
+			in_flight = true;
+		}
+
+		// the local interface refused the datagram: it is too big, no need to wait for a timeout
+
+		void ProbeRefused()
+		{
+			assert(searching);
+			Failed();
+		}
+
+		void ProcessAcks(const unsigned int acks[], int count)
+		{
+			if (!in_flight)
+				return;
+			for (int i = 0; i < count; ++i)
+			{
+				if (acks[i] == probe_sequence)
+				{
+					confirmed_size = probe_size;
+					Next();
+					return;
+				}
+			}
+		}
+
+		// a probe that goes unacked for two round trips (plus ack delay) is counted as lost
+
+		void Update(double time, float rtt)
+		{
+			const double ProbeAckDelay = 0.1;
+			if (!in_flight)
+				return;
+			const double timeout = 2.0 * rtt + ProbeAckDelay;
+			if (time - probe_time < timeout)
+				return;
+			in_flight = false;
+			if (probe_count >= MaxProbes)
+				Failed();
+		}
+
+		bool IsSearching() const
+		{
+			return searching;
+		}
+
+		// largest datagram known to get through, header included
+
+		int GetPathMtu() const
+		{
+			return confirmed_size;
+		}
+
+	private:
+
+		static const int MaxProbes = 3;
+		static const int SearchGranularity = 32;
+
+		void Failed()
+		{
+			failed_size = probe_size;
+			Next();
+		}
+
+		void Next()
+		{
+			in_flight = false;
+			probe_count = 0;
+			probe_size = NextProbeSize();
+			if (probe_size == 0)
+				searching = false;
+		}
+
+		int NextProbeSize() const
+		{
+			const int common_sizes[] = { 1500 - 28, 9000 - 28 };	// ethernet, jumbo frames
+			for (size_t i = 0; i < sizeof(common_sizes) / sizeof(common_sizes[0]); ++i)
+			{
+				if (common_sizes[i] > confirmed_size && common_sizes[i] < failed_size && common_sizes[i] <= max_size)
+					return common_sizes[i];
+			}
+			if (failed_size - confirmed_size <= SearchGranularity)
+				return 0;
+			return (confirmed_size + failed_size) / 2;
+		}
+
+		int base_size;
+		int max_size;
+		int confirmed_size;			// largest size acked so far
+		int failed_size;			// smallest size known not to get through
+		int probe_size;				// size being probed
+		unsigned int probe_sequence;	// packet sequence of the probe in flight
+		int probe_count;			// tries at the current size
+		double probe_time;
+		bool in_flight;
+		bool searching;
+	};
+
+	// decides when the receiving side sends an ack-only packet
+	//  + acks are coalesced: one ack covers every packet since the last one (ack + 32 bits)
+	//  + an ack goes out once AckEveryPackets packets arrived, or MaxAckDelay after the first of them
+	//  + a packet out of order (a gap, or a late packet filling one) is acked at once, so loss is reported quickly
+	//  + any packet we send carries the same ack fields, so sending one resets the schedule
+
+	class AckScheduler
+	{
+	public:
+
+		AckScheduler(int ack_every = 4, float max_delay = 0.005f)
+		{
+			this->ack_every = ack_every;
+			this->max_delay = max_delay;
+			Reset();
+		}
+
+		void Reset()
+		{
+			pending = 0;
+			first_pending_time = 0.0;
+			last_received_time = 0.0;
+			immediate = false;
+		}
+
+		void PacketReceived(bool in_order, double time)
+		{
+			if (pending == 0)
+				first_pending_time = time;
+			pending++;
+			last_received_time = time;
+			if (!in_order)
+				immediate = true;
+		}
+
+		void AckSent()
+		{
+			pending = 0;
+			immediate = false;
+		}
+
+		bool ShouldAck(double time) const
+		{
+			if (pending == 0)
+				return false;
+			return immediate || pending >= ack_every || time - first_pending_time >= max_delay;
+		}
+
+		// seconds until the delayed ack is due (a large number if nothing is waiting)
+
+		double GetTimeUntilAck(double time) const
+		{
+			if (pending == 0)
+				return 1.0e9;
+			if (immediate || pending >= ack_every)
+				return 0.0;
+			const double wait = first_pending_time + max_delay - time;
+			return wait > 0.0 ? wait : 0.0;
+		}
+
+		// how long the most recent packet has been waiting for its ack
+
+		float GetAckDelay(double time) const
+		{
+			return pending > 0 ? (float)(time - last_received_time) : 0.0f;
+		}
+
+	private:
+
+		int ack_every;				// packets per ack
+		float max_delay;			// seconds an ack may be held back
+		int pending;				// packets received since the last ack
+		double first_pending_time;
+		double last_received_time;
+		bool immediate;				// something arrived out of order
+	};
+
+	// forward error correction: one xor parity packet protects a block of message packets
+	//  + the parity of up to 32 frames goes out right after them, so the receiver can rebuild any one that is lost without a round trip
+	//  + the block size follows the loss the sender still sees, less redundancy while the link is clean, more when packets keep going missing
+	//  + a partial block is closed after MaxBlockDelay, so the tail of a burst is protected too
+	//  + repair frame: [sequence of first frame][mask of covered frames after it][xor of frame lengths][xor of the frames]
+
+	class FecEncoder
+	{
+	public:
+
+		static const int MinBlockSize = 2;
+		static const int MaxBlockSize = 32;		// covered frames must fit in the 32 bit mask
+		static const int RepairHeaderSize = 11;	// frame type + first sequence + mask + length xor
+
+		FecEncoder(int max_frame_size, unsigned int max_sequence = 0xFFFFFFFF, float max_block_delay = 0.005f, float target_loss = 0.01f)
+			: parity(max_frame_size)
+		{
+			this->max_sequence = max_sequence;
+			this->max_block_delay = max_block_delay;
+			this->target_loss = target_loss;
+			repair_size = 0;
+			Reset();
+		}
+
+		void Reset()
+		{
+			block_size = 0;
+			last_queued = 0;
+			last_resent = 0;
+			ClearBlock();
+		}
+
+		// 0 while the link is clean: nothing is protected and no repair packets are sent
+
+		int GetBlockSize() const
+		{
+			return block_size;
+		}
+
+		// called from the connection update with the running totals of the retransmission system. a rebuilt message is
+		// acked and never resent, so this is the loss left after repair: the block shrinks until that stays under target_loss
+
+		void UpdateRedundancy(unsigned int queued_messages, unsigned int resent_messages)
+		{
+			const unsigned int queued = queued_messages - last_queued;
+			const unsigned int lost = resent_messages - last_resent;
+			if (queued < SampleSize)
+				return;
+			last_queued = queued_messages;
+			last_resent = resent_messages;
+			const float loss = (float)lost / (float)queued;
+			if (loss > target_loss)
+			{
+				if (block_size == 0)
+					block_size = std::max(MinBlockSize, std::min(MaxBlockSize, (int)(0.5f / loss)));
+				else
+					block_size = std::max(MinBlockSize, block_size * 2 / 3);
+			}
+			else if (loss < target_loss * 0.5f && block_size > 0)
+			{
+				block_size++;
+				if (block_size > MaxBlockSize)
+					block_size = 0;
+			}
+		}
+
+		// adds a frame sent with this sequence to the block. false if it can't join the open block
+		// (too far from its first frame, or too large), then the caller closes the block and tries again
+
+		bool AddFrame(unsigned int sequence, const unsigned char frame[], int size, double time)
+		{
+			if (size <= 0 || size > (int)parity.size() - RepairHeaderSize)
+				return false;
+			if (count == 0)
+			{
+				first_sequence = sequence;
+				first_time = time;
+			}
+			else if (sequence_difference(sequence, first_sequence, max_sequence) >= 32)
+				return false;
+			const unsigned int offset = sequence_difference(sequence, first_sequence, max_sequence);
+			mask |= 1u << offset;
+			length_xor ^= (unsigned int)size;
+			unsigned char* p = &parity[RepairHeaderSize];
+			for (int i = 0; i < size; ++i)
+				p[i] ^= frame[i];
+			repair_size = std::max(repair_size, RepairHeaderSize + size);
+			count++;
+			return true;
+		}
+
+		bool IsBlockFull() const
+		{
+			return count > 0 && count >= block_size;
+		}
+
+		bool IsBlockOverdue(double time) const
+		{
+			return count > 0 && time - first_time >= max_block_delay;
+		}
+
+		// writes the repair frame for the open block and starts a new one. returns its size (0 if the block is empty)
+
+		int CloseBlock(unsigned char repair[], unsigned char frame_type)
+		{
+			if (count == 0)
+				return 0;
+			parity[0] = frame_type;
+			WriteInteger(&parity[1], first_sequence);
+			WriteInteger(&parity[5], mask);
+			parity[9] = (unsigned char)(length_xor >> 8);
+			parity[10] = (unsigned char)(length_xor & 0xFF);
+			const int size = repair_size;
+			std::memcpy(repair, &parity[0], size);
+			ClearBlock();
+			return size;
+		}
+
+		int GetMaxRepairSize() const
+		{
+			return (int)parity.size();
+		}
+
+	private:
+
+		static const unsigned int SampleSize = 256;	// messages sent between two redundancy decisions
+
+		static void WriteInteger(unsigned char* data, unsigned int value)
+		{
+			data[0] = (unsigned char)(value >> 24);
+			data[1] = (unsigned char)((value >> 16) & 0xFF);
+			data[2] = (unsigned char)((value >> 8) & 0xFF);
+			data[3] = (unsigned char)(value & 0xFF);
+		}
+
+		void ClearBlock()
+		{
+			std::memset(&parity[0], 0, repair_size);
+			count = 0;
+			first_sequence = 0;
+			first_time = 0.0;
+			mask = 0;
+			length_xor = 0;
+			repair_size = 0;
+		}
+
+		std::vector<unsigned char> parity;	// repair frame being built: header, then the xor of the frames
+		unsigned int max_sequence;
+		float max_block_delay;				// seconds a partial block may stay open
+		float target_loss;					// loss still acceptable after repair
+		int block_size;						// frames per repair frame, 0 = off
+		unsigned int last_queued;
+		unsigned int last_resent;
+		int count;							// frames in the open block
+		unsigned int first_sequence;
+		double first_time;
+		unsigned int mask;
+		unsigned int length_xor;
+		int repair_size;					// header + longest frame so far
+	};
+
+	// receiving side of the forward error correction
+	//  + keeps the last RingSize message frames by sequence, but only once the peer has sent a repair frame
+	//  + a repair frame that covers exactly one missing frame gives that frame back, more than one missing and it is of no use
+
+	class FecDecoder
+	{
+	public:
+
+		static const int RingSize = 256;
+
+		FecDecoder(int max_frame_size, unsigned int max_sequence = 0xFFFFFFFF)
+		{
+			this->max_frame_size = max_frame_size;
+			this->max_sequence = max_sequence;
+			Reset();
+		}
+
+		void Reset()
+		{
+			frames.clear();
+			slots.clear();
+		}
+
+		void FrameReceived(unsigned int sequence, const unsigned char frame[], int size)
+		{
+			if (slots.empty() || size <= 0 || size > max_frame_size)
+				return;
+			Slot& slot = slots[sequence % RingSize];
+			slot.sequence = sequence;
+			slot.size = size;
+			slot.valid = true;
+			std::memcpy(&frames[(size_t)(sequence % RingSize) * max_frame_size], frame, size);
+		}
+
+		// returns the size of the rebuilt frame (written to "frame", its sequence to "sequence"), or 0 if nothing could be rebuilt
+
+		int Recover(const unsigned char repair[], int size, unsigned char frame[], unsigned int& sequence)
+		{
+			if (slots.empty())
+			{
+				frames.resize((size_t)RingSize * max_frame_size);
+				slots.resize(RingSize);
+			}
+			const int header = FecEncoder::RepairHeaderSize;
+			const int parity_size = size - header;
+			if (parity_size <= 0 || parity_size > max_frame_size)
+				return 0;
+			const unsigned int first_sequence = ReadInteger(repair + 1);
+			const unsigned int mask = ReadInteger(repair + 5);
+			unsigned int length = ((unsigned int)repair[9] << 8) | repair[10];
+			int missing = 0;
+			for (int i = 0; i < 32; ++i)
+			{
+				if (((mask >> i) & 1) == 0)
+					continue;
+				const unsigned int covered = Advance(first_sequence, i);
+				const Slot& slot = slots[covered % RingSize];
+				if (slot.valid && slot.sequence == covered)
+					continue;
+				if (++missing > 1)
+					return 0;
+				sequence = covered;
+			}
+			if (missing != 1)
+				return 0;
+			std::memcpy(frame, repair + header, parity_size);
+			for (int i = 0; i < 32; ++i)
+			{
+				const unsigned int covered = Advance(first_sequence, i);
+				if (((mask >> i) & 1) == 0 || covered == sequence)
+					continue;
+				const Slot& slot = slots[covered % RingSize];
+				if (slot.size > parity_size)
+					return 0;
+				const unsigned char* data = &frames[(size_t)(covered % RingSize) * max_frame_size];
+				for (int j = 0; j < slot.size; ++j)
+					frame[j] ^= data[j];
+				length ^= (unsigned int)slot.size;
+			}
+			if (length == 0 || (int)length > parity_size)
+				return 0;
+			FrameReceived(sequence, frame, (int)length);
+			return (int)length;
+		}
+
+	private:
+
+		struct Slot
+		{
+			Slot() : sequence(0), size(0), valid(false) {}
+			unsigned int sequence;
+			int size;
+			bool valid;
+		};
+
+		static unsigned int ReadInteger(const unsigned char* data)
+		{
+			return ((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) | ((unsigned int)data[2] << 8) | data[3];
+		}
+
+		unsigned int Advance(unsigned int sequence, int offset) const
+		{
+			return (unsigned int)(((unsigned long long)sequence + offset) % ((unsigned long long)max_sequence + 1));
+		}
+
+		int max_frame_size;
+		unsigned int max_sequence;
+		std::vector<unsigned char> frames;	// RingSize frames of max_frame_size, allocated with the first repair frame
+		std::vector<Slot> slots;
+	};
+
+	// connection with reliability (seq/ack)
+
+	class ReliableConnection : public Connection
+	{
+	public:
+
+		ReliableConnection(unsigned int protocolId, float timeout, unsigned int max_sequence = 0xFFFFFFFF, int max_packet_size = MaxDatagramSize)
+			: Connection(protocolId, timeout, max_packet_size), reliabilitySystem(max_sequence),
+			  retransmissionSystem(256, max_packet_size - HeaderSize - MessageHeaderSize, max_sequence, HeaderSize + MessageHeaderSize),
+			  pathMtu(std::min(BaseDatagramSize, max_packet_size), max_packet_size),
+			  sendBatch(MaxBatchSize, max_packet_size),
+			  fecEncoder(max_packet_size - HeaderSize, max_sequence), fecDecoder(max_packet_size - HeaderSize, max_sequence)
+		{
+			congestion = NULL;
+			fecEnabled = false;
+			for (int i = 0; i < MaxBatchSize; ++i)
+				recoveredBuffers[i] = NULL;
+			ClearData();
+#ifdef NET_UNIT_TEST
+			packet_loss_mask = 0;
+#endif
+		}
+
+		~ReliableConnection()
+		{
+			if (IsRunning())
+				Stop();
+			ReleaseRecoveredBuffers();
+		}
+
+		// overriden functions from "Connection"
+
+		bool SendPacket(const unsigned char data[], int size)
+		{
+			assert(size <= sendBatch.GetPacketSize() - HeaderSize);
+			unsigned char* frame = sendBatch[0] + HeaderSize;
+			std::memcpy(frame, data, size);
+			return SendFrameInPlace(frame, size);
+		}
+
+		int ReceivePacket(unsigned char data[], int size)
+		{
+			unsigned char* const packets[1] = { data };
+			int sizes[1] = { 0 };
+			return ReceivePackets(packets, sizes, size, 1) > 0 ? sizes[0] : 0;
+		}
+
+		int SendPackets(const unsigned char* const data[], const int sizes[], int count)
+		{
+			return SendPacketBatch(data, sizes, count, NULL);
+		}
+
+		int ReceivePackets(unsigned char* const data[], int sizes[], int size, int count)
+		{
+			ReceivedPacket frames[MaxBatchSize];
+			int received = ReceiveFrames(frames, count);
+			int accepted = 0;
+			for (int i = 0; i < received; ++i)
+			{
+				if (frames[i].size > size)
+					continue;
+				std::memcpy(data[accepted], frames[i].GetData(), frames[i].size);
+				sizes[accepted++] = frames[i].size;
+			}
+			return accepted;
+		}
+
+		// messages: sent through the retransmission system, delivered once and (by default) in order
+
+		bool SendReliable(const unsigned char data[], int size)
+		{
+			if (!retransmissionSystem.CanSend())
+				return false;
+			unsigned int id = retransmissionSystem.QueueMessage(data, size);
+			SendMessagePacket(id);	// if this fails the message is picked up by the next Update
+			return true;
+		}
+
+		// queues up to MaxBatchSize messages and sends them with one batched send. returns how many the window took
+
+		int SendReliableBatch(const unsigned char* const data[], const int sizes[], int count)
+		{
+			unsigned int ids[MaxBatchSize];
+			int queued = 0;
+			int queued_bytes = 0;
+			while (queued < count && queued < MaxBatchSize && retransmissionSystem.CanSend() && WindowOpen(queued_bytes))
+			{
+				ids[queued] = retransmissionSystem.QueueMessage(data[queued], sizes[queued]);
+				queued_bytes += sizes[queued];
+				queued++;
+			}
+			SendMessagePackets(ids, queued);
+			return queued;
+		}
+
+		// SendReliableBatch without the copy: the messages are built straight in buffers from ReserveReliable, which
+		// hold the largest message the connection sends. the ones the window doesn't take are still the caller's,
+		// to commit later or give back with CancelReliable
+
+		unsigned char* ReserveReliable()
+		{
+			return retransmissionSystem.ReserveMessage();
+		}
+
+		int CommitReliableBatch(unsigned char* const messages[], const int sizes[], int count)
+		{
+			unsigned int ids[MaxBatchSize] = {};	// cleared only because -Wmaybe-uninitialized can't tell that queued bounds the reads
+			int queued = 0;
+			int queued_bytes = 0;
+			while (queued < count && queued < MaxBatchSize && retransmissionSystem.CanSend() && WindowOpen(queued_bytes))
+			{
+				ids[queued] = retransmissionSystem.CommitMessage(messages[queued], sizes[queued]);
+				queued_bytes += sizes[queued];
+				queued++;
+			}
+			SendMessagePackets(ids, queued);
+			return queued;
+		}
+
+		void CancelReliable(unsigned char* message)
+		{
+			retransmissionSystem.CancelMessage(message);
+		}
+
+		// with in_order false a message is handed out as soon as it arrives, without waiting for earlier ones
+		// (for data the caller places itself, e.g. by an offset it carries)
+
+		int ReceiveReliable(unsigned char data[], int size, bool in_order = true)
+		{
+			int bytes = 0;
+			const unsigned char* message = ReadReliable(bytes, in_order);
+			if (!message)
+				return 0;
+			assert(size >= bytes);
+			bytes = std::min(bytes, size);
+			std::memcpy(data, message, bytes);
+			return bytes;
+		}
+
+		// ReceiveReliable without the copy: the message is read where it was received, and stays valid until the
+		// next ReadReliable or ReceiveReliable. NULL if no message is ready
+
+		const unsigned char* ReadReliable(int& size, bool in_order = true)
+		{
+			while (true)
+			{
+				const unsigned char* message = in_order ? retransmissionSystem.ReadMessage(size) : retransmissionSystem.ReadAnyMessage(size);
+				if (message)
+					return message;
+				ReceivedPacket frames[MaxBatchSize];
+				int received = ReceiveFrames(frames, MaxBatchSize);
+				if (received <= 0)
+				{
+					retransmissionSystem.CompactHeldMessages();
+					return NULL;
+				}
+				for (int i = 0; i < received; ++i)
+				{
+					const unsigned char* frame = frames[i].GetData();
+					if (frame[0] == FrameMessage && frames[i].size > MessageHeaderSize)
+					{
+						unsigned int id = 0;
+						ReadInteger(frame + 1, id);
+						retransmissionSystem.MessageReceived(id, frames[i].buffer, frames[i].offset + MessageHeaderSize, frames[i].size - MessageHeaderSize);
+					}
+				}
+			}
+		}
+
+		// keeps acks flowing back to the sender when there is nothing else to send
+
+		bool SendKeepAlive()
+		{
+			unsigned char frame = FrameKeepAlive;
+			return SendPacket(&frame, 1);
+		}
+
+		// seconds until a delayed ack is due, so the caller can wake up for it
+
+		double GetTimeUntilAck() const
+		{
+			return ackScheduler.GetTimeUntilAck(GetTime());
+		}
+
+		// room in the send window and in the congestion window. SendReliable itself only needs the former,
+		// so small control messages are never held back by congestion control
+
+		bool CanSendReliable() const
+		{
+			return retransmissionSystem.CanSend() && WindowOpen(0);
+		}
+
+		// the controller is not owned, NULL sends as fast as the send window allows
+
+		void SetCongestionControl(CongestionControl* controller)
+		{
+			congestion = controller;
+			if (congestion)
+				congestion->Reset();
+		}
+
+		CongestionControl* GetCongestionControl()
+		{
+			return congestion;
+		}
+
+		// starts probing for the largest datagram the path carries, probes go out from Update
+
+		void DiscoverPathMtu()
+		{
+			pathMtu.Start();
+		}
+
+		// sends xor repair packets along with messages, so a lost one can be rebuilt by the receiver without being resent.
+		// how many messages each repair covers follows the loss rate (none at all while there is no loss). the receiving side
+		// needs no setting, it rebuilds whatever the repair packets allow
+
+		void SetForwardErrorCorrection(bool enabled)
+		{
+			if (!enabled)
+				SendRepair();
+			fecEnabled = enabled;
+		}
+
+		bool IsForwardErrorCorrectionEnabled() const
+		{
+			return fecEnabled;
+		}
+
+		// largest message that fits one datagram on this path (base size until discovery confirms more).
+		// with forward error correction the repair header has to fit in the datagram as well
+
+		int GetMessageSizeLimit() const
+		{
+			const int overhead = HeaderSize + MessageHeaderSize + (fecEnabled ? FecEncoder::RepairHeaderSize : 0);
+			return std::min(retransmissionSystem.GetMaxMessageSize(), pathMtu.GetPathMtu() - overhead);
+		}
+
+		void Update(float deltaTime)
+		{
+			Connection::Update(deltaTime);
+			unsigned int* acks = NULL;
+			int ack_count = 0;
+			reliabilitySystem.GetAcks(&acks, ack_count);
+			retransmissionSystem.ProcessAcks(acks, ack_count);
+			pathMtu.ProcessAcks(acks, ack_count);
+			pathMtu.Update(GetTime(), reliabilitySystem.GetRoundTripTime());
+			if (IsConnected() && pathMtu.GetProbeSize() > 0)
+				SendProbe(pathMtu.GetProbeSize());
+			if (IsConnected() && ackScheduler.ShouldAck(GetTime()))
+				SendAck();
+			if (fecEnabled)
+			{
+				fecEncoder.UpdateRedundancy(retransmissionSystem.GetQueuedMessages(), retransmissionSystem.GetResentMessages());
+				// a lost frame is only given up on (by loss detection and by the resends) once its repair had its chance
+				const unsigned int allowance = fecEncoder.GetBlockSize() > 0 ? fecEncoder.GetBlockSize() + 1 : 0;
+				reliabilitySystem.SetReorderingAllowance(allowance);
+				retransmissionSystem.SetReorderingAllowance(allowance);
+				if (fecEncoder.IsBlockOverdue(GetTime()) || fecEncoder.GetBlockSize() == 0)
+					SendRepair();
+			}
+			if (congestion)
+			{
+				CongestionSample sample;
+				reliabilitySystem.GetCongestionSample(sample);
+				congestion->SetPacketSize(pathMtu.GetPathMtu());
+				congestion->Update(sample);
+			}
+			retransmissionSystem.Update(reliabilitySystem.GetRoundTripTime());
+			const std::vector<unsigned int>& resend = retransmissionSystem.GetResendList();
+			for (size_t i = 0; i < resend.size(); i += MaxBatchSize)
+				SendMessagePackets(&resend[i], (int)std::min(resend.size() - i, (size_t)MaxBatchSize));
+			reliabilitySystem.Update();
+		}
+
+		int GetHeaderSize() const
+		{
+			return Connection::GetHeaderSize() + reliabilitySystem.GetHeaderSize();
+		}
+
+		ReliabilitySystem& GetReliabilitySystem()
 		{
-			return remote_sequence;
+			return reliabilitySystem;
 		}
 
-		unsigned int GetMaxSequence() const
+		RetransmissionSystem& GetRetransmissionSystem()
 		{
-			return max_sequence;
+			return retransmissionSystem;
 		}
 
-		void GetAcks(unsigned int** acks, int& count)
+		PathMtuDiscovery& GetPathMtuDiscovery()
 		{
-			*acks = &this->acks[0];
-			count = (int)this->acks.size();
+			return pathMtu;
 		}
 
-		unsigned int GetSentPackets() const
+		// unit test controls
+
+#ifdef NET_UNIT_TEST
+		void SetPacketLossMask(unsigned int mask)
 		{
-			return sent_packets;
+			packet_loss_mask = mask;
 		}
+#endif
 
-		unsigned int GetReceivedPackets() const
+	protected:
+
+		void WriteInteger(unsigned char* data, unsigned int value)
 		{
-			return recv_packets;
+			data[0] = (unsigned char)(value >> 24);
+			data[1] = (unsigned char)((value >> 16) & 0xFF);
+			data[2] = (unsigned char)((value >> 8) & 0xFF);
+			data[3] = (unsigned char)(value & 0xFF);
 		}
 
-		unsigned int GetLostPackets() const
+		void WriteHeader(unsigned char* header, unsigned int sequence, unsigned int ack, unsigned int ack_bits)
 		{
-			return lost_packets;
+			WriteInteger(header, sequence);
+			WriteInteger(header + 4, ack);
+			WriteInteger(header + 8, ack_bits);
 		}
 
-		unsigned int GetAckedPackets() const
+		void ReadInteger(const unsigned char* data, unsigned int& value)
 		{
-			return acked_packets;
+			value = (((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) |
+				((unsigned int)data[2] << 8) | ((unsigned int)data[3]));
 		}
 
-		float GetSentBandwidth() const
+		void ReadHeader(const unsigned char* header, unsigned int& sequence, unsigned int& ack, unsigned int& ack_bits)
 		{
-			return sent_bandwidth;
+			ReadInteger(header, sequence);
+			ReadInteger(header + 4, ack);
+			ReadInteger(header + 8, ack_bits);
 		}
 
-		float GetAckedBandwidth() const
+		virtual void OnStop()
 		{
-			return acked_bandwidth;
+			ClearData();
 		}
 
-		float GetRoundTripTime() const
+		virtual void OnDisconnect()
 		{
-			return rtt;
+			ClearData();
 		}
 
-		int GetHeaderSize() const
+		virtual void SetPacketPool(const std::shared_ptr<PacketPool>& packetPool)
 		{
-			return 12;
+			ReleaseRecoveredBuffers();
+			retransmissionSystem.Reset();
+			Connection::SetPacketPool(packetPool);
 		}
 
-	protected:
+	private:
 
-		void AdvanceQueueTime(float deltaTime)
+		enum FrameType
 		{
-			for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); itor++)
-				itor->time += deltaTime;
+			FrameKeepAlive = 0,
+			FrameMessage = 1,
+			FrameProbe = 2,
+			FrameRepair = 3
+		};
 
-			for (PacketQueue::iterator itor = receivedQueue.begin(); itor != receivedQueue.end(); itor++)
-				itor->time += deltaTime;
+		static const int HeaderSize = ProtocolHeaderSize + 12;		// protocol and connection id + reliability header
+		static const int AckPacketSize = 12;		// ack + ack bits + ack delay: no sequence, so never acked itself
 
-			for (PacketQueue::iterator itor = pendingAckQueue.begin(); itor != pendingAckQueue.end(); itor++)
-				itor->time += deltaTime;
+		// an ack-only packet has no sequence number and no payload. it is exactly AckPacketSize bytes,
+		// and every sequenced packet is longer (12 byte header plus at least one byte of payload)
 
-			for (PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); itor++)
-				itor->time += deltaTime;
+		void SendAck()
+		{
+			unsigned char packet[AckPacketSize];
+			const unsigned int delay_us = (unsigned int)(ackScheduler.GetAckDelay(GetTime()) * 1000000.0f);
+			WriteInteger(packet, reliabilitySystem.GetRemoteSequence());
+			WriteInteger(packet + 4, reliabilitySystem.GenerateAckBits());
+			WriteInteger(packet + 8, delay_us);
+			if (Connection::SendPacket(packet, AckPacketSize))
+				ackScheduler.AckSent();
 		}
 
-		void UpdateQueues()
+		void ReadAckPacket(const unsigned char packet[])
 		{
-			const float epsilon = 0.001f;
+			unsigned int ack = 0;
+			unsigned int ack_bits = 0;
+			unsigned int delay_us = 0;
+			ReadInteger(packet, ack);
+			ReadInteger(packet + 4, ack_bits);
+			ReadInteger(packet + 8, delay_us);
+			reliabilitySystem.ProcessAck(ack, ack_bits, delay_us / 1000000.0f);
+		}
 
-			while (sentQueue.size() && sentQueue.front().time > rtt_maximum + epsilon)
-				sentQueue.pop_front();
+		bool WindowOpen(int pending_bytes) const
+		{
+			return !congestion || reliabilitySystem.GetBytesInFlight() + pending_bytes < congestion->GetCongestionWindow();
+		}
+		static const int MessageHeaderSize = 5;	// frame type + message id
 
-			if (receivedQueue.size())
-			{
-				const unsigned int latest_sequence = receivedQueue.back().sequence;
-				const unsigned int minimum_sequence = latest_sequence >= 34 ? (latest_sequence - 34) : max_sequence - (34 - latest_sequence);
-				while (receivedQueue.size() && !sequence_more_recent(receivedQueue.front().sequence, minimum_sequence, max_sequence))
-					receivedQueue.pop_front();
-			}
+		// a probe is a packet padded out to "size" bytes on the wire, the receiver acks it like any other packet
+
+		void SendProbe(int size)
+		{
+			unsigned char* packet = sendBatch[0] + HeaderSize;
+			const int payload = size - HeaderSize;
+			assert(payload > 0 && payload <= sendBatch.GetPacketSize() - HeaderSize);
+			packet[0] = FrameProbe;
+			std::memset(packet + 1, 0, payload - 1);
+			unsigned int sequence = reliabilitySystem.GetLocalSequence();
+			if (SendFrameInPlace(packet, payload))
+				pathMtu.ProbeSent(sequence, GetTime());
+			else
+				pathMtu.ProbeRefused();
+		}
 
-			while (ackedQueue.size() && ackedQueue.front().time > rtt_maximum * 2 - epsilon)
-				ackedQueue.pop_front();
+		// messages go out of their send window slots: the message header and then the packet headers are written
+		// into the headroom in front of each, so neither a first send nor a resend copies the message
 
-			while (pendingAckQueue.size() && pendingAckQueue.front().time > rtt_maximum + epsilon)
-			{
-				pendingAckQueue.pop_front();
-				lost_packets++;
-			}
+		bool SendMessagePacket(unsigned int id)
+		{
+			int size = 0;
+			unsigned char* frame = retransmissionSystem.GetMessageBuffer(id, size) - MessageHeaderSize;
+			frame[0] = FrameMessage;
+			WriteInteger(frame + 1, id);
+			unsigned int sequence = reliabilitySystem.GetLocalSequence();
+			if (!SendFrameInPlace(frame, size + MessageHeaderSize))
+				return false;
+			retransmissionSystem.MessageSent(id, sequence);
+			ProtectFrame(sequence, frame, size + MessageHeaderSize);
+			return true;
 		}
 
-		void UpdateStats()
+		void SendMessagePackets(const unsigned int ids[], int count)
 		{
-			int sent_bytes_per_second = 0;
-			for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); ++itor)
-				sent_bytes_per_second += itor->size;
-			int acked_packets_per_second = 0;
-			int acked_bytes_per_second = 0;
-			for (PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); ++itor)
+			assert(count <= MaxBatchSize);
+			if (count <= 0)
+				return;
+			unsigned char* frames[MaxBatchSize];
+			int sizes[MaxBatchSize];
+			unsigned int sequences[MaxBatchSize];
+			for (int i = 0; i < count; ++i)
 			{
-				if (itor->time >= rtt_maximum)
-				{
-					acked_packets_per_second++;
-					acked_bytes_per_second += itor->size;
-				}
+				int size = 0;
+				unsigned char* frame = retransmissionSystem.GetMessageBuffer(ids[i], size) - MessageHeaderSize;
+				frame[0] = FrameMessage;
+				WriteInteger(frame + 1, ids[i]);
+				frames[i] = frame;
+				sizes[i] = size + MessageHeaderSize;
 			}
-			sent_bytes_per_second /= rtt_maximum;
-			acked_bytes_per_second /= rtt_maximum;
-			sent_bandwidth = sent_bytes_per_second * (8 / 1000.0f);
-			acked_bandwidth = acked_bytes_per_second * (8 / 1000.0f);
+			SendFramesInPlace(frames, sizes, count, sequences);
+			for (int i = 0; i < count; ++i)
+				retransmissionSystem.MessageSent(ids[i], sequences[i]);
+			for (int i = 0; i < count; ++i)
+				ProtectFrame(sequences[i], frames[i], sizes[i]);
 		}
 
-	private:
-
-		unsigned int max_sequence;			// maximum sequence value before wrap around (used to test sequence wrap at low # values)
-		unsigned int local_sequence;		// local sequence number for most recently sent packet
-		unsigned int remote_sequence;		// remote sequence number for most recently received packet
-
-		unsigned int sent_packets;			// total number of packets sent
-		unsigned int recv_packets;			// total number of packets received
-		unsigned int lost_packets;			// total number of packets lost
-		unsigned int acked_packets;			// total number of packets acked
-
-		float sent_bandwidth;				// approximate sent bandwidth over the last second
-		float acked_bandwidth;				// approximate acked bandwidth over the last second
-		float rtt;							// estimated round trip time
-		float rtt_maximum;					// maximum expected round trip time (hard coded to one second for the moment)
-
-		std::vector<unsigned int> acks;		// acked packets from last set of packet receives. cleared each update!
-
-		PacketQueue sentQueue;				// sent packets used to calculate sent bandwidth (kept until rtt_maximum)
-		PacketQueue pendingAckQueue;		// sent packets which have not been acked yet (kept until rtt_maximum * 2 )
-		PacketQueue receivedQueue;			// received packets for determining acks to send (kept up to most recent recv sequence - 32)
-		PacketQueue ackedQueue;				// acked packets (kept until rtt_maximum * 2)
-	};
+		// adds a message frame that just went out to the open repair block, the repair is sent once the block is full.
+		// frames the socket refused are covered too: to the receiver they are just lost
 
-	// connection with reliability (seq/ack)
+		void ProtectFrame(unsigned int sequence, const unsigned char frame[], int size)
+		{
+			if (!fecEnabled || fecEncoder.GetBlockSize() == 0)
+				return;
+			if (!fecEncoder.AddFrame(sequence, frame, size, GetTime()))
+			{
+				SendRepair();
+				if (!fecEncoder.AddFrame(sequence, frame, size, GetTime()))
+					return;
+			}
+			if (fecEncoder.IsBlockFull())
+				SendRepair();
+		}
 
-	class ReliableConnection : public Connection
-	{
-	public:
+		// a repair packet is sequenced and acked like any other, but never resent
 
-		ReliableConnection(unsigned int protocolId, float timeout, unsigned int max_sequence = 0xFFFFFFFF)
-			: Connection(protocolId, timeout), reliabilitySystem(max_sequence)
+		void SendRepair()
 		{
-			ClearData();
-#ifdef NET_UNIT_TEST
-			packet_loss_mask = 0;
-#endif
+			unsigned char* frame = sendBatch[0] + HeaderSize;
+			const int size = fecEncoder.CloseBlock(frame, FrameRepair);
+			if (size > 0 && IsConnected())
+				SendFrameInPlace(frame, size);
 		}
 
-		~ReliableConnection()
+		// sequence numbers are handed out while the batch is built, so a datagram the socket then refuses
+		// simply looks lost to the reliability system. returns how many datagrams the socket took
+
+		int SendPacketBatch(const unsigned char* const data[], const int sizes[], int count, unsigned int sequences[])
 		{
-			if (IsRunning())
-				Stop();
+			assert(count <= MaxBatchSize);
+			unsigned char* frames[MaxBatchSize];
+			for (int i = 0; i < count; ++i)
+			{
+				assert(sizes[i] <= sendBatch.GetPacketSize() - HeaderSize);
+				frames[i] = sendBatch[i] + HeaderSize;
+				std::memcpy(frames[i], data[i], sizes[i]);
+			}
+			return SendFramesInPlace(frames, sizes, count, sequences);
 		}
 
-		// overriden functions from "Connection"
+		// SendPacket for a frame with HeaderSize bytes of headroom in front of it, the headers go there
 
-		bool SendPacket(const unsigned char data[], int size)
+		bool SendFrameInPlace(unsigned char frame[], int size)
 		{
 #ifdef NET_UNIT_TEST
 			if (reliabilitySystem.GetLocalSequence() & packet_loss_mask)
@@ -971,116 +3711,405 @@ namespace net
 			}
 #endif
 			const int header = 12;
-			unsigned char packet[header + PacketSizeHack];
+			unsigned char* packet = frame - header;
 			unsigned int seq = reliabilitySystem.GetLocalSequence();
 			unsigned int ack = reliabilitySystem.GetRemoteSequence();
 			unsigned int ack_bits = reliabilitySystem.GenerateAckBits();
 			WriteHeader(packet, seq, ack, ack_bits);
-			std::memcpy(packet + header, data, size);
-			if (!Connection::SendPacket(packet, size + header))
+			const int sizes[1] = { size + header };
+			if (Connection::SendPacketsInPlace(&packet, sizes, 1) != 1)
 				return false;
 			reliabilitySystem.PacketSent(size);
+			ackScheduler.AckSent();
 			return true;
 		}
 
-		int ReceivePacket(unsigned char data[], int size)
+		// SendPacketBatch for frames with HeaderSize bytes of headroom in front of them, the headers go there
+
+		int SendFramesInPlace(unsigned char* const frames[], const int sizes[], int count, unsigned int sequences[])
 		{
 			const int header = 12;
-			if (size <= header)
-				return false;
-			unsigned char packet[header + PacketSizeHack];
-			int received_bytes = Connection::ReceivePacket(packet, size + header);
+			assert(count <= MaxBatchSize);
+			unsigned char* packets[MaxBatchSize];
+			int batch_sizes[MaxBatchSize];
+			int batch_count = 0;
+			for (int i = 0; i < count; ++i)
+			{
+				unsigned int seq = reliabilitySystem.GetLocalSequence();
+				if (sequences)
+					sequences[i] = seq;
+#ifdef NET_UNIT_TEST
+				if (seq & packet_loss_mask)
+				{
+					reliabilitySystem.PacketSent(sizes[i]);
+					continue;
+				}
+#endif
+				unsigned char* packet = frames[i] - header;
+				WriteHeader(packet, seq, reliabilitySystem.GetRemoteSequence(), reliabilitySystem.GenerateAckBits());
+				reliabilitySystem.PacketSent(sizes[i]);
+				packets[batch_count] = packet;
+				batch_sizes[batch_count++] = sizes[i] + header;
+			}
+			if (batch_count == 0)
+				return 0;
+			ackScheduler.AckSent();
+			return Connection::SendPacketsInPlace(packets, batch_sizes, batch_count);
+		}
+
+		// reads one batch of packets and leaves their frames in the buffers they arrived in. ack packets are used up,
+		// and a repair frame is replaced by the frame it rebuilds (or dropped). returns how many frames are left
+
+		int ReceiveFrames(ReceivedPacket frames[], int count)
+		{
+			assert(count <= MaxBatchSize);
+			int accepted = 0;
+			while (accepted == 0)	// a batch of nothing but ack packets doesn't mean the socket is empty
+			{
+				int received = Connection::ReceivePacketsInPlace(frames, count);
+				if (received == 0)
+					break;
+				for (int i = 0; i < received; ++i)
+				{
+					ReceivedPacket frame = frames[i];
+					if (ReadPacket(frame, i))
+						frames[accepted++] = frame;
+				}
+			}
+			if (ackScheduler.ShouldAck(GetTime()))
+				SendAck();
+			return accepted;
+		}
+
+		// reads the reliability header of a received packet and moves "packet" on to the frame behind it.
+		// false if there is no frame to hand out. "index" is the packet's place in its batch
+
+		bool ReadPacket(ReceivedPacket& packet, int index)
+		{
+			const int header = 12;
+			const int received_bytes = packet.size;
+			const unsigned char* data = packet.GetData();
 			if (received_bytes == 0)
 				return false;
+			if (received_bytes == AckPacketSize)
+			{
+				ReadAckPacket(data);
+				return false;
+			}
 			if (received_bytes <= header)
 				return false;
 			unsigned int packet_sequence = 0;
 			unsigned int packet_ack = 0;
 			unsigned int packet_ack_bits = 0;
-			ReadHeader(packet, packet_sequence, packet_ack, packet_ack_bits);
+			ReadHeader(data, packet_sequence, packet_ack, packet_ack_bits);
+			const unsigned int remote_sequence = reliabilitySystem.GetRemoteSequence();
+			const unsigned int expected_sequence = remote_sequence == reliabilitySystem.GetMaxSequence() ? 0 : remote_sequence + 1;
+			ackScheduler.PacketReceived(packet_sequence == expected_sequence, GetTime());
 			reliabilitySystem.PacketReceived(packet_sequence, received_bytes - header);
 			reliabilitySystem.ProcessAck(packet_ack, packet_ack_bits);
-			std::memcpy(data, packet + header, received_bytes - header);
-			return received_bytes - header;
+			const unsigned char* frame = data + header;
+			const int frame_size = received_bytes - header;
+			if (frame[0] == FrameRepair)
+				return RecoverFrame(frame, frame_size, packet, index);
+			if (frame[0] == FrameMessage)
+				fecDecoder.FrameReceived(packet_sequence, frame, frame_size);
+			packet.offset += header;
+			packet.size = frame_size;
+			return true;
 		}
 
-		void Update(float deltaTime)
+		// the repair frame is not handed out itself: if it rebuilds a lost frame, that frame takes its place
+		// (rebuilt into a buffer of its own, one for each place in the batch).
+		// the rebuilt packet is marked received so the peer sees it acked and never resends it. it is acked right
+		// away, before the rest of a received batch moves the ack on past the 32 packets the ack bits cover
+
+		bool RecoverFrame(const unsigned char repair[], int size, ReceivedPacket& packet, int index)
 		{
-			Connection::Update(deltaTime);
-			reliabilitySystem.Update(deltaTime);
+			GetPacketPool()->Recycle(recoveredBuffers[index]);
+			unsigned int sequence = 0;
+			const int frame_size = fecDecoder.Recover(repair, size, recoveredBuffers[index], sequence);
+			if (frame_size <= 0)
+				return false;
+			reliabilitySystem.PacketReceived(sequence, frame_size);
+			SendAck();
+			packet.buffer = recoveredBuffers[index];
+			packet.offset = 0;
+			packet.size = frame_size;
+			return true;
 		}
 
-		int GetHeaderSize() const
+		void ReleaseRecoveredBuffers()
 		{
-			return Connection::GetHeaderSize() + reliabilitySystem.GetHeaderSize();
+			for (int i = 0; i < MaxBatchSize; ++i)
+			{
+				PacketPool::Release(recoveredBuffers[i]);
+				recoveredBuffers[i] = NULL;
+			}
 		}
 
-		ReliabilitySystem& GetReliabilitySystem()
+		void ClearData()
 		{
-			return reliabilitySystem;
+			reliabilitySystem.Reset();
+			retransmissionSystem.Reset();
+			pathMtu.Reset();
+			ackScheduler.Reset();
+			fecEncoder.Reset();
+			fecDecoder.Reset();
+			if (congestion)
+				congestion->Reset();
 		}
 
-		// unit test controls
-
 #ifdef NET_UNIT_TEST
-		void SetPacketLossMask(unsigned int mask)
+		unsigned int packet_loss_mask;			// mask sequence number, if non-zero, drop packet - for unit test only
+#endif
+
+		ReliabilitySystem reliabilitySystem;	// reliability system: manages sequence numbers and acks, tracks network stats etc.
+		RetransmissionSystem retransmissionSystem;	// resends lost messages and puts received ones back in order
+		PathMtuDiscovery pathMtu;				// finds the largest datagram the path carries
+		CongestionControl* congestion;			// decides how much may be in flight and how fast to send (optional)
+		AckScheduler ackScheduler;				// when to send ack-only packets back
+		PacketBatch sendBatch;					// whole datagrams: frames built or copied in behind room for the headers
+		bool fecEnabled;						// send repair packets with the messages
+		FecEncoder fecEncoder;					// xor parity of the messages sent since the last repair packet
+		FecDecoder fecDecoder;					// recent messages received, to rebuild a lost one from a repair packet
+		unsigned char* recoveredBuffers[MaxBatchSize];	// frames rebuilt from repair frames, by place in the batch
+	};
+
+	// many connections on one port: the server side of concurrent transfers
+	//  + owns the socket. the connections (owned by the caller) are attached to it and send through it directly
+	//  + a received datagram goes to the connection of its peer: sender address and the connection id in its header
+	//  + a datagram from a new peer is offered to the accept handler, which may hand back a connection to attach
+	//  + the lookup is a flat open-addressed table of 16 byte entries (key and slot only), so finding the session of a
+	//    datagram touches a cache line or two however many sessions there are
+
+	class SessionTable
+	{
+	public:
+
+		// the caller's connection for a new peer (slot numbers its session), or NULL to drop the datagram
+		typedef std::function<Connection*(int slot, const Address& address, unsigned int connection_id)> AcceptHandler;
+
+		SessionTable(unsigned int protocolId, int max_sessions, int max_packet_size = MaxDatagramSize)
+			: pool(std::make_shared<PacketPool>(max_packet_size))
 		{
-			packet_loss_mask = mask;
+			assert(max_sessions > 0);
+			this->protocolId = protocolId;
+			this->max_packet_size = max_packet_size;
+			int capacity = 1;
+			while (capacity < max_sessions * 2)		// at most half full, so probe runs stay short
+				capacity <<= 1;
+			entries.resize(capacity);
+			connections.resize(max_sessions, NULL);
+			keys.resize(max_sessions);
+			for (int slot = max_sessions - 1; slot >= 0; --slot)
+				free_slots.push_back(slot);
+			for (int i = 0; i < MaxBatchSize; ++i)
+				receiveBuffers[i] = NULL;
 		}
-#endif
 
-	protected:
+		~SessionTable()
+		{
+			Stop();
+		}
 
-		void WriteInteger(unsigned char* data, unsigned int value)
+		// with receive offload on, a buffer holds a whole coalesced run, so the pool grows to the largest one.
+		// the io_uring engine reads the socket when the kernel offers it
+
+		bool Start(int port, bool sharePort = false)
 		{
-			data[0] = (unsigned char)(value >> 24);
-			data[1] = (unsigned char)((value >> 16) & 0xFF);
-			data[2] = (unsigned char)((value >> 8) & 0xFF);
-			data[3] = (unsigned char)(value & 0xFF);
+			printf("start session table on port %d, up to %d sessions\n", port, (int)connections.size());
+			if (!socket.Open(port, sharePort))
+				return false;
+			const int size = (socket.EnableReceiveOffload() ? MaxOffloadSize : max_packet_size) + RingReceiveHeadroom;
+			if (pool->GetBufferSize() < size)
+				pool = std::make_shared<PacketPool>(size);
+			socket.EnableRing(pool.get());
+			return true;
 		}
 
-		void WriteHeader(unsigned char* header, unsigned int sequence, unsigned int ack, unsigned int ack_bits)
+		void Stop()
 		{
-			WriteInteger(header, sequence);
-			WriteInteger(header + 4, ack);
-			WriteInteger(header + 8, ack_bits);
+			for (int slot = 0; slot < (int)connections.size(); ++slot)
+				if (connections[slot])
+					Remove(slot);
+			for (int i = 0; i < MaxBatchSize; ++i)
+			{
+				PacketPool::Release(receiveBuffers[i]);
+				receiveBuffers[i] = NULL;
+			}
+			socket.Close();
 		}
 
-		void ReadInteger(const unsigned char* data, unsigned int& value)
+		void SetAcceptHandler(const AcceptHandler& handler)
 		{
-			value = (((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) |
-				((unsigned int)data[2] << 8) | ((unsigned int)data[3]));
+			acceptHandler = handler;
 		}
 
-		void ReadHeader(const unsigned char* header, unsigned int& sequence, unsigned int& ack, unsigned int& ack_bits)
+		// reads one batch of datagrams and delivers each to its connection. the slots of the connections that got
+		// any are left in "touched" (once each): they have to be read before the next Receive reuses the buffers
+
+		int Receive(std::vector<int>& touched)
 		{
-			ReadInteger(header, sequence);
-			ReadInteger(header + 4, ack);
-			ReadInteger(header + 8, ack_bits);
+			for (size_t i = 0; i < touched.size(); ++i)
+				if (connections[touched[i]])
+					connections[touched[i]]->ClearDelivered();
+			touched.clear();
+			Address senders[MaxBatchSize];
+			int offsets[MaxBatchSize];
+			int sizes[MaxBatchSize];
+			int segments[MaxBatchSize];
+			int received;
+			if (socket.IsRingEnabled())
+				received = socket.ReceiveInPlace(senders, receiveBuffers, offsets, sizes, segments, MaxBatchSize);
+			else
+			{
+				for (int i = 0; i < MaxBatchSize; ++i)
+					pool->Recycle(receiveBuffers[i]);
+				received = socket.ReceiveBatch(senders, receiveBuffers, pool->GetBufferSize(), sizes, MaxBatchSize, segments);
+				for (int i = 0; i < received; ++i)
+					offsets[i] = 0;
+			}
+			for (int i = 0; i < received; ++i)
+			{
+				unsigned int id = Connection::ReadConnectionId(receiveBuffers[i] + offsets[i], sizes[i], protocolId);
+				if (id == 0)
+					continue;
+				int slot = Find(senders[i], id);
+				if (slot < 0)
+					slot = Accept(senders[i], id);
+				if (slot < 0)
+					continue;
+				if (!connections[slot]->WaitForPacket(0.0f))
+					touched.push_back(slot);
+				connections[slot]->Deliver(receiveBuffers[i], offsets[i], sizes[i], segments[i] > 0 ? segments[i] : sizes[i]);
+			}
+			return received;
 		}
 
-		virtual void OnStop()
+		// detaches a session's connection, its peer's next datagram opens a new session
+
+		void Remove(int slot)
 		{
-			ClearData();
+			assert(slot >= 0 && slot < (int)connections.size() && connections[slot]);
+			Erase(keys[slot]);
+			if (connections[slot]->IsRunning())
+				connections[slot]->Stop();
+			connections[slot] = NULL;
+			free_slots.push_back(slot);
 		}
 
-		virtual void OnDisconnect()
+		Connection* GetConnection(int slot) const
 		{
-			ClearData();
+			return connections[slot];
+		}
+
+		int GetMaxSessions() const
+		{
+			return (int)connections.size();
+		}
+
+		int GetSessionCount() const
+		{
+			return (int)(connections.size() - free_slots.size());
+		}
+
+		bool WaitForPacket(float timeout)
+		{
+			return socket.Wait(timeout);
 		}
 
 	private:
 
-		void ClearData()
+		struct Entry
 		{
-			reliabilitySystem.Reset();
+			unsigned int address = 0;
+			unsigned short port = 0;
+			bool used = false;
+			unsigned int connection_id = 0;
+			int slot = -1;
+		};
+
+		unsigned int Hash(unsigned int address, unsigned short port, unsigned int connection_id) const
+		{
+			unsigned int hash = address * 0x9E3779B1u ^ port * 0x85EBCA77u ^ connection_id * 0xC2B2AE3Du;
+			hash ^= hash >> 15;
+			return hash & (unsigned int)(entries.size() - 1);
 		}
 
-#ifdef NET_UNIT_TEST
-		unsigned int packet_loss_mask;			// mask sequence number, if non-zero, drop packet - for unit test only
-#endif
+		int Find(const Address& address, unsigned int connection_id) const
+		{
+			const unsigned int mask = (unsigned int)(entries.size() - 1);
+			for (unsigned int i = Hash(address.GetAddress(), address.GetPort(), connection_id); entries[i].used; i = (i + 1) & mask)
+			{
+				const Entry& entry = entries[i];
+				if (entry.address == address.GetAddress() && entry.port == address.GetPort() && entry.connection_id == connection_id)
+					return entry.slot;
+			}
+			return -1;
+		}
 
-		ReliabilitySystem reliabilitySystem;	// reliability system: manages sequence numbers and acks, tracks network stats etc.
+		int Accept(const Address& address, unsigned int connection_id)
+		{
+			if (free_slots.empty() || !acceptHandler)
+				return -1;
+			const int slot = free_slots.back();
+			Connection* connection = acceptHandler(slot, address, connection_id);
+			if (!connection)
+				return -1;
+			free_slots.pop_back();
+			connection->Attach(socket, address, connection_id, pool);
+			connections[slot] = connection;
+
+			Entry entry;
+			entry.address = address.GetAddress();
+			entry.port = address.GetPort();
+			entry.used = true;
+			entry.connection_id = connection_id;
+			entry.slot = slot;
+			const unsigned int mask = (unsigned int)(entries.size() - 1);
+			unsigned int i = Hash(entry.address, entry.port, connection_id);
+			while (entries[i].used)
+				i = (i + 1) & mask;
+			entries[i] = entry;
+			keys[slot] = entry;
+			return slot;
+		}
+
+		// linear probing: entries after the erased one move back into the hole unless that would put them
+		// ahead of their home position, so no tombstones pile up as sessions come and go
+
+		void Erase(const Entry& key)
+		{
+			const unsigned int mask = (unsigned int)(entries.size() - 1);
+			unsigned int hole = Hash(key.address, key.port, key.connection_id);
+			while (entries[hole].used && !(entries[hole].address == key.address && entries[hole].port == key.port &&
+				entries[hole].connection_id == key.connection_id))
+				hole = (hole + 1) & mask;
+			if (!entries[hole].used)
+				return;
+			entries[hole] = Entry();
+			for (unsigned int i = (hole + 1) & mask; entries[i].used; i = (i + 1) & mask)
+			{
+				const unsigned int home = Hash(entries[i].address, entries[i].port, entries[i].connection_id);
+				if (((i - home) & mask) >= ((i - hole) & mask))
+				{
+					entries[hole] = entries[i];
+					entries[i] = Entry();
+					hole = i;
+				}
+			}
+		}
+
+		unsigned int protocolId;
+		int max_packet_size;
+		Socket socket;
+		std::shared_ptr<PacketPool> pool;		// shared with the attached connections, which keep the buffers of the messages they hold
+		unsigned char* receiveBuffers[MaxBatchSize];	// datagrams of every session, until their connections have read (or referenced) them
+		AcceptHandler acceptHandler;
+		std::vector<Entry> entries;				// open-addressed by peer address, port and connection id
+		std::vector<Connection*> connections;	// by slot
+		std::vector<Entry> keys;				// by slot, to find the entry again
+		std::vector<int> free_slots;
 	};
 }
 
@@ -10,9 +10,19 @@
 #include <vector>
 #include <ctime>
 #include <algorithm>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
 
 #include "fileHandler.h"
+#include "crc32.h"
+#include "merkle.h"
+#include "compress.h"
+#include "packetizer.h"
 #include "Net.h"
+#include "EventLoop.h"
+#include "CongestionControl.h"
 
 //#define SHOW_ACKS
 
@@ -22,103 +32,696 @@ using namespace net;
 const int ServerPort = 30000;
 const int ClientPort = 30001;
 const int ProtocolId = 0x11223344;
-const float DeltaTime = 1.0f / 30.0f;
-const float SendRate = 1.0f / 30.0f;
+const float DeltaTime = 1.0f / 30.0f;		// hello interval while the client connects
+const float KeepAliveInterval = 1.0f;	// liveness only: acks travel in ack packets
+const float UpdateInterval = 0.01f;		// connection upkeep: timeouts and resends
+const float StatsInterval = 0.25f;
+const float JournalInterval = 1.0f;		// how often the receiver checkpoints its progress to disk
+const float SendBurst = 2.0f;			// packets the pacer may always send back to back
+const float PacingQuantum = 0.002f;		// seconds worth of sending the pacer may release at once
 const float TimeOut = 10.0f;
-const int PacketSize = 256;
+const int MaxSessions = 256;			// uploads each server worker takes at once, one session each
+const int MaxWorkers = 64;				// server threads, one per core, each with its own socket on the server port
 
-class FlowControl
+// ----------------------------------------------
+
+//Tracks the file transfer states
+enum TransferState {
+	idle,
+	probingPath,
+	sendingMetadata,
+	sendingManifest,
+	waitingForResume,
+	sendingDelta,
+	sendingFile,
+	resendingFile,
+	sendingChecksum,
+	receivingMetadata,
+	receivingManifest,
+	receivingFile,
+	receivingChecksum,
+	completed
+};
+
+// One upload the server is receiving: its own connection (sequence numbers, acks, resends and congestion
+// control) on the shared port, and everything about the file it is writing
+struct Session
 {
-public:
+	Session(CongestionControl* congestion, int worker)
+		: connection(ProtocolId, TimeOut), congestion(congestion), worker(worker)
+	{
+		connection.SetCongestionControl(congestion);
+	}
 
-	FlowControl()
+	~Session()
 	{
-		printf("flow control initialized\n");
-		Reset();
+		connection.SetCongestionControl(NULL);
+		delete congestion;
 	}
 
-	void Reset()
+	ReliableConnection connection;
+	CongestionControl* congestion;
+	int worker;						// the server thread that owns the session
+	TransferState transferState = receivingMetadata;
+	FileMetadata metadata = {};		// what the sender said (the name only while handling that packet)
+	FileMetadata trailer = {};		// the trailer, once it is in
+	bool trailerReceived = false;
+	uint64_t resendFrom = 0;		// where the next range to ask for again is searched from
+	int resendRequests = 0;			// ranges asked for again since the last trailer
+	bool resendPending = false;		// the send window filled before every missing range was asked for
+	FileSink sink = {};				// chunks go straight to disk
+	ChunkTracker chunks = {};		// which chunks are in, and their CRC
+	Manifest manifest = {};			// hash of every chunk, checked against its root
+	BlockAssembler assembler = {};	// compressed blocks whose messages are still coming in
+	unsigned int damagedChunks = 0;	// chunks dropped by the CRC-32C or manifest check
+	char savePath[512] = "";
+	char partPath[sizeof(savePath) + 8] = "";		// the file while it is incomplete
+	char journalPath[sizeof(savePath) + 8] = "";	// which chunks of the partial file are on disk
+	bool journalDirty = false;		// chunks arrived since the last checkpoint
+	bool claimed = false;			// savePath is ours in fileClaims
+	size_t currentOffset = 0;
+	Signature basisSignature = {};	// the old copy, block by block, while it goes out
+	uint64_t signatureBlocksSent = 0;
+	bool signaturePending = false;	// the signature still has to go out, then the resume offset
+	MappedFile basisFile = {};		// copy from an earlier transfer, unchanged chunks are copied from there
+	TokenBucket sendBucket;			// paces the signature
+	double lastUpdateTime = 0.0;
+	clock_t transfer_start = 0, transfer_end = 0;
+};
+
+// sends messages built in buffers from ReserveReliable, as many as the windows take; the rest go back unsent.
+// Returns how many went out
+
+static int sendBuilt(ReliableConnection& connection, unsigned char* const messages[], const int sizes[], int count)
+{
+	int sent = connection.CommitReliableBatch(messages, sizes, count);
+	for (int i = sent; i < count; ++i)
+		connection.CancelReliable(messages[i]);
+	return sent;
+}
+
+// make the chunks written so far durable, then record them in the journal
+
+static void saveCheckpoint(Session& s)
+{
+	if (!s.journalDirty)
+		return;
+	if (fileSinkSync(&s.sink) != 0 || journalSave(s.journalPath, &s.metadata, &s.chunks) != 0)
+		printf("Failed to checkpoint %s\n", s.journalPath);
+	s.journalDirty = false;
+}
+
+// tell the sender where to start, everything before the first gap is already on disk
+
+static bool sendResume(Session& s)
+{
+	uint64_t gapOffset = s.metadata.fileSize, gapLength = 0;
+	chunkTrackerFindGap(&s.chunks, 0, &gapOffset, &gapLength);
+	char resume[RESUME_PACKET_SIZE];
+	return s.connection.SendReliable((unsigned char*)resume, (int)createResumePacket(gapOffset, resume));
+}
+
+// ask again for the ranges still missing, as many as the send window takes. The rest go out from the server
+// loop as acks make room, so no range is skipped because its request didn't fit
+
+static void sendResendRequests(Session& s)
+{
+	while (s.resendPending && s.connection.CanSendReliable())
 	{
-		mode = Bad;
-		penalty_time = 4.0f;
-		good_conditions_time = 0.0f;
-		penalty_reduction_accumulator = 0.0f;
+		uint64_t gapOffset = 0, gapLength = 0;
+		if (s.transferState != receivingFile || !chunkTrackerFindGap(&s.chunks, s.resendFrom, &gapOffset, &gapLength)) {
+			if (s.transferState == receivingFile)
+				printf("Asked again for %d missing ranges\n", s.resendRequests);
+			s.resendPending = false;
+			break;
+		}
+		char request[RESEND_REQUEST_SIZE];
+		if (!s.connection.SendReliable((unsigned char*)request, (int)createResendRequest(gapOffset, gapLength, request)))
+			break;
+		s.resendFrom = gapOffset + gapLength;
+		s.resendRequests++;
+	}
+}
+
+// a chunk that matches its hash in the manifest goes to its offset; the bitmap catches
+// duplicates and tells when the file is whole. False if it can't be written (the transfer starts over)
+
+static bool placeChunk(Session& s, uint64_t chunkOffset, const char* chunkData, size_t chunkSize, bool inSink)
+{
+	if (!manifestCheckChunk(&s.manifest, chunkOffset, chunkData, chunkSize)) {
+		s.damagedChunks++;
+		return true;
+	}
+	int added = chunkTrackerAdd(&s.chunks, chunkOffset, chunkData, chunkSize);
+	if (added < 0)
+		printf("Ignoring chunk at offset %llu (%zu bytes)\n", (unsigned long long)chunkOffset, chunkSize);
+	if (added <= 0)
+		return true;
+	if ((inSink ? fileSinkCommit(&s.sink, chunkSize) : fileSinkWrite(&s.sink, chunkOffset, chunkData, chunkSize)) != 0) {
+		printf("Failed to write to %s\n", s.partPath);
+		closeFileSink(&s.sink);
+		unmapFile(&s.basisFile);
+		remove(s.partPath);
+		remove(s.journalPath);
+		s.transferState = receivingMetadata;
+		return false;
+	}
+	s.currentOffset += chunkSize;
+	s.journalDirty = true;
+
+	if (chunkTrackerComplete(&s.chunks)) {
+		s.transfer_end = clock();
+		s.transferState = receivingChecksum;
+	}
+	return true;
+}
+
+// files being written, across all workers: two sessions must never write the same one. Only taken
+// when a transfer starts or ends, the packets themselves never wait on the lock
+
+struct FileClaim
+{
+	Session* session;
+	int worker;
+};
+
+static std::mutex claimsMutex;
+static std::map<std::string, FileClaim> fileClaims;
+
+// claims savePath for the session. If another session has it, that one is returned (and the claim fails)
+
+static FileClaim claimFile(Session& s)
+{
+	std::lock_guard<std::mutex> lock(claimsMutex);
+	std::map<std::string, FileClaim>::iterator claim = fileClaims.find(s.savePath);
+	if (claim != fileClaims.end() && claim->second.session != &s)
+		return claim->second;
+	FileClaim own = { &s, s.worker };
+	fileClaims[s.savePath] = own;
+	s.claimed = true;
+	FileClaim none = { nullptr, -1 };
+	return none;
+}
+
+// a session holds its file only while receiving it
+
+static void releaseFile(Session& s)
+{
+	if (!s.claimed)
+		return;
+	std::lock_guard<std::mutex> lock(claimsMutex);
+	std::map<std::string, FileClaim>::iterator claim = fileClaims.find(s.savePath);
+	if (claim != fileClaims.end() && claim->second.session == &s)
+		fileClaims.erase(claim);
+	s.claimed = false;
+}
+
+// the peer went quiet: an interrupted transfer is checkpointed and dropped, the sender's next attempt resumes from the journal
+
+static void closeSession(Session& s)
+{
+	if (s.transferState == receivingManifest || s.transferState == receivingFile || s.transferState == receivingChecksum) {
+		saveCheckpoint(s);
+		printf("Transfer interrupted, %s keeps the progress\n", s.journalPath);
 	}
+	closeFileSink(&s.sink);
+	chunkTrackerFree(&s.chunks);
+	manifestFree(&s.manifest);
+	blockAssemblerFree(&s.assembler);
+	unmapFile(&s.basisFile);
+	signatureFree(&s.basisSignature);
+	releaseFile(s);
+}
+
+// reads every message the session's connection has, the datagrams were delivered to it by the session table
 
-	void Update(float deltaTime, float rtt)
+static void receiveMessages(Session& s)
+{
+	while (true)
 	{
-		const float RTT_Threshold = 250.0f;
+		// the file is only held while it is being received
+		if (s.transferState == receivingMetadata || s.transferState == completed)
+			releaseFile(s);
+
+		    //1.Handle the first received packet as metadata containing file details (e.g., name, size).
+		    //2. If this is the first packet, treat it as metadata.
+			//3. Metadata processing: Extract file name and size to prepare for receiving file chunks.
+			//4. Example: Deserialize packet data to retrieve file name and size.
+
+		// Data chunks carry their offset and trailer pieces theirs, so once the manifest is in everything is taken as it arrives.
+		// The message is read where it landed, it stays valid until the next read
+		bool inOrder = s.transferState != receivingFile && s.transferState != receivingChecksum;
+		int bytesRead = 0;
+		const unsigned char* packet = s.connection.ReadReliable(bytesRead, inOrder);
+		if (!packet)
+			break;
+		int messageType = getMessageType((const char*)packet, bytesRead);
 
-		if (mode == Good)
-		{
-			if (rtt > RTT_Threshold)
-			{
-				printf("*** dropping to bad mode ***\n");
-				mode = Bad;
-				if (good_conditions_time < 10.0f && penalty_time < 60.0f)
-				{
-					penalty_time *= 2.0f;
-					if (penalty_time > 60.0f)
-						penalty_time = 60.0f;
-					printf("penalty time increased to %.1f\n", penalty_time);
+		switch (s.transferState) {
+		
+		case receivingMetadata: {
+			if (extractMetadataPacket((char*)packet, bytesRead, &s.metadata) && !s.metadata.isLastPacket) {
+				printf("Receiving file: %.*s (Size: %llu bytes, %u byte chunks)\n", (int)s.metadata.filenameLength, s.metadata.filename,
+					(unsigned long long)s.metadata.fileSize, s.metadata.chunkSize);
+
+				// Chunks must fit the receive buffer (compressed: be one block), and arrive in a form this build understands
+				bool compressed = s.metadata.compression == COMPRESSION_LZ;
+				if (s.metadata.chunkSize == 0 || (compressed ? s.metadata.chunkSize != COMPRESSION_BLOCK_SIZE : s.metadata.chunkSize + DATA_HEADER_SIZE > (size_t)s.connection.GetRetransmissionSystem().GetMaxMessageSize())) {
+					printf("Unsupported chunk size: %u bytes\n", s.metadata.chunkSize);
+					break;
+				}
+				if (s.metadata.hashAlgorithm != HASH_XXH64 || (s.metadata.compression != COMPRESSION_NONE && !compressed)) {
+					printf("Unsupported hash algorithm %u or compression %u\n", s.metadata.hashAlgorithm, s.metadata.compression);
+					break;
 				}
-				good_conditions_time = 0.0f;
-				penalty_reduction_accumulator = 0.0f;
-				return;
-			}
 
-			good_conditions_time += deltaTime;
-			penalty_reduction_accumulator += deltaTime;
+				// Never trust a path from the peer: keep only the file name. The name is still in the packet, copy it out
+				size_t nameStart = 0;
+				for (size_t i = 0; i < s.metadata.filenameLength; i++)
+					if (s.metadata.filename[i] == '/' || s.metadata.filename[i] == '\\' || s.metadata.filename[i] == '\0')
+						nameStart = i + 1;
+				snprintf(s.savePath, sizeof(s.savePath), "received_%.*s", (int)(s.metadata.filenameLength - nameStart), s.metadata.filename + nameStart);
+				snprintf(s.partPath, sizeof(s.partPath), "%s.part", s.savePath);
+				snprintf(s.journalPath, sizeof(s.journalPath), "%s.journal", s.savePath);
+				s.metadata.filename = nullptr;
+				s.metadata.filenameLength = 0;
+				// A client that started over before its old session timed out takes the file over (and its journal),
+				// anyone else has to wait for that upload to finish
+				// (when both sessions are on this worker: another worker's sessions are never touched from here)
+				FileClaim writer = claimFile(s);
+				if (writer.session && writer.worker == s.worker &&
+					writer.session->connection.GetAddress().GetAddress() == s.connection.GetAddress().GetAddress()) {
+					closeSession(*writer.session);
+					writer.session->transferState = receivingMetadata;
+					writer = claimFile(s);
+				}
+				if (writer.session) {
+					printf("%s is already being received, refusing a second upload of it\n", s.savePath);
+					break;
+				}
 
-			if (penalty_reduction_accumulator > 10.0f && penalty_time > 1.0f)
-			{
-				penalty_time /= 2.0f;
-				if (penalty_time < 1.0f)
-					penalty_time = 1.0f;
-				printf("penalty time reduced to %.1f\n", penalty_time);
-				penalty_reduction_accumulator = 0.0f;
+				chunkTrackerFree(&s.chunks);
+				manifestFree(&s.manifest);
+				blockAssemblerFree(&s.assembler);
+				if (chunkTrackerInit(&s.chunks, s.metadata.fileSize, s.metadata.chunkSize) != 0 ||
+					manifestInit(&s.manifest, s.metadata.fileSize, s.metadata.chunkSize) != 0 ||
+					(compressed && blockAssemblerInit(&s.assembler) != 0)) {
+					printf("Failed to track %llu bytes in %u byte chunks\n", (unsigned long long)s.metadata.fileSize, s.metadata.chunkSize);
+					break;
+				}
+
+				// Pick up a partial copy of this same file (size, modification time and CRC all match)
+				uint64_t partTime = 0;
+				bool resumed = getFileModifiedTime(s.partPath, &partTime) == 0 && journalLoad(s.journalPath, &s.metadata, &s.chunks) == 0;
+				if (!resumed)
+					remove(s.journalPath);	// a rejected journal left the tracker empty
+				if (openFileSink(s.partPath, s.metadata.fileSize, &s.sink, resumed) != 0) {
+					printf("Failed to create output file for %llu bytes\n", (unsigned long long)s.metadata.fileSize);
+					break;
+				}
+
+				// A fresh start on a file received before: describe the old copy so only the changes are sent.
+				// The resume offset follows the signature, otherwise it goes right away
+				unmapFile(&s.basisFile);
+				signatureFree(&s.basisSignature);
+				s.signaturePending = false;
+				if (s.metadata.deltaOffered && !resumed && mapFile(s.savePath, &s.basisFile) == 0 && s.basisFile.size > 0 &&
+					signatureBuild(&s.basisSignature, s.basisFile.data, s.basisFile.size, signatureBlockSize(s.basisFile.size)) == 0) {
+					printf("Sending the signature of %s: %llu blocks of %u bytes\n", s.savePath,
+						(unsigned long long)s.basisSignature.blockCount, s.basisSignature.blockSize);
+					s.signatureBlocksSent = 0;
+					s.signaturePending = true;
+				}
+				else {
+					unmapFile(&s.basisFile);
+					sendResume(s);
+				}
+				if (resumed)
+					printf("Resuming from %s: %llu of %llu chunks already received\n", s.journalPath,
+						(unsigned long long)s.chunks.receivedChunks, (unsigned long long)s.chunks.chunkCount);
+
+				s.currentOffset = 0;
+				s.trailerReceived = false;
+				s.resendPending = false;
+				s.damagedChunks = 0;
+				s.journalDirty = false;
+				s.transferState = receivingManifest;
 			}
+			if (s.transferState != receivingManifest || !manifestComplete(&s.manifest))
+				break;
 		}
+			[[fallthrough]];
+		case receivingManifest:
+			// Also reached straight from the metadata when there are no chunk hashes to wait for (an empty file)
+			if (messageType == MESSAGE_MANIFEST && !extractManifestPacket((const char*)packet, bytesRead, &s.manifest)) {
+				printf("Ignoring a manifest packet out of place\n");
+				break;
+			}
+			if (manifestComplete(&s.manifest)) {
+				// The hashes are only as good as their root, which came with the metadata
+				if (manifestRoot(&s.manifest) != s.metadata.rootHash) {
+					printf("Chunk manifest doesn't match its root hash\n");
+					closeFileSink(&s.sink);
+					s.transferState = receivingMetadata;
+					break;
+				}
+				s.transferState = chunkTrackerComplete(&s.chunks) ? receivingChecksum : receivingFile;
+			}
+			break;
+		case receivingFile: {
+			if (messageType == MESSAGE_METADATA) {
+				// The trailer came before some chunks did: ask again for just the missing ranges
+				if (!extractMetadataPacket((char*)packet, bytesRead, &s.trailer) || !s.trailer.isLastPacket)
+					break;
+				s.trailerReceived = true;
+				s.resendFrom = 0;
+				s.resendRequests = 0;
+				s.resendPending = true;
+				sendResendRequests(s);
+				break;
+			}
 
-		if (mode == Bad)
-		{
-			if (rtt <= RTT_Threshold)
-				good_conditions_time += deltaTime;
-			else
-				good_conditions_time = 0.0f;
+			if (messageType == MESSAGE_COPY) {
+				// Whole chunks the old copy already has. They are checked against the manifest like any other,
+				// a chunk that doesn't match (the old copy changed meanwhile) is asked for again after the trailer
+				DeltaCopy copy;
+				if (!extractCopyPacket((const char*)packet, bytesRead, &copy) || copy.offset % s.metadata.chunkSize != 0 ||
+					copy.offset > s.metadata.fileSize || copy.length > s.metadata.fileSize - copy.offset ||
+					copy.basisOffset > s.basisFile.size || copy.length > s.basisFile.size - copy.basisOffset) {
+					s.damagedChunks++;
+					break;
+				}
+				bool placed = true;
+				for (uint64_t done = 0; placed && done < copy.length; done += s.metadata.chunkSize)
+					placed = placeChunk(s, copy.offset + done, s.basisFile.data + copy.basisOffset + done,
+						(size_t)std::min<uint64_t>(s.metadata.chunkSize, copy.length - done), false);
+				if (!placed || !s.trailerReceived || !chunkTrackerComplete(&s.chunks))
+					break;
+			}
+			else {
+				// Each chunk is checked on its own (CRC-32C of the packet, then its hash in the manifest)
+				uint64_t chunkOffset = 0;
+				const char* chunkData = nullptr;
+				size_t chunkSize = 0;
+				bool inSink = false;	// decompressed straight into the sink, only committed once it checks out
+				if (messageType == MESSAGE_BLOCK) {
+					// A compressed chunk is a block, once all its messages are in
+					BlockFragment fragment;
+					EncodedBlock block;
+					int assembled = extractBlockPacket((const char*)packet, bytesRead, &fragment) ? blockAssemblerAdd(&s.assembler, &fragment, &block) : -1;
+					if (assembled < 0) {
+						s.damagedChunks++;
+						break;
+					}
+					if (assembled == 0)
+						break;
+					chunkOffset = block.offset;
+					chunkSize = block.offset < s.metadata.fileSize ? (size_t)std::min<uint64_t>(s.metadata.chunkSize, s.metadata.fileSize - block.offset) : 0;
+					if (block.compressed) {
+						char* window = fileSinkReserve(&s.sink, chunkOffset, chunkSize);
+						inSink = window && lzDecompress(block.data, block.size, window, chunkSize);
+						chunkData = window;
+					}
+					else if (block.size == chunkSize) {
+						chunkData = block.data;
+					}
+					if (chunkSize == 0 || !chunkData || (block.compressed && !inSink)) {
+						s.damagedChunks++;
+						break;
+					}
+				}
+				else if (!extractDataPacket((const char*)packet, bytesRead, &chunkOffset, &chunkData, &chunkSize)) {
+					s.damagedChunks++;  // left as a gap, asked for again after the trailer
+					break;
+				}
+				if (!placeChunk(s, chunkOffset, chunkData, chunkSize, inSink) || !s.trailerReceived || !chunkTrackerComplete(&s.chunks))
+					break;
+			}
+		}
+			[[fallthrough]];
+		case receivingChecksum: {
+			// The sender's CRC arrives in a trailer after the last chunk,
+			// or the last resent chunk completes a file whose trailer is already here
+			if (!s.trailerReceived) {
+				if (!extractMetadataPacket((char*)packet, bytesRead, &s.trailer) || !s.trailer.isLastPacket)
+					break;
+				s.trailerReceived = true;
+			}
+			s.metadata.crc = s.trailer.crc;
+
+			// Every chunk matched the manifest, so there is no pass over the file: the CRC built on the fly
+			// is only a cross-check, skipped when chunks came too far out of order to keep it
+			uint32_t receivedCRC = 0;
+			bool crcMatches = !chunkTrackerCRC(&s.chunks, &receivedCRC) || receivedCRC == s.metadata.crc;
+			chunkTrackerFree(&s.chunks);
+			manifestFree(&s.manifest);
+			blockAssemblerFree(&s.assembler);
+			bool saved = closeFileSink(&s.sink) == 0;
+			remove(s.journalPath);
+
+			// Only a file that checked out replaces the old copy, which stays the delta basis otherwise
+			if (crcMatches) {
+				unmapFile(&s.basisFile);
+				saved = saved && replaceFile(s.partPath, s.savePath) == 0;
+				if (saved) {
+					double duration = (double)(s.transfer_end - s.transfer_start) / CLOCKS_PER_SEC;
+					double speed = calculateTransferSpeed(s.transfer_start, s.transfer_end, (size_t)s.metadata.fileSize);
+					printf("File received successfully\n");
+					printf("Saved as: %s\n", s.savePath);
+					printf("File received in %.2f seconds\n", duration);
+					printf("Transfer speed: %.2f Mbps\n", speed);
+					if (s.damagedChunks > 0)
+						printf("Damaged chunks received again: %u\n", s.damagedChunks);
+					printf("CRC verification: PASSED\n");
+				}
+				s.transferState = completed;
+			}
+			else {
+				printf("CRC verification failed!\n");
+				remove(s.partPath);
+				s.currentOffset = 0;
+				s.transferState = receivingMetadata;
+				continue;  // Restart loop safely
+			}
+		}
+			break;
 
-			if (good_conditions_time > penalty_time)
-			{
-				printf("*** upgrading to good mode ***\n");
-				good_conditions_time = 0.0f;
-				penalty_reduction_accumulator = 0.0f;
-				mode = Good;
-				return;
+		default:
+			break;
+		}
+	}
+}
+
+// the signature of the old copy, as many blocks per packet as fit and as many packets as the pacer allows, then where to start
+
+static void sendSignature(Session& s)
+{
+	unsigned char* batchData[MaxBatchSize];
+	int batchSizes[MaxBatchSize];
+	const int payloadSize = s.connection.GetMessageSizeLimit();
+	const double sendRate = s.congestion->GetPacingRate();
+	s.sendBucket.SetRate(sendRate, std::max((double)SendBurst * payloadSize, sendRate * PacingQuantum));
+	s.sendBucket.Update(GetTime());
+
+	while (s.signaturePending && s.connection.CanSendReliable() && s.sendBucket.CanConsume(payloadSize))
+	{
+		int packetsSent = 0;
+		if (s.signatureBlocksSent < s.basisSignature.blockCount) {
+			int batchCount = 0;
+			uint64_t batchBlocks[MaxBatchSize];
+			uint64_t block = s.signatureBlocksSent;
+			while (batchCount < MaxBatchSize && block < s.basisSignature.blockCount) {
+				unsigned char* piece = s.connection.ReserveReliable();
+				size_t packetSize;
+				batchBlocks[batchCount] = createSignaturePacket(&s.basisSignature, block, (char*)piece, payloadSize, &packetSize);
+				if (batchBlocks[batchCount] == 0) {
+					// No room for even one block: no signature, the sender sends the whole file
+					s.connection.CancelReliable(piece);
+					s.signatureBlocksSent = s.basisSignature.blockCount;
+					break;
+				}
+				batchData[batchCount] = piece;
+				batchSizes[batchCount] = (int)packetSize;
+				block += batchBlocks[batchCount];
+				batchCount++;
 			}
+			packetsSent = sendBuilt(s.connection, batchData, batchSizes, batchCount);
+			for (int i = 0; i < packetsSent; ++i)
+				s.signatureBlocksSent += batchBlocks[i];
+		}
+		if (s.signatureBlocksSent >= s.basisSignature.blockCount && sendResume(s)) {
+			packetsSent++;
+			signatureFree(&s.basisSignature);
+			s.signaturePending = false;
 		}
+		if (packetsSent == 0)
+			break;
+		s.sendBucket.Consume(packetsSent * payloadSize);
 	}
+}
 
-	float GetSendRate()
+// a server worker: one socket, a session for every client that sends to it. Each loop reads a batch of datagrams,
+// hands them to their sessions and lets each read its messages, then sleeps until the next datagram or timer
+
+static int serveUploads(const char* congestionName, int worker, bool sharePort)
+{
+	SessionTable table(ProtocolId, MaxSessions);
+	std::vector<Session*> sessions(MaxSessions, nullptr);
+
+	table.SetAcceptHandler([&](int slot, const Address& address, unsigned int connectionId) -> Connection* {
+		Session* session = new Session(CreateCongestionControl(congestionName), worker);
+		session->lastUpdateTime = GetTime();
+		session->transfer_start = clock();
+		sessions[slot] = session;
+		printf("client %d.%d.%d.%d:%d connected (worker %d, session %d, connection %08x)\n", address.GetA(), address.GetB(),
+			address.GetC(), address.GetD(), address.GetPort(), worker, slot, connectionId);
+		return &session->connection;
+	});
+
+	if (!table.Start(ServerPort, sharePort))
 	{
-		return mode == Good ? 30.0f : 10.0f;
+		printf("could not start session table on port %d\n", ServerPort);
+		return 1;
 	}
 
-private:
+	TimerWheel timers;
+	timers.Start(GetTime());
 
-	enum Mode
+	// update every connection (this also resends lost messages once their timeout expires), and drop the quiet ones
+
+	timers.Schedule(UpdateInterval, [&]() {
+		double now = GetTime();
+		for (int slot = 0; slot < MaxSessions; ++slot)
+		{
+			Session* s = sessions[slot];
+			if (!s)
+				continue;
+			s->connection.Update((float)(now - s->lastUpdateTime));
+			s->lastUpdateTime = now;
+			if (s->connection.IsConnected())
+				continue;
+			closeSession(*s);
+			table.Remove(slot);
+			delete s;
+			sessions[slot] = nullptr;
+			printf("worker %d: session %d closed, %d left\n", worker, slot, table.GetSessionCount());
+		}
+	}, UpdateInterval);
+
+	// the receiver acks on its own (ack packets), keepalives only show the connection is still there
+
+	timers.Schedule(KeepAliveInterval, [&]() {
+		for (int slot = 0; slot < MaxSessions; ++slot)
+			if (sessions[slot])
+				sessions[slot]->connection.SendKeepAlive();
+	}, KeepAliveInterval);
+
+	// show stats for all of the worker's sessions together
+
+	timers.Schedule(StatsInterval, [&]() {
+		int active = 0, receiving = 0;
+		unsigned int sent_packets = 0, lost_packets = 0, resent_messages = 0;
+		float rtt = 0.0f, acked_bandwidth = 0.0f;
+		double received = 0.0;
+		for (int slot = 0; slot < MaxSessions; ++slot)
+		{
+			Session* s = sessions[slot];
+			if (!s)
+				continue;
+			active++;
+			if (s->transferState == receivingManifest || s->transferState == receivingFile || s->transferState == receivingChecksum)
+				receiving++;
+			rtt += s->connection.GetReliabilitySystem().GetRoundTripTime();
+			sent_packets += s->connection.GetReliabilitySystem().GetSentPackets();
+			lost_packets += s->connection.GetReliabilitySystem().GetLostPackets();
+			acked_bandwidth += s->connection.GetReliabilitySystem().GetAckedBandwidth();
+			resent_messages += s->connection.GetRetransmissionSystem().GetResentMessages();
+			received += (double)s->currentOffset;
+		}
+		if (active == 0)
+			return;
+		printf("worker %d: %d sessions, %d receiving, %.1fMB received, avg rtt %.1fms, sent %d, lost %d, resent %d, acked bandwidth = %.1fkbps\n",
+			worker, active, receiving, received / (1024.0 * 1024.0), rtt / active * 1000.0f, sent_packets, lost_packets,
+			resent_messages, acked_bandwidth);
+	}, StatsInterval);
+
+	timers.Schedule(JournalInterval, [&]() {
+		for (int slot = 0; slot < MaxSessions; ++slot)
+			if (sessions[slot] && sessions[slot]->transferState == receivingFile)
+				saveCheckpoint(*sessions[slot]);
+	}, JournalInterval);
+
+	std::vector<int> touched;
+	while (true)
 	{
-		Good,
-		Bad
-	};
+		timers.Advance(GetTime());
 
-	Mode mode;
-	float penalty_time;
-	float good_conditions_time;
-	float penalty_reduction_accumulator;
-};
+		// a batch at a time until the socket is empty; each session reads its datagrams before the next batch reuses the buffers
+		while (table.Receive(touched) > 0)
+			for (size_t i = 0; i < touched.size(); i++)
+				receiveMessages(*sessions[touched[i]]);
 
+		// resend requests the send window had no room for, and signatures paced like the sender's data. Then sleep until a packet arrives,
+		// a timer or delayed ack is due, or a pacer lets the next packet out
 
+		double now = GetTime();
+		double timeout = timers.GetTimeUntilNext(now);
+		for (int slot = 0; slot < MaxSessions; ++slot)
+		{
+			Session* s = sessions[slot];
+			if (!s)
+				continue;
+			if (s->resendPending)
+				sendResendRequests(*s);
+			if (s->signaturePending)
+			{
+				sendSignature(*s);
+				if (s->signaturePending && s->connection.CanSendReliable())
+					timeout = min(timeout, s->sendBucket.GetTimeUntil(s->connection.GetMessageSizeLimit()));
+			}
+			timeout = min(timeout, s->connection.GetTimeUntilAck());
+		}
+		table.WaitForPacket((float)timeout);
+	}
+}
 
+// thread per core: each worker opens its own socket on the server port and owns its sessions outright. The kernel
+// keeps a client on one socket, so nothing about a transfer is shared between threads (only the file names, see claimFile)
+
+static int runServer(const char* congestionName, int workers)
+{
+	CongestionControl* check = CreateCongestionControl(congestionName);
+	if (!check)
+	{
+		printf("unknown congestion control: %s\n", congestionName);
+		return 1;
+	}
+	printf("congestion control: %s\n", check->GetName());
+	delete check;
+
+	if (workers > 1 && !NET_REUSE_PORT)
+	{
+		printf("the server port can't be shared on this platform, running one worker\n");
+		workers = 1;
+	}
+	if (workers <= 1)
+		return serveUploads(congestionName, 0, false);
+
+	printf("%d workers on port %d\n", workers, ServerPort);
+	const int cores = std::max(1, (int)std::thread::hardware_concurrency());
+	std::vector<int> results(workers, 0);
+	std::vector<std::thread> threads;
+	for (int worker = 0; worker < workers; worker++) {
+		threads.push_back(std::thread([&results, congestionName, worker, cores]() {
+			if (!PinThread(worker % cores))
+				printf("worker %d: could not pin to core %d\n", worker, worker % cores);
+			results[worker] = serveUploads(congestionName, worker, true);
+		}));
+	}
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+	return *std::max_element(results.begin(), results.end());
+}
 
 // ----------------------------------------------
 
@@ -134,22 +737,45 @@ int main(int argc, char* argv[])
 
 	Mode mode = Server;
 	Address address;
-	//Tracks the file transfer states
-	enum TransferState {
-		idle,
-		sendingMetadata,
-		sendingFile,
-		receivingMetadata,
-		receivingFile,
-		completed
-	} transferState = idle;
+	TransferState transferState = idle;
 
 	//Variables used in sending and receiving 
 	char* fileBuffer = nullptr;
+	MappedFile sourceFile = {};	// sender reads straight from the mapped file
+	const char* fileData = nullptr;
+	Manifest manifest = {};		// sender: hash of every chunk
+	uint64_t manifestLeavesSent = 0;
+	std::deque<std::pair<uint64_t, uint64_t> > resendRanges;	// sender: byte ranges (offset, length) the receiver asked for again
+	bool resumeKnown = false;	// sender: the receiver said where to start
+	uint64_t resumeOffset = 0;
+	uint64_t modifiedTime = 0;	// sender: file modification time, so the receiver can tell a changed file from its partial copy
 	size_t fileSize = 0;
 	size_t currentOffset = 0;
-	FileMetadata metadata;
-	char tempBuffer[PacketSize];
+	FileMetadata metadata = {};	// sender: what it announces
+	char tempBuffer[METADATA_MAX_SIZE];
+	int payloadSize = 0;			// bytes per data packet (offset header + file data), set from the path MTU
+	int maxPayloadSize = 0;			// optional limit from the command line
+	bool sendFailed = false;		// sender: something can't be sent at this payload size, give up
+	const char* congestionName = "cubic";
+	bool forwardErrorCorrection = false;	// client: send repair packets so lost chunks can be rebuilt without a resend
+	bool compression = false;			// client: offer compressed blocks in the metadata
+	CompressionPipeline* compressor = nullptr;	// sender: blocks compressed ahead on worker threads
+	PacketPipeline* packetizer = nullptr;	// sender: uncompressed packets built ahead on the reader and packetizer threads
+	EncodedBlock sendBlock = {};		// sender: block being cut into messages, from the pipeline
+	bool sendBlockTaken = false;
+	uint32_t sendFragment = 0;			// next message of sendBlock
+	EncodedBlock resendBlock = {};		// sender: block of a resend range, compressed on the spot
+	bool resendBlockReady = false;
+	uint32_t resendFragment = 0;
+	std::vector<char> resendScratch;
+	bool delta = false;					// client: offer to send only what the receiver's old copy lacks
+	int workers = NET_REUSE_PORT ? (int)std::thread::hardware_concurrency() : 1;	// server: threads sharing the server port, one per core
+	Signature basisSignature = {};		// the receiver's old copy, block by block, to match the file against
+	DeltaCopy* deltaCopies = nullptr;	// sender: chunks the receiver copies from its old copy, in file order
+	size_t deltaCopyCount = 0;
+	size_t deltaCopiesSent = 0;
+	unsigned char* batchData[MaxBatchSize];	// messages sent together in one batched call, built where the connection keeps them
+	int batchSizes[MaxBatchSize];
 
 
 
@@ -165,17 +791,47 @@ int main(int argc, char* argv[])
 			address = Address(a, b, c, d, ServerPort);
 		}
 	}
+	if (mode == Server) {
+		for (int i = 1; i + 1 < argc; i++)
+			if (strcmp(argv[i], "workers") == 0)
+				workers = atoi(argv[i + 1]);  // Optional "workers N", 1 for a single-threaded server
+		workers = std::min(std::max(workers, 1), MaxWorkers);
+	}
 
 	// initialize
+	init_crc32_table();
+	printf("crc32 backend: %s\n", crc32BackendName(crc32GetBackend()));
+
 	if (mode == Client && argc >= 3) {  // Make sure we have a filename argument
-		if (loadFile(argv[2], &fileBuffer, &fileSize) == 0) {
+		if (mapFile(argv[2], &sourceFile) == 0) {
+			fileData = sourceFile.data;
+			fileSize = sourceFile.size;
+			printf("File mapped successfully: %s (%zu bytes)\n", argv[2], fileSize);
+			transferState = probingPath;  // Set initial state for sending
+		}
+		else if (loadFile(argv[2], &fileBuffer, &fileSize) == 0) {
+			fileData = fileBuffer;
 			printf("File loaded successfully: %s (%zu bytes)\n", argv[2], fileSize);
-			transferState = sendingMetadata;  // Set initial state for sending
+			transferState = probingPath;
 		}
 		else {
 			printf("Failed to load file: %s\n", argv[2]);
 			return 1;
 		}
+		if (getFileModifiedTime(argv[2], &modifiedTime) != 0)
+			printf("Could not read the modification time of %s, resuming will not be possible\n", argv[2]);
+		if (argc >= 4)
+			maxPayloadSize = atoi(argv[3]);  // Optional cap on the payload size
+		if (argc >= 5)
+			congestionName = argv[4];  // Optional congestion controller: aimd, cubic or bbr
+		for (int i = 5; i < argc; i++) {
+			if (strcmp(argv[i], "fec") == 0)
+				forwardErrorCorrection = true;  // Optional "fec" for lossy links with a long round trip
+			else if (strcmp(argv[i], "compress") == 0)
+				compression = true;  // Optional "compress" for files that shrink (logs, CSV) on slow links
+			else if (strcmp(argv[i], "delta") == 0)
+				delta = true;  // Optional "delta" for a file the receiver has an older copy of
+		}
 	}
 	else {
 		transferState = receivingMetadata;
@@ -186,47 +842,164 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	ReliableConnection connection(ProtocolId, TimeOut);
+	if (mode == Server)
+	{
+		int result = runServer(congestionName, workers);
+		ShutdownSockets();
+		return result;
+	}
+
+	CongestionControl* congestion = CreateCongestionControl(congestionName);
+	if (!congestion)
+	{
+		printf("unknown congestion control: %s\n", congestionName);
+		return 1;
+	}
+	printf("congestion control: %s\n", congestion->GetName());
 
-	const int port = mode == Server ? ServerPort : ClientPort;
+	ReliableConnection connection(ProtocolId, TimeOut);
+	connection.SetCongestionControl(congestion);
+	connection.SetForwardErrorCorrection(forwardErrorCorrection);
 
-	if (!connection.Start(port))
+	// another client on this machine may have the usual port: any free one will do,
+	// the server tells its sessions apart by address and connection id
+	if (!connection.Start(ClientPort) && !connection.Start(0))
 	{
-		printf("could not start connection on port %d\n", port);
+		printf("could not start connection on port %d\n", ClientPort);
 		return 1;
 	}
 
-	if (mode == Client)
-		connection.Connect(address);
-	else
-		connection.Listen();
+	connection.Connect(address);
 
 	bool connected = false;
-	float sendAccumulator = 0.0f;
-	float statsAccumulator = 0.0f;
 
-	FlowControl flowControl;
+	payloadSize = connection.GetMessageSizeLimit();
+
 	clock_t transfer_start = clock(), transfer_end = clock();
-	while (true)
-	{
-		// update flow control
 
-		//Verify file integrity after receiving all chunks.
-		if (connection.IsConnected())
-			flowControl.Update(DeltaTime, connection.GetReliabilitySystem().GetRoundTripTime() * 1000.0f);
+	// periodic work runs off the timer wheel, sends are paced by the token bucket,
+	// and in between the loop sleeps on the socket so packets are handled as soon as they arrive
 
-		const float sendRate = flowControl.GetSendRate();
+	TimerWheel timers;
+	TokenBucket sendBucket;
+	double lastUpdateTime = GetTime();
+	timers.Start(lastUpdateTime);
 
-		// detect changes in connection state
+	// update connection (this also resends lost messages once their timeout expires)
+
+	timers.Schedule(UpdateInterval, [&]() {
+		double now = GetTime();
+
+		// show packets that were acked since the last update
+
+#ifdef SHOW_ACKS
+		unsigned int* acks = NULL;
+		int ack_count = 0;
+		connection.GetReliabilitySystem().GetAcks(&acks, ack_count);
+		if (ack_count > 0)
+		{
+			printf("acks: %d", acks[0]);
+			for (int i = 1; i < ack_count; ++i)
+				printf(",%d", acks[i]);
+			printf("\n");
+		}
+#endif
+
+		connection.Update((float)(now - lastUpdateTime));
+		lastUpdateTime = now;
+	}, UpdateInterval);
+
+	// the client says hello until the server answers (it has nothing else to send while probing)
+
+	timers.Schedule(DeltaTime, [&]() {
+		if (mode == Client && connection.IsConnecting())
+			connection.SendKeepAlive();
+	}, DeltaTime);
+
+	// show connection stats
+
+	timers.Schedule(StatsInterval, [&]() {
+		if (!connection.IsConnected())
+			return;
+
+		float rtt = connection.GetReliabilitySystem().GetRoundTripTime();
+
+		unsigned int sent_packets = connection.GetReliabilitySystem().GetSentPackets();
+		unsigned int acked_packets = connection.GetReliabilitySystem().GetAckedPackets();
+		unsigned int lost_packets = connection.GetReliabilitySystem().GetLostPackets();
+
+		float sent_bandwidth = connection.GetReliabilitySystem().GetSentBandwidth();
+		float acked_bandwidth = connection.GetReliabilitySystem().GetAckedBandwidth();
+		unsigned int resent_messages = connection.GetRetransmissionSystem().GetResentMessages();
+
+		printf("rtt %.1fms, sent %d, acked %d, lost %d (%.1f%%), resent %d, sent bandwidth = %.1fkbps, acked bandwidth = %.1fkbps\n",
+			rtt * 1000.0f, sent_packets, acked_packets, lost_packets,
+			sent_packets > 0.0f ? (float)lost_packets / (float)sent_packets * 100.0f : 0.0f,
+			resent_messages, sent_bandwidth, acked_bandwidth);
+		if (mode == Client)
+			printf("%s: cwnd %.1fKB, in flight %.1fKB, pacing %.2fMbps\n", congestion->GetName(),
+				congestion->GetCongestionWindow() / 1024.0, connection.GetReliabilitySystem().GetBytesInFlight() / 1024.0,
+				congestion->GetPacingRate() * 8.0 / 1.0e6);
+	}, StatsInterval);
+
+	// sender: the next messages of an encoded block, as many as the pacer allows. Returns how many went out
+
+	auto sendBlockFragments = [&](const EncodedBlock& block, uint32_t& fragment) {
+		uint32_t fragments = blockFragmentCount(&block, payloadSize);
+		int batchCount = 0;
+		int batchLimit = std::max(1, (int)(sendBucket.GetTokens() / payloadSize));
+		while (batchCount < batchLimit && batchCount < MaxBatchSize && fragment + batchCount < fragments) {
+			unsigned char* piece = connection.ReserveReliable();
+			batchData[batchCount] = piece;
+			batchSizes[batchCount] = (int)createBlockPacket(&block, fragment + batchCount, (char*)piece, payloadSize);
+			batchCount++;
+		}
+		int sent = sendBuilt(connection, batchData, batchSizes, batchCount);
+		fragment += sent;
+		return sent;
+	};
+
+	// sender: stops the packetizer threads, the buffers still lent to them go back to the connection
 
-		// Handle connection state changes for the server.
-        // Add logic to gracefully handle file transfers during connection interruptions.
+	auto stopPacketizer = [&]() {
+		char* leftovers[PACKETIZER_PACKETS];
+		int count = packetizerDestroy(packetizer, leftovers);
+		for (int i = 0; i < count; ++i)
+			connection.CancelReliable((unsigned char*)leftovers[i]);
+		packetizer = nullptr;
+	};
+
+	// true when the client has something it could send right now (so waiting on the pacer makes sense)
+
+	auto readyToSend = [&]() {
+		switch (transferState) {
+		case idle:
+		case sendingMetadata:
+			return true;
+		case sendingManifest:
+		case sendingDelta:
+		case resendingFile:
+			return connection.CanSendReliable();
+		case sendingFile:
+			return currentOffset < fileSize && connection.CanSendReliable();
+		case sendingChecksum:
+			return connection.GetRetransmissionSystem().GetMessagesInFlight() == 0;
+		default:
+			return false;
+		}
+	};
+
+	while (true)
+	{
+		timers.Advance(GetTime());
+
+		// detect changes in connection state
 
-		if (mode == Server && connected && !connection.IsConnected())
+		// The client gives up; running it again resumes where the receiver's journal says
+		if (mode == Client && connected && !connection.IsConnected())
 		{
-			flowControl.Reset();
-			printf("reset flow control\n");
-			connected = false;
+			printf("connection lost\n");
+			break;
 		}
 
 		if (!connected && connection.IsConnected())
@@ -235,58 +1008,232 @@ int main(int argc, char* argv[])
 			connected = true;
 			if (mode == Client) {
 				transfer_start = clock();
+				connection.DiscoverPathMtu();
 			}
 			
 		}
 
+		// The payload size is fixed once probing settles, then announced in the metadata
+		if (mode == Client && transferState == probingPath && connected && !connection.GetPathMtuDiscovery().IsSearching()) {
+			payloadSize = connection.GetMessageSizeLimit();
+			if (maxPayloadSize > 0 && maxPayloadSize < payloadSize)
+				payloadSize = std::max(maxPayloadSize, MIN_PAYLOAD_SIZE);
+			if (compression && payloadSize < BLOCK_HEADER_SIZE + BLOCK_MIN_FRAGMENT) {
+				printf("Packets too small to carry compressed blocks, sending the file as it is\n");
+				compression = false;
+			}
+			// Compressed transfers work in whole blocks: they are the chunks the manifest and the resume journal track
+			uint32_t chunkSize = compression ? COMPRESSION_BLOCK_SIZE : (uint32_t)(payloadSize - DATA_HEADER_SIZE);
+			printf("path MTU %d bytes, sending %u byte %s\n", connection.GetPathMtuDiscovery().GetPathMtu(), chunkSize,
+				compression ? "compressed blocks" : "chunks");
+
+			// Hash every chunk up front, the root goes in the metadata and the hashes follow it.
+			// The whole-file CRC is worked out on another thread meanwhile
+			uint32_t fileCrc = 0;
+			std::thread crcWorker([&fileCrc, fileData, fileSize]() { fileCrc = crc32Update(0, fileData, fileSize); });
+			int manifestResult = manifestBuild(&manifest, fileData, fileSize, chunkSize);
+			crcWorker.join();
+			if (manifestResult != 0) {
+				printf("Failed to build the chunk manifest\n");
+				break;
+			}
+			metadata.version = METADATA_VERSION;
+			metadata.fileSize = fileSize;
+			metadata.crc = fileCrc;
+			metadata.chunkSize = chunkSize;
+			metadata.rootHash = manifestRoot(&manifest);
+			metadata.modifiedTime = modifiedTime;
+			metadata.hashAlgorithm = HASH_XXH64;
+			metadata.compression = compression ? COMPRESSION_LZ : COMPRESSION_NONE;
+			metadata.deltaOffered = delta;
+			metadata.filename = argv[2];
+			metadata.filenameLength = strlen(argv[2]);
+			metadata.isLastPacket = false;
+			if (metadata.filenameLength > METADATA_MAX_NAME) {
+				printf("File name longer than %d bytes\n", METADATA_MAX_NAME);
+				break;
+			}
+			transferState = sendingMetadata;
+		}
+
 		if (!connected && connection.ConnectFailed())
 		{
 			printf("connection failed\n");
 			break;
 		}
+
+		// The receiver answered the metadata with the first byte it is missing
+		if (mode == Client && transferState == waitingForResume && resumeKnown) {
+			currentOffset = (size_t)resumeOffset;
+			if (currentOffset > 0)
+				printf("Resuming at byte %zu of %zu\n", currentOffset, fileSize);
+			// The receiver sent the signature of its old copy: only what it can't copy from there is sent, as resend ranges
+			if (signatureComplete(&basisSignature) && currentOffset < fileSize) {
+				if (deltaCompute(&basisSignature, fileData, fileSize, metadata.chunkSize, &deltaCopies, &deltaCopyCount) != 0) {
+					printf("Failed to match the receiver's copy, sending all of the file\n");
+					deltaCopyCount = 0;
+				}
+				uint64_t literalOffset = 0, copiedBytes = 0;
+				for (size_t i = 0; i < deltaCopyCount; i++) {
+					if (deltaCopies[i].offset > literalOffset)
+						resendRanges.push_back(std::make_pair(literalOffset, deltaCopies[i].offset - literalOffset));
+					literalOffset = deltaCopies[i].offset + deltaCopies[i].length;
+					copiedBytes += deltaCopies[i].length;
+				}
+				if (literalOffset < fileSize)
+					resendRanges.push_back(std::make_pair(literalOffset, (uint64_t)fileSize - literalOffset));
+				printf("Receiver already has %llu of %zu bytes, sending %llu\n", (unsigned long long)copiedBytes, fileSize,
+					(unsigned long long)(fileSize - copiedBytes));
+				signatureFree(&basisSignature);
+				deltaCopiesSent = 0;
+				transferState = sendingDelta;
+			}
+			else if (compression && currentOffset < fileSize) {
+				compressor = pipelineCreate(fileData, fileSize, currentOffset, COMPRESSION_BLOCK_SIZE);
+				if (!compressor) {
+					printf("Failed to start the compression workers\n");
+					break;
+				}
+			}
+			else if (currentOffset < fileSize) {
+				packetizer = packetizerCreate(fileData, fileSize, currentOffset, (size_t)payloadSize);
+			}
+			if (transferState == waitingForResume)
+				transferState = currentOffset < fileSize ? sendingFile : sendingChecksum;
+		}
 		// send and receive packets
 
-		sendAccumulator += DeltaTime;
+		const double sendRate = congestion->GetPacingRate();
+		sendBucket.SetRate(sendRate, std::max((double)SendBurst * payloadSize, sendRate * PacingQuantum));
+		sendBucket.Update(GetTime());
 
-		// Break the file into chunks of size `PacketSize` and send each chunk.
-		while (sendAccumulator > 1.0f / sendRate)
+		// Break the file into chunks of size `payloadSize` and send each chunk.
+		while (readyToSend() && sendBucket.CanConsume(payloadSize))
 		{
+			int packetsSent = 0;
 			if (mode == Client ) {
 
 				switch (transferState) {
 				case idle:
 				case sendingMetadata: {
 
-
-					size_t totalMetadataSize = sizeof(FileMetadata);
-					size_t currentMetaOffset = 0;
-					while (currentMetaOffset < totalMetadataSize) {
-						size_t packetSize;
-						createMetadataPacket(argv[2], fileSize, computeCRC32(fileBuffer, fileSize), false, tempBuffer, &packetSize, currentMetaOffset);
-						connection.SendPacket((unsigned char*)tempBuffer, packetSize);
-						currentMetaOffset += packetSize;
-					}
+					// Everything about the file in one message
+					size_t packetSize = createMetadataPacket(&metadata, tempBuffer, sizeof(tempBuffer));
+					connection.SendReliable((unsigned char*)tempBuffer, (int)packetSize);
+					packetsSent++;
 					printf("Sent metadata for file: %s\n", argv[2]);
-					transferState = sendingFile;
+					manifestLeavesSent = 0;
+					transferState = sendingManifest;
 				}
 					break;
 
-				case sendingFile:
-					if (currentOffset < fileSize) {
-						/*size_t packetSize = createDataPacket(fileBuffer, fileSize, currentOffset, tempBuffer, PacketSize, (currentOffset + PacketSize >= fileSize));
-						connection.SendPacket((unsigned char*)tempBuffer, packetSize);
-						currentOffset += packetSize;
-						*/
-						size_t remainingSize = fileSize - currentOffset;
-						size_t chunkSize = (remainingSize < (size_t)PacketSize) ? remainingSize : (size_t)PacketSize;
-
-						if (chunkSize > PacketSize) {
-							chunkSize = PacketSize;
+				case sendingManifest:
+					// The chunk hashes, as many per packet as fit. They are read in order, ahead of any data
+					if (manifestLeavesSent < manifest.chunkCount) {
+						int batchCount = 0;
+						uint64_t batchLeaves[MaxBatchSize];
+						uint64_t leaf = manifestLeavesSent;
+						while (batchCount < MaxBatchSize && leaf < manifest.chunkCount) {
+							unsigned char* piece = connection.ReserveReliable();
+							size_t packetSize;
+							batchLeaves[batchCount] = createManifestPacket(&manifest, leaf, (char*)piece, payloadSize, &packetSize);
+							if (batchLeaves[batchCount] == 0) {
+								connection.CancelReliable(piece);
+								printf("Packets too small to carry the manifest\n");
+								sendFailed = true;
+								break;
+							}
+							batchData[batchCount] = piece;
+							batchSizes[batchCount] = (int)packetSize;
+							leaf += batchLeaves[batchCount];
+							batchCount++;
 						}
+						packetsSent = sendBuilt(connection, batchData, batchSizes, batchCount);
+						for (int i = 0; i < packetsSent; ++i)
+							manifestLeavesSent += batchLeaves[i];
+					}
+					if (manifestLeavesSent >= manifest.chunkCount) {
+						printf("Sent manifest: %llu chunk hashes\n", (unsigned long long)manifest.chunkCount);
+						transferState = waitingForResume;
+					}
+					break;
 
-						memcpy(tempBuffer, fileBuffer + currentOffset, chunkSize);
-						connection.SendPacket((unsigned char*)tempBuffer, chunkSize);
-						currentOffset += chunkSize;
+				case sendingDelta:
+					// The copies first, the receiver reads them from its old copy while the rest is on its way
+					if (deltaCopiesSent < deltaCopyCount) {
+						int batchCount = 0;
+						while (batchCount < MaxBatchSize && deltaCopiesSent + batchCount < deltaCopyCount) {
+							unsigned char* piece = connection.ReserveReliable();
+							batchData[batchCount] = piece;
+							batchSizes[batchCount] = (int)createCopyPacket(&deltaCopies[deltaCopiesSent + batchCount], (char*)piece);
+							batchCount++;
+						}
+						packetsSent = sendBuilt(connection, batchData, batchSizes, batchCount);
+						deltaCopiesSent += packetsSent;
+					}
+					if (deltaCopiesSent >= deltaCopyCount) {
+						printf("Sent %zu copies\n", deltaCopyCount);
+						currentOffset = fileSize;
+						transferState = resendRanges.empty() ? sendingChecksum : resendingFile;
+					}
+					break;
+				case sendingFile:
+					// Build as many chunks as the pacer allows and send them in one batched call.
+					// A full window means the receiver hasn't acked yet: the rest go next time
+					if (currentOffset < fileSize && connection.CanSendReliable()) {
+						if (compressor) {
+							// One block at a time, in as many messages as it takes. The workers are already on the next ones
+							if (!sendBlockTaken) {
+								if (!pipelineNext(compressor, &sendBlock))
+									break;
+								sendBlockTaken = true;
+								sendFragment = 0;
+							}
+							packetsSent = sendBlockFragments(sendBlock, sendFragment);
+							if (sendFragment >= blockFragmentCount(&sendBlock, payloadSize)) {
+								currentOffset += sendBlock.rawSize;
+								pipelineRelease(compressor);
+								sendBlockTaken = false;
+							}
+						}
+						else if (packetizer) {
+							// The packets come ready made from the packetizer thread, built in buffers lent to it
+							// from the connection, so this one only commits them. Those the window doesn't take yet stay lent
+							char* packets[PACKETIZER_PACKETS];
+							size_t sizes[MaxBatchSize];
+							int lend = packetizerSpace(packetizer);
+							for (int i = 0; i < lend; ++i)
+								packets[i] = (char*)connection.ReserveReliable();
+							packetizerSupply(packetizer, packets, lend);
+							int batchLimit = std::min((int)(sendBucket.GetTokens() / payloadSize), MaxBatchSize);
+							int batchCount = packetizerPeek(packetizer, packets, sizes, batchLimit);
+							for (int i = 0; i < batchCount; ++i) {
+								batchData[i] = (unsigned char*)packets[i];
+								batchSizes[i] = (int)sizes[i];
+							}
+							packetsSent = connection.CommitReliableBatch(batchData, batchSizes, batchCount);
+							packetizerRelease(packetizer, packetsSent);
+							for (int i = 0; i < packetsSent; ++i)
+								currentOffset += batchSizes[i] - DATA_HEADER_SIZE;
+						}
+						else {
+							int batchCount = 0;
+							int batchLimit = (int)(sendBucket.GetTokens() / payloadSize);
+							size_t batchOffset = currentOffset;
+							while (batchCount < batchLimit && batchCount < MaxBatchSize && batchOffset < fileSize) {
+								unsigned char* chunk = connection.ReserveReliable();
+								size_t packetSize = createDataPacket(fileData, fileSize, batchOffset, (char*)chunk, payloadSize, (batchOffset + payloadSize - DATA_HEADER_SIZE >= fileSize));
+								batchData[batchCount] = chunk;
+								batchSizes[batchCount] = (int)packetSize;
+								batchOffset += packetSize - DATA_HEADER_SIZE;
+								batchCount++;
+							}
+							packetsSent = sendBuilt(connection, batchData, batchSizes, batchCount);
+							for (int i = 0; i < packetsSent; ++i)
+								currentOffset += batchSizes[i] - DATA_HEADER_SIZE;
+						}
+						if (sourceFile.data)
+							mappedFileAdvance(&sourceFile, currentOffset);
 						float progress = (float)currentOffset / fileSize * 100.0f;
 						printf("\rSending progress: %.2f%%", progress);
 						fflush(stdout);
@@ -294,146 +1241,145 @@ int main(int argc, char* argv[])
 						if (currentOffset >= fileSize) {
 							transfer_end = clock();
 							double duration = (double)(transfer_end - transfer_start) / CLOCKS_PER_SEC;
-							double speed = calculateTransferSpeed(transfer_start, transfer_end, fileSize);
+							double speed = calculateTransferSpeed(transfer_start, transfer_end, fileSize - (size_t)resumeOffset);
 							printf("Transfer completed\n");
 							printf("File size: %zu bytes\n", fileSize);
 							printf("Time taken: %.2f seconds\n", duration);
 							printf("Transfer speed: %.2f Mbps\n", speed);
-							transferState = completed;
+							pipelineDestroy(compressor);
+							compressor = nullptr;
+							stopPacketizer();
+							transferState = resendRanges.empty() ? sendingChecksum : resendingFile;
 						}
 					}
 					break;
-				default:
-					break;
-				}
-			}
-			sendAccumulator -= 1.0f / sendRate;
-		}
-
-		while (true)
-		{
-			    //1.Handle the first received packet as metadata containing file details (e.g., name, size).
-			    //2. If this is the first packet, treat it as metadata.
-				//3. Metadata processing: Extract file name and size to prepare for receiving file chunks.
-				//4. Example: Deserialize packet data to retrieve file name and size.
-
-			// Server-Side: Handle receiving file metadata and file chunks
-			unsigned char packet[256];
-			//transferState = receivingMetadata; ///Changed to make sure it goes in
-			int bytesRead = connection.ReceivePacket(packet, sizeof(FileMetadata));
-			if (bytesRead <= 0)
-				break;
-			if (mode == Server) {
-				switch (transferState) {
-				
-				case receivingMetadata: {
-					static char metadataBuffer[sizeof(FileMetadata)];
-					static size_t receivedMetaOffset = 0;
-
-					if (extractMetadataPacket((char*)packet, bytesRead, &metadata, metadataBuffer, &receivedMetaOffset)) {
-						printf("Receiving file: %s (Size: %zu bytes)\n", metadata.filename, metadata.fileSize);
-
-						fileBuffer = (char*)malloc(metadata.fileSize);
-						if (!fileBuffer) {
-							printf("Failed to allocate memory for file\n");
-							return 1;
+				case resendingFile:
+					// Only the ranges the receiver asked for, then the trailer again.
+					// Compressed ranges are whole blocks, compressed again here (resends are rare)
+					if (!resendRanges.empty() && metadata.compression == COMPRESSION_LZ) {
+						std::pair<uint64_t, uint64_t>& front = resendRanges.front();
+						if (!resendBlockReady) {
+							resendScratch.resize(COMPRESSION_BLOCK_SIZE);
+							encodeBlock(fileData, fileSize, front.first, COMPRESSION_BLOCK_SIZE, &resendScratch[0], &resendBlock);
+							resendBlockReady = true;
+							resendFragment = 0;
+						}
+						packetsSent = sendBlockFragments(resendBlock, resendFragment);
+						if (resendFragment >= blockFragmentCount(&resendBlock, payloadSize)) {
+							front.first += resendBlock.rawSize;
+							front.second = front.second > resendBlock.rawSize ? front.second - resendBlock.rawSize : 0;
+							if (front.second == 0 || front.first >= fileSize)
+								resendRanges.pop_front();
+							resendBlockReady = false;
 						}
-
-						currentOffset = 0;
-						transferState = receivingFile;
 					}
-				}
-					break;
-				case receivingFile:
-					if (currentOffset + bytesRead <= metadata.fileSize) {
-						memcpy(fileBuffer + currentOffset, packet, bytesRead);
-						currentOffset += bytesRead;
-
-						if (currentOffset >= metadata.fileSize) {
-							transfer_end = clock();
-							
-							uint32_t receivedCRC = computeCRC32(fileBuffer, metadata.fileSize);
-
-							if (receivedCRC == metadata.crc) {
-								char savePath[512];
-								snprintf(savePath, sizeof(savePath), "received_%s", metadata.filename);
-								if (saveFile(savePath, fileBuffer, metadata.fileSize) == 0) {
-									double duration = (double)(transfer_end - transfer_start) / CLOCKS_PER_SEC;
-									double speed = calculateTransferSpeed(transfer_start, transfer_end, metadata.fileSize);
-									printf("File received successfully\n");
-									printf("Saved as: %s\n", savePath);
-									printf("File received in %.2f seconds\n", duration);
-									printf("Transfer speed: %.2f Mbps\n", speed);
-									printf("CRC verification: PASSED\n");
-								}
-							}
-							if (receivedCRC != metadata.crc) {
-								printf("CRC verification failed!\n");
-								free(fileBuffer);
-								fileBuffer = nullptr;
-								currentOffset = 0;
-								transferState = receivingMetadata;
-								continue;  // Restart loop safely
-							}
+					else if (!resendRanges.empty()) {
+						int batchCount = 0;
+						size_t range = 0;
+						uint64_t rangeOffset = resendRanges[0].first;
+						while (batchCount < MaxBatchSize && range < resendRanges.size()) {
+							unsigned char* chunk = connection.ReserveReliable();
+							size_t packetSize = createDataPacket(fileData, fileSize, (size_t)rangeOffset, (char*)chunk, payloadSize, false);
+							batchData[batchCount] = chunk;
+							batchSizes[batchCount] = (int)packetSize;
+							batchCount++;
+							rangeOffset += packetSize - DATA_HEADER_SIZE;
+							if (rangeOffset >= resendRanges[range].first + resendRanges[range].second && ++range < resendRanges.size())
+								rangeOffset = resendRanges[range].first;
+						}
+						packetsSent = sendBuilt(connection, batchData, batchSizes, batchCount);
+						for (int i = 0; i < packetsSent; ++i) {
+							uint64_t chunkSize = (uint64_t)batchSizes[i] - DATA_HEADER_SIZE;
+							std::pair<uint64_t, uint64_t>& front = resendRanges.front();
+							front.first += chunkSize;
+							front.second = front.second > chunkSize ? front.second - chunkSize : 0;
+							if (front.second == 0)
+								resendRanges.pop_front();
 						}
 					}
+					if (resendRanges.empty())
+						transferState = sendingChecksum;
+					break;
+				case sendingChecksum: {
+					// Trailer: the metadata again, flagged as last, carrying the final CRC.
+					// Wait for the data to be acked so the trailer comes after all of it.
+					// It goes again after every round of resends, so the receiver can ask for whatever is still missing.
+					if (connection.GetRetransmissionSystem().GetMessagesInFlight() > 0)
+						break;
+					metadata.isLastPacket = true;
+					size_t packetSize = createMetadataPacket(&metadata, tempBuffer, sizeof(tempBuffer));
+					connection.SendReliable((unsigned char*)tempBuffer, (int)packetSize);
+					packetsSent++;
+					printf("Sent checksum for file: %s\n", argv[2]);
+					transferState = completed;
+				}
 					break;
-
 				default:
 					break;
 				}
 			}
+			if (packetsSent == 0)
+				break;
+			sendBucket.Consume(packetsSent * payloadSize);
 		}
-		// Write the received chunk to the output file.
-	   // Ensure that no data is lost or corrupted during the process.
-
-		// show packets that were acked this frame
+		if (sendFailed)
+			break;
 
-#ifdef SHOW_ACKS
-		unsigned int* acks = NULL;
-		int ack_count = 0;
-		connection.GetReliabilitySystem().GetAcks(&acks, ack_count);
-		if (ack_count > 0)
+		while (true)
 		{
-			printf("acks: %d", acks[0]);
-			for (int i = 1; i < ack_count; ++i)
-				printf(",%d", acks[i]);
-			printf("\n");
+			int bytesRead = 0;
+			const unsigned char* packet = connection.ReadReliable(bytesRead);
+			if (!packet)
+				break;
+			int messageType = getMessageType((const char*)packet, bytesRead);
+
+			// Client-Side: the receiver asks again for chunks that were damaged or never arrived
+			if (mode == Client && messageType == MESSAGE_RESEND) {
+				uint64_t offset = 0, length = 0;
+				uint64_t chunkSize = metadata.chunkSize;	// 0 until probing settles, nothing can be asked for before that
+				if (chunkSize > 0 && extractResendRequest((const char*)packet, bytesRead, &offset, &length) &&
+					offset % chunkSize == 0 && offset < fileSize && length > 0 && length <= fileSize - offset) {
+					resendRanges.push_back(std::make_pair(offset, length));
+					if (transferState == sendingChecksum || transferState == completed)
+						transferState = resendingFile;
+				}
+				continue;
+			}
+			if (mode == Client && messageType == MESSAGE_SIGNATURE) {
+				// Comes ahead of the resume offset, only when the receiver has an old copy
+				if (!delta || !extractSignaturePacket((const char*)packet, bytesRead, &basisSignature))
+					printf("Ignoring a signature packet out of place\n");
+				continue;
+			}
+			if (mode == Client && messageType == MESSAGE_RESUME) {
+				uint64_t offset = 0;
+				uint64_t chunkSize = metadata.chunkSize;
+				if (chunkSize > 0 && extractResumePacket((const char*)packet, bytesRead, &offset) && offset <= fileSize && (offset % chunkSize == 0 || offset == fileSize)) {
+					resumeOffset = offset;
+					resumeKnown = true;
+				}
+				continue;
+			}
 		}
-#endif
-
-		// update connection
-
-		connection.Update(DeltaTime);
-
-		// show connection stats
+		// sleep until a packet arrives, a timer or delayed ack is due, or the pacer lets the next packet out
 
-		statsAccumulator += DeltaTime;
-
-		while (statsAccumulator >= 0.25f && connection.IsConnected())
-		{
-			float rtt = connection.GetReliabilitySystem().GetRoundTripTime();
-
-			unsigned int sent_packets = connection.GetReliabilitySystem().GetSentPackets();
-			unsigned int acked_packets = connection.GetReliabilitySystem().GetAckedPackets();
-			unsigned int lost_packets = connection.GetReliabilitySystem().GetLostPackets();
-
-			float sent_bandwidth = connection.GetReliabilitySystem().GetSentBandwidth();
-			float acked_bandwidth = connection.GetReliabilitySystem().GetAckedBandwidth();
-
-			printf("rtt %.1fms, sent %d, acked %d, lost %d (%.1f%%), sent bandwidth = %.1fkbps, acked bandwidth = %.1fkbps\n",
-				rtt * 1000.0f, sent_packets, acked_packets, lost_packets,
-				sent_packets > 0.0f ? (float)lost_packets / (float)sent_packets * 100.0f : 0.0f,
-				sent_bandwidth, acked_bandwidth);
-
-			statsAccumulator -= 0.25f;
-		}
-		
-		net::wait(DeltaTime);
+		double now = GetTime();
+		double timeout = min(timers.GetTimeUntilNext(now), connection.GetTimeUntilAck());
+		if (readyToSend())
+			timeout = min(timeout, sendBucket.GetTimeUntil(payloadSize));
+		connection.WaitForPacket((float)timeout);
 	}
 	if (fileBuffer) {
 		free(fileBuffer);
 	}
+	unmapFile(&sourceFile);
+	manifestFree(&manifest);
+	pipelineDestroy(compressor);
+	stopPacketizer();
+	signatureFree(&basisSignature);
+	free(deltaCopies);
+	connection.SetCongestionControl(NULL);
+	delete congestion;
 	ShutdownSockets();
 
 	return 0;
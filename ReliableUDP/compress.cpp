@@ -0,0 +1,356 @@
+/*
+ * FILE: compress.cpp
+ * PROJECT: Reliable UDP File Transfer
+ * PROGRAMMER: Manreet & Bhawanjeet
+ * FIRST VERSION: 17/10/2026
+ * DESCRIPTION:
+ * This source file implements the block codec and the compression pipeline.
+ * The codec writes the LZ4 block format (https://github.com/lz4/lz4): a
+ * token with the literal and match lengths, the literals, then a 2 byte
+ * offset back into what was already decoded. Matches are found greedily
+ * through a hash of the next 4 bytes, and the search speeds up over data
+ * that doesn't match, so incompressible blocks cost little.
+ */
+#include "compress.h"
+#include <string.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5   // the format ends with at least this many literals
+#define LZ_MATCH_MARGIN 12   // no match may start closer than this to the end
+#define LZ_MAX_OFFSET 65535
+#define INCOMPRESSIBLE_STREAK 8  // blocks in a row that didn't shrink before the workers stop trying
+#define INCOMPRESSIBLE_PROBE 16  // while they have stopped, every this many blocks is tried anyway
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static uint32_t lzHash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes a length that didn't fit its 4 bits as a run of bytes, 255 meaning more follow
+static uint8_t* writeLength(uint8_t* out, size_t length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+// One sequence: literals, then a match (matchLength 0 for the last sequence, which has none)
+static uint8_t* writeSequence(uint8_t* out, const uint8_t* outEnd, const uint8_t* literals, size_t literalLength, size_t offset, size_t matchLength) {
+    size_t needed = 1 + literalLength / 255 + 1 + literalLength + (matchLength ? 2 + matchLength / 255 + 1 : 0);
+    if (needed > (size_t)(outEnd - out)) {
+        return NULL;
+    }
+    uint8_t* token = out++;
+    *token = (uint8_t)((literalLength < 15 ? literalLength : 15) << 4);
+    if (literalLength >= 15) {
+        out = writeLength(out, literalLength - 15);
+    }
+    memcpy(out, literals, literalLength);
+    out += literalLength;
+    if (matchLength == 0) {
+        return out;
+    }
+    *out++ = (uint8_t)(offset & 0xFF);
+    *out++ = (uint8_t)(offset >> 8);
+    size_t code = matchLength - LZ_MIN_MATCH;
+    *token |= (uint8_t)(code < 15 ? code : 15);
+    if (code >= 15) {
+        out = writeLength(out, code - 15);
+    }
+    return out;
+}
+
+/*
+* Name: lzCompress
+* Parameteres: const char* source, size_t size, char* dest, size_t capacity
+* Returns: size_t
+* Description: Compresses one block. Positions are kept as 32-bit values in
+* the hash table, matches are limited to LZ_MAX_OFFSET back. Returns 0 as
+* soon as the output would pass capacity.
+*/
+size_t lzCompress(const char* source, size_t size, char* dest, size_t capacity) {
+    const uint8_t* src = (const uint8_t*)source;
+    uint8_t* out = (uint8_t*)dest;
+    const uint8_t* outEnd = out + capacity;
+    size_t anchor = 0;
+
+    if (size > LZ_MATCH_MARGIN) {
+        uint32_t table[1 << LZ_HASH_BITS];
+        memset(table, 0, sizeof(table));
+        const size_t matchEnd = size - LZ_LAST_LITERALS;
+        const size_t searchEnd = size - LZ_MATCH_MARGIN;
+        size_t pos = 1;
+        while (pos < searchEnd) {
+            uint32_t sequence = read32(src + pos);
+            uint32_t hash = lzHash(sequence);
+            size_t candidate = table[hash];
+            table[hash] = (uint32_t)pos;
+            if (pos - candidate > LZ_MAX_OFFSET || read32(src + candidate) != sequence) {
+                pos += 1 + ((pos - anchor) >> 6);  // step further the longer nothing has matched
+                continue;
+            }
+            size_t length = LZ_MIN_MATCH;
+            while (pos + length < matchEnd && src[candidate + length] == src[pos + length]) {
+                length++;
+            }
+            out = writeSequence(out, outEnd, src + anchor, pos - anchor, pos - candidate, length);
+            if (!out) {
+                return 0;
+            }
+            pos += length;
+            anchor = pos;
+            if (pos - 2 < searchEnd) {
+                table[lzHash(read32(src + pos - 2))] = (uint32_t)(pos - 2);
+            }
+        }
+    }
+    out = writeSequence(out, outEnd, src + anchor, size - anchor, 0, 0);
+    return out ? (size_t)(out - (uint8_t*)dest) : 0;
+}
+
+// Reads a length continued in extra bytes. False if the input ends first
+static bool readLength(const uint8_t** in, const uint8_t* inEnd, size_t* length) {
+    uint8_t byte;
+    do {
+        if (*in >= inEnd) {
+            return false;
+        }
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/*
+* Name: lzDecompress
+* Parameteres: const char* source, size_t size, char* dest, size_t destSize
+* Returns: bool
+* Description: Decompresses one block. Every length and offset is checked
+* against both buffers, so damaged input fails instead of writing out of
+* bounds.
+*/
+bool lzDecompress(const char* source, size_t size, char* dest, size_t destSize) {
+    const uint8_t* in = (const uint8_t*)source;
+    const uint8_t* inEnd = in + size;
+    uint8_t* out = (uint8_t*)dest;
+    uint8_t* outEnd = out + destSize;
+
+    while (in < inEnd) {
+        uint8_t token = *in++;
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !readLength(&in, inEnd, &literalLength)) {
+            return false;
+        }
+        if (literalLength > (size_t)(inEnd - in) || literalLength > (size_t)(outEnd - out)) {
+            return false;
+        }
+        memcpy(out, in, literalLength);
+        in += literalLength;
+        out += literalLength;
+        if (in == inEnd) {
+            break;  // the last sequence has no match
+        }
+        if (inEnd - in < 2) {
+            return false;
+        }
+        size_t offset = in[0] | ((size_t)in[1] << 8);
+        in += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !readLength(&in, inEnd, &matchLength)) {
+            return false;
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(out - (uint8_t*)dest) || matchLength > (size_t)(outEnd - out)) {
+            return false;
+        }
+        const uint8_t* match = out - offset;
+        if (offset >= matchLength) {
+            memcpy(out, match, matchLength);
+            out += matchLength;
+        }
+        else {
+            for (size_t i = 0; i < matchLength; i++) {
+                *out++ = match[i];  // overlapping copy repeats the last offset bytes
+            }
+        }
+    }
+    return out == outEnd;
+}
+
+void encodeBlock(const char* fileData, uint64_t fileSize, uint64_t offset, uint32_t blockSize, char* scratch, EncodedBlock* block) {
+    uint64_t remaining = fileSize - offset;
+    block->offset = offset;
+    block->rawSize = (size_t)(remaining < blockSize ? remaining : blockSize);
+    block->size = block->rawSize > 1 ? lzCompress(fileData + offset, block->rawSize, scratch, block->rawSize - 1) : 0;
+    block->compressed = block->size > 0;
+    if (!block->compressed) {
+        block->data = fileData + offset;
+        block->size = block->rawSize;
+    }
+    else {
+        block->data = scratch;
+    }
+}
+
+// Block i of the pipeline sits in slot i % slots.size() from the moment a
+// worker takes it until the sender releases it. The workers stay at most
+// slots.size() blocks ahead of the sender.
+struct PipelineSlot {
+    enum State { Free, Busy, Ready };
+    State state = Free;
+    uint64_t index = 0;
+    EncodedBlock block = {};
+    std::vector<char> scratch;
+};
+
+struct CompressionPipeline {
+    const char* fileData;
+    uint64_t fileSize;
+    uint64_t startOffset;
+    uint32_t blockSize;
+    uint64_t blockCount;
+    uint64_t nextIndex;      // next block a worker takes
+    uint64_t takeIndex;      // next block the sender takes
+    int incompressible;      // blocks in a row that didn't shrink
+    bool stopping;
+    std::vector<PipelineSlot> slots;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable workReady;
+    std::condition_variable blockReady;
+};
+
+static void pipelineWorker(CompressionPipeline* pipeline) {
+    std::unique_lock<std::mutex> lock(pipeline->mutex);
+    while (true) {
+        pipeline->workReady.wait(lock, [pipeline]() {
+            if (pipeline->stopping) {
+                return true;
+            }
+            uint64_t index = pipeline->nextIndex;
+            return index < pipeline->blockCount && index < pipeline->takeIndex + pipeline->slots.size() &&
+                pipeline->slots[index % pipeline->slots.size()].state == PipelineSlot::Free;
+        });
+        if (pipeline->stopping) {
+            return;
+        }
+        uint64_t index = pipeline->nextIndex++;
+        PipelineSlot& slot = pipeline->slots[index % pipeline->slots.size()];
+        slot.state = PipelineSlot::Busy;
+        slot.index = index;
+        // Data that didn't compress lately is only sampled now and then
+        bool attempt = pipeline->incompressible < INCOMPRESSIBLE_STREAK || index % INCOMPRESSIBLE_PROBE == 0;
+        lock.unlock();
+
+        uint64_t offset = pipeline->startOffset + index * pipeline->blockSize;
+        if (attempt) {
+            encodeBlock(pipeline->fileData, pipeline->fileSize, offset, pipeline->blockSize, &slot.scratch[0], &slot.block);
+        }
+        else {
+            uint64_t remaining = pipeline->fileSize - offset;
+            slot.block.offset = offset;
+            slot.block.rawSize = (size_t)(remaining < pipeline->blockSize ? remaining : pipeline->blockSize);
+            slot.block.data = pipeline->fileData + offset;
+            slot.block.size = slot.block.rawSize;
+            slot.block.compressed = false;
+        }
+
+        lock.lock();
+        if (attempt) {
+            pipeline->incompressible = slot.block.compressed ? 0 : pipeline->incompressible + 1;
+        }
+        slot.state = PipelineSlot::Ready;
+        pipeline->blockReady.notify_all();
+    }
+}
+
+/*
+* Name: pipelineCreate
+* Parameteres: const char* fileData, uint64_t fileSize, uint64_t startOffset, uint32_t blockSize
+* Returns: CompressionPipeline*
+* Description: Starts the workers on the blocks from startOffset to the end
+* of the file. One thread per spare core, up to COMPRESSION_MAX_THREADS.
+* Returns NULL if it can't be set up.
+*/
+CompressionPipeline* pipelineCreate(const char* fileData, uint64_t fileSize, uint64_t startOffset, uint32_t blockSize) {
+    if (blockSize == 0 || startOffset > fileSize) {
+        return NULL;
+    }
+    unsigned int cores = std::thread::hardware_concurrency();
+    int threads = cores > 1 ? (int)cores - 1 : 1;
+    if (threads > COMPRESSION_MAX_THREADS) {
+        threads = COMPRESSION_MAX_THREADS;
+    }
+
+    CompressionPipeline* pipeline = new CompressionPipeline();
+    pipeline->fileData = fileData;
+    pipeline->fileSize = fileSize;
+    pipeline->startOffset = startOffset;
+    pipeline->blockSize = blockSize;
+    pipeline->blockCount = (fileSize - startOffset + blockSize - 1) / blockSize;
+    pipeline->nextIndex = 0;
+    pipeline->takeIndex = 0;
+    pipeline->incompressible = 0;
+    pipeline->stopping = false;
+    pipeline->slots.resize((size_t)threads * 2 + 2);
+    for (size_t i = 0; i < pipeline->slots.size(); i++) {
+        pipeline->slots[i].scratch.resize(blockSize);
+    }
+    for (int i = 0; i < threads; i++) {
+        pipeline->workers.push_back(std::thread(pipelineWorker, pipeline));
+    }
+    return pipeline;
+}
+
+// Waits for the next block in file order. False once every block was taken
+bool pipelineNext(CompressionPipeline* pipeline, EncodedBlock* block) {
+    std::unique_lock<std::mutex> lock(pipeline->mutex);
+    uint64_t index = pipeline->takeIndex;
+    if (index >= pipeline->blockCount) {
+        return false;
+    }
+    PipelineSlot& slot = pipeline->slots[index % pipeline->slots.size()];
+    pipeline->blockReady.wait(lock, [&slot, index]() {
+        return slot.state == PipelineSlot::Ready && slot.index == index;
+    });
+    *block = slot.block;
+    return true;
+}
+
+// The block from pipelineNext has been sent, its slot goes back to the workers
+void pipelineRelease(CompressionPipeline* pipeline) {
+    std::lock_guard<std::mutex> lock(pipeline->mutex);
+    PipelineSlot& slot = pipeline->slots[pipeline->takeIndex % pipeline->slots.size()];
+    if (slot.state == PipelineSlot::Ready && slot.index == pipeline->takeIndex) {
+        slot.state = PipelineSlot::Free;
+        pipeline->takeIndex++;
+        pipeline->workReady.notify_all();
+    }
+}
+
+void pipelineDestroy(CompressionPipeline* pipeline) {
+    if (!pipeline) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pipeline->mutex);
+        pipeline->stopping = true;
+    }
+    pipeline->workReady.notify_all();
+    for (size_t i = 0; i < pipeline->workers.size(); i++) {
+        pipeline->workers[i].join();
+    }
+    delete pipeline;
+}
@@ -0,0 +1,50 @@
+/*
+ * FILE: compress.h
+ * PROJECT: Reliable UDP File Transfer
+ * PROGRAMMER: Manreet & Bhawanjeet
+ * FIRST VERSION: 17/10/2026
+ * DESCRIPTION:
+ * This header file declares the optional compression stage. The file is cut
+ * into fixed-size blocks, each compressed on its own with a small LZ codec
+ * (the LZ4 block format) and stored raw when that doesn't make it smaller.
+ * Blocks are compressed ahead of the sender on worker threads, so the send
+ * loop only has to cut them into packets.
+ */
+#ifndef COMPRESS_H
+#define COMPRESS_H
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define COMPRESSION_BLOCK_SIZE (64 * 1024)  // file bytes per compressed block, back references reach 64 KB at most
+#define COMPRESSION_MAX_THREADS 4
+
+// One block of the file, ready to be sent
+typedef struct {
+    uint64_t offset;     // file offset of the block
+    size_t rawSize;      // file bytes it holds
+    const char* data;    // compressed bytes, or the file bytes themselves when stored raw
+    size_t size;
+    bool compressed;
+} EncodedBlock;
+
+// Worker threads compressing the blocks after a starting offset, in order
+typedef struct CompressionPipeline CompressionPipeline;
+
+// Compresses source into dest. Returns the compressed size, or 0 if it
+// would take more than capacity bytes (the caller then stores it raw).
+size_t lzCompress(const char* source, size_t size, char* dest, size_t capacity);
+
+// True if source decompresses to exactly destSize bytes
+bool lzDecompress(const char* source, size_t size, char* dest, size_t destSize);
+
+// Encodes the block at offset on the calling thread. scratch needs blockSize bytes.
+void encodeBlock(const char* fileData, uint64_t fileSize, uint64_t offset, uint32_t blockSize, char* scratch, EncodedBlock* block);
+
+CompressionPipeline* pipelineCreate(const char* fileData, uint64_t fileSize, uint64_t startOffset, uint32_t blockSize);
+bool pipelineNext(CompressionPipeline* pipeline, EncodedBlock* block);
+void pipelineRelease(CompressionPipeline* pipeline);
+void pipelineDestroy(CompressionPipeline* pipeline);
+
+#endif
@@ -0,0 +1,524 @@
+/*
+ * FILE: crc32.cpp
+ * PROJECT: Reliable UDP File Transfer
+ * PROGRAMMER: Manreet & Bhawanjeet
+ * FIRST VERSION: 17/10/2026
+ * DESCRIPTION:
+ * This source file implements the CRC32 engine. The lookup tables are built
+ * on first use and the backend is chosen from the CPU features at the same
+ * time. The PCLMULQDQ folding follows Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" white paper (the same
+ * constants zlib uses). The SSE4.2 crc32 instruction computes CRC-32C
+ * (Castagnoli), not the CRC-32 stored in our metadata, so it only backs the
+ * separate CRC-32C functions used for per-packet checks.
+ */
+#include "crc32.h"
+#include <string.h>
+
+#define POLYNOMIAL 0xEDB88320  // Standard CRC-32 polynomial (reflected)
+#define POLYNOMIAL_C 0x82F63B78  // CRC-32C (Castagnoli) polynomial (reflected)
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CRC32_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CRC32_TARGET_PCLMUL
+#define CRC32_TARGET_SSE42
+#else
+#include <cpuid.h>
+#define CRC32_TARGET_PCLMUL __attribute__((target("sse4.1,pclmul")))
+#define CRC32_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+// The slicing backends read whole words, which only works on little-endian CPUs.
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define CRC32_BIG_ENDIAN 1
+#endif
+
+// All backends work on the inverted CRC register; crc32Update does the inversion.
+typedef uint32_t(*Crc32Function)(uint32_t crc, const uint8_t* data, size_t size);
+
+// Multiplies a and b modulo the CRC polynomial (bit-reflected, x^0 is the top bit)
+static uint32_t multModP(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLYNOMIAL : b >> 1;
+    }
+    return p;
+}
+
+struct Crc32Tables {
+    uint32_t table[16][256];
+    uint32_t x2n[32];   // x^(2^n) modulo the polynomial, used by crc32Combine
+
+    Crc32Tables() {
+        //Source: https://gist.github.com/timepp/1f678e200d9e0f2a043a9ec6b3690635
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; j++) {
+                crc = (crc >> 1) ^ (crc & 1 ? POLYNOMIAL : 0);
+            }
+            table[0][i] = crc;
+        }
+        // table[k][i] is the CRC of byte i followed by k zero bytes
+        for (int k = 1; k < 16; k++) {
+            for (int i = 0; i < 256; i++) {
+                uint32_t prev = table[k - 1][i];
+                table[k][i] = (prev >> 8) ^ table[0][prev & 0xFF];
+            }
+        }
+        uint32_t p = (uint32_t)1 << 30;  // x^1
+        x2n[0] = p;
+        for (int n = 1; n < 32; n++) {
+            x2n[n] = p = multModP(p, p);
+        }
+    }
+};
+
+static const Crc32Tables& crcTables(void) {
+    static const Crc32Tables tables;
+    return tables;
+}
+
+static uint32_t crc32Table(uint32_t crc, const uint8_t* data, size_t size) {
+    const uint32_t(*t)[256] = crcTables().table;
+    while (size--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+static uint32_t crc32Slice8(uint32_t crc, const uint8_t* data, size_t size) {
+    const uint32_t(*t)[256] = crcTables().table;
+    while (size >= 8) {
+        uint32_t one, two;
+        memcpy(&one, data, 4);
+        memcpy(&two, data + 4, 4);
+        one ^= crc;
+        crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24] ^
+              t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+        data += 8;
+        size -= 8;
+    }
+    return crc32Table(crc, data, size);
+}
+
+static uint32_t crc32Slice16(uint32_t crc, const uint8_t* data, size_t size) {
+    const uint32_t(*t)[256] = crcTables().table;
+    while (size >= 16) {
+        uint32_t one, two, three, four;
+        memcpy(&one, data, 4);
+        memcpy(&two, data + 4, 4);
+        memcpy(&three, data + 8, 4);
+        memcpy(&four, data + 12, 4);
+        one ^= crc;
+        crc = t[15][one & 0xFF] ^ t[14][(one >> 8) & 0xFF] ^ t[13][(one >> 16) & 0xFF] ^ t[12][one >> 24] ^
+              t[11][two & 0xFF] ^ t[10][(two >> 8) & 0xFF] ^ t[9][(two >> 16) & 0xFF] ^ t[8][two >> 24] ^
+              t[7][three & 0xFF] ^ t[6][(three >> 8) & 0xFF] ^ t[5][(three >> 16) & 0xFF] ^ t[4][three >> 24] ^
+              t[3][four & 0xFF] ^ t[2][(four >> 8) & 0xFF] ^ t[1][(four >> 16) & 0xFF] ^ t[0][four >> 24];
+        data += 16;
+        size -= 16;
+    }
+    return crc32Table(crc, data, size);
+}
+
+// CRC-32C tables, slicing-by-8 only: x86 CPUs from the last 15 years do it in hardware
+struct Crc32cTables {
+    uint32_t table[8][256];
+
+    Crc32cTables() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; j++) {
+                crc = (crc >> 1) ^ (crc & 1 ? POLYNOMIAL_C : 0);
+            }
+            table[0][i] = crc;
+        }
+        for (int k = 1; k < 8; k++) {
+            for (int i = 0; i < 256; i++) {
+                uint32_t prev = table[k - 1][i];
+                table[k][i] = (prev >> 8) ^ table[0][prev & 0xFF];
+            }
+        }
+    }
+};
+
+static const Crc32cTables& crc32cTables(void) {
+    static const Crc32cTables tables;
+    return tables;
+}
+
+static uint32_t crc32cSlice8(uint32_t crc, const uint8_t* data, size_t size) {
+    const uint32_t(*t)[256] = crc32cTables().table;
+#ifndef CRC32_BIG_ENDIAN
+    while (size >= 8) {
+        uint32_t one, two;
+        memcpy(&one, data, 4);
+        memcpy(&two, data + 4, 4);
+        one ^= crc;
+        crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24] ^
+              t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+        data += 8;
+        size -= 8;
+    }
+#endif
+    while (size--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#ifdef CRC32_X86
+
+static bool cpuHasSse42(void) {
+    unsigned int ecx;
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    ecx = (unsigned int)info[2];
+#else
+    unsigned int eax, ebx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+#endif
+    const unsigned int sse42 = 1u << 20;
+    return (ecx & sse42) != 0;
+}
+
+// One crc32 instruction per 8 bytes (4 on 32-bit builds)
+CRC32_TARGET_SSE42
+static uint32_t crc32cSse42(uint32_t crc, const uint8_t* data, size_t size) {
+#if defined(_M_X64) || defined(__x86_64__)
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = (uint32_t)crc64;
+#else
+    while (size >= 4) {
+        uint32_t word;
+        memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+        data += 4;
+        size -= 4;
+    }
+#endif
+    while (size--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+static bool cpuHasPclmul(void) {
+    unsigned int ecx;
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    ecx = (unsigned int)info[2];
+#else
+    unsigned int eax, ebx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+#endif
+    const unsigned int sse41 = 1u << 19;
+    const unsigned int pclmul = 1u << 1;
+    return (ecx & sse41) && (ecx & pclmul);
+}
+
+// Folds 64 bytes per step. size must be at least 64 and a multiple of 16.
+CRC32_TARGET_PCLMUL
+static uint32_t crc32FoldPclmul(uint32_t crc, const uint8_t* data, size_t size) {
+    static const uint64_t k1k2[2] = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+    static const uint64_t k3k4[2] = { 0x01751997d0ULL, 0x00ccaa009eULL };
+    static const uint64_t k5k0[2] = { 0x0163cd6124ULL, 0x0000000000ULL };
+    static const uint64_t poly[2] = { 0x01db710641ULL, 0x01f7011641ULL };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_loadu_si128((const __m128i*)k1k2);
+    data += 64;
+    size -= 64;
+
+    // fold four 128 bit lanes in parallel
+    while (size >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        data += 64;
+        size -= 64;
+    }
+
+    // fold the four lanes into one
+    x0 = _mm_loadu_si128((const __m128i*)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // fold any remaining 16 byte blocks
+    while (size >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)data);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        data += 16;
+        size -= 16;
+    }
+
+    // 128 bits down to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_loadu_si128((const __m128i*)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32Pclmul(uint32_t crc, const uint8_t* data, size_t size) {
+    if (size >= 64) {
+        size_t folded = size & ~(size_t)15;
+        crc = crc32FoldPclmul(crc, data, folded);
+        data += folded;
+        size -= folded;
+    }
+    return crc32Slice16(crc, data, size);
+}
+
+#endif
+
+static const Crc32Function crcFunctions[CRC32_BACKEND_COUNT] = {
+    crc32Table,
+    crc32Slice8,
+    crc32Slice16,
+#ifdef CRC32_X86
+    crc32Pclmul,
+#else
+    NULL,
+#endif
+};
+
+struct Crc32Engine {
+    Crc32Backend backend;
+    Crc32Function update;
+
+    Crc32Engine() {
+        crcTables();
+        backend = CRC32_BACKEND_TABLE;
+        for (int b = CRC32_BACKEND_COUNT - 1; b >= 0; b--) {
+            if (crc32BackendSupported((Crc32Backend)b)) {
+                backend = (Crc32Backend)b;
+                break;
+            }
+        }
+        update = crcFunctions[backend];
+    }
+};
+
+// Built once, thread-safe (function-local static)
+static Crc32Engine& crcEngine(void) {
+    static Crc32Engine engine;
+    return engine;
+}
+
+void crc32Init(void) {
+    crcEngine();
+}
+
+Crc32Backend crc32GetBackend(void) {
+    return crcEngine().backend;
+}
+
+/*
+* Name: crc32SetBackend
+* Parameteres: Crc32Backend backend
+* Returns: bool
+* Description: Forces a backend (for benchmarking). Must not be called while
+* another thread is computing CRCs. Returns false if the CPU can't run it.
+*/
+bool crc32SetBackend(Crc32Backend backend) {
+    if (!crc32BackendSupported(backend)) {
+        return false;
+    }
+    Crc32Engine& engine = crcEngine();
+    engine.backend = backend;
+    engine.update = crcFunctions[backend];
+    return true;
+}
+
+bool crc32BackendSupported(Crc32Backend backend) {
+    switch (backend) {
+    case CRC32_BACKEND_TABLE:
+        return true;
+    case CRC32_BACKEND_SLICE8:
+    case CRC32_BACKEND_SLICE16:
+#ifdef CRC32_BIG_ENDIAN
+        return false;
+#else
+        return true;
+#endif
+    case CRC32_BACKEND_PCLMUL:
+#ifdef CRC32_X86
+        return cpuHasPclmul();
+#else
+        return false;
+#endif
+    default:
+        return false;
+    }
+}
+
+const char* crc32BackendName(Crc32Backend backend) {
+    switch (backend) {
+    case CRC32_BACKEND_TABLE:   return "table";
+    case CRC32_BACKEND_SLICE8:  return "slicing-by-8";
+    case CRC32_BACKEND_SLICE16: return "slicing-by-16";
+    case CRC32_BACKEND_PCLMUL:  return "pclmulqdq";
+    default:                    return "unknown";
+    }
+}
+
+uint32_t crc32Update(uint32_t crc, const void* data, size_t size) {
+    if (!data || size == 0) {
+        return crc;
+    }
+    return ~crcEngine().update(~crc, (const uint8_t*)data, size);
+}
+
+void crc32ContextInit(Crc32Context* context) {
+    context->crc = 0;
+}
+
+void crc32ContextUpdate(Crc32Context* context, const void* data, size_t size) {
+    context->crc = crc32Update(context->crc, data, size);
+}
+
+uint32_t crc32ContextFinal(const Crc32Context* context) {
+    return context->crc;
+}
+
+// x^(n * 2^k) modulo the polynomial
+static uint32_t x2nModP(uint64_t n, unsigned int k) {
+    const uint32_t* x2n = crcTables().x2n;
+    uint32_t p = (uint32_t)1 << 31;  // x^0
+    while (n) {
+        if (n & 1) {
+            p = multModP(x2n[k & 31], p);
+        }
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+/*
+* Name: crc32Combine
+* Parameteres: uint32_t crcA, uint32_t crcB, uint64_t lengthB
+* Returns: uint32_t
+* Description: CRC of range A followed by range B. Shifting crcA past lengthB
+* zero bytes is a multiply by x^(8 * lengthB), so this is O(log lengthB).
+*/
+uint32_t crc32Combine(uint32_t crcA, uint32_t crcB, uint64_t lengthB) {
+    return multModP(x2nModP(lengthB, 3), crcA) ^ crcB;
+}
+
+uint32_t crc32CombineGen(uint64_t lengthB) {
+    return x2nModP(lengthB, 3);
+}
+
+uint32_t crc32CombineOp(uint32_t crcA, uint32_t crcB, uint32_t op) {
+    return multModP(op, crcA) ^ crcB;
+}
+
+static Crc32Function crc32cPick(void) {
+#ifdef CRC32_X86
+    if (cpuHasSse42()) {
+        return crc32cSse42;
+    }
+#endif
+    crc32cTables();
+    return crc32cSlice8;
+}
+
+// Picked once, thread-safe (function-local static)
+static Crc32Function crc32cFunction(void) {
+    static const Crc32Function update = crc32cPick();
+    return update;
+}
+
+bool crc32cHardware(void) {
+#ifdef CRC32_X86
+    return crc32cFunction() == crc32cSse42;
+#else
+    return false;
+#endif
+}
+
+uint32_t crc32cUpdate(uint32_t crc, const void* data, size_t size) {
+    if (!data || size == 0) {
+        return crc;
+    }
+    return ~crc32cFunction()(~crc, (const uint8_t*)data, size);
+}
@@ -0,0 +1,61 @@
+/*
+ * FILE: crc32.h
+ * PROJECT: Reliable UDP File Transfer
+ * PROGRAMMER: Manreet & Bhawanjeet
+ * FIRST VERSION: 17/10/2026
+ * DESCRIPTION:
+ * This header file declares the CRC32 engine used for file integrity checks.
+ * The engine has several interchangeable backends (byte table, slicing-by-8,
+ * slicing-by-16 and PCLMULQDQ folding) which all produce the standard
+ * CRC-32 (polynomial 0xEDB88320). The fastest backend supported by the CPU
+ * is picked once, the first time the engine is used. A resumable context
+ * and a combine function allow checksums to be built while data moves.
+ * CRC-32C (Castagnoli, polynomial 0x82F63B78) is provided separately for
+ * per-packet checks, using the SSE4.2 crc32 instruction when available.
+ */
+#ifndef CRC32_H
+#define CRC32_H
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    CRC32_BACKEND_TABLE,    // one table lookup per byte
+    CRC32_BACKEND_SLICE8,   // 8 bytes per step, 8 tables
+    CRC32_BACKEND_SLICE16,  // 16 bytes per step, 16 tables
+    CRC32_BACKEND_PCLMUL,   // carry-less multiply folding (SSE4.1 + PCLMULQDQ)
+    CRC32_BACKEND_COUNT
+} Crc32Backend;
+
+void crc32Init(void);
+Crc32Backend crc32GetBackend(void);
+bool crc32SetBackend(Crc32Backend backend);
+bool crc32BackendSupported(Crc32Backend backend);
+const char* crc32BackendName(Crc32Backend backend);
+
+// Updates a running CRC with more data. Start with crc = 0; the value
+// returned after the last block is the CRC of all the data (same as computeCRC32).
+uint32_t crc32Update(uint32_t crc, const void* data, size_t size);
+
+// Resumable CRC: init once, update with each block in order, then finalize.
+typedef struct {
+    uint32_t crc;
+} Crc32Context;
+
+void crc32ContextInit(Crc32Context* context);
+void crc32ContextUpdate(Crc32Context* context, const void* data, size_t size);
+uint32_t crc32ContextFinal(const Crc32Context* context);
+
+// Joins the CRCs of two adjacent ranges A and B into the CRC of A followed
+// by B, without touching the data. crc32CombineGen precomputes the operator
+// for a fixed lengthB so ranges of equal size can be joined with one multiply.
+uint32_t crc32Combine(uint32_t crcA, uint32_t crcB, uint64_t lengthB);
+uint32_t crc32CombineGen(uint64_t lengthB);
+uint32_t crc32CombineOp(uint32_t crcA, uint32_t crcB, uint32_t op);
+
+// CRC-32C, used the same way as crc32Update (start with crc = 0).
+uint32_t crc32cUpdate(uint32_t crc, const void* data, size_t size);
+bool crc32cHardware(void);
+
+#endif
@@ -0,0 +1,265 @@
+/*
+ * FILE: delta.cpp
+ * PROJECT: Reliable UDP File Transfer
+ * PROGRAMMER: Manreet & Bhawanjeet
+ * FIRST VERSION: 17/10/2026
+ * DESCRIPTION:
+ * This source file implements the delta transfer. The weak checksum is the
+ * one rsync uses (two 16-bit sums), which slides one byte along the file in a
+ * few instructions. The strong hash is XXH64 from the chunk manifest.
+ */
+#include "delta.h"
+#include "merkle.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_BLOCK UINT64_MAX
+
+// s1 is the sum of the bytes, s2 the sum of the running s1, both kept to 16 bits in the result
+static void weakStart(const unsigned char* p, uint32_t size, uint32_t* s1, uint32_t* s2) {
+    uint32_t a = 0, b = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        a += p[i];
+        b += a;
+    }
+    *s1 = a;
+    *s2 = b;
+}
+
+static uint32_t weakValue(uint32_t s1, uint32_t s2) {
+    return (s1 & 0xFFFF) | (s2 << 16);
+}
+
+static uint32_t weakChecksum(const char* data, uint32_t size) {
+    uint32_t s1, s2;
+    weakStart((const unsigned char*)data, size, &s1, &s2);
+    return weakValue(s1, s2);
+}
+
+// rsync's rule: the square root of the file, so the signature and the misses grow about equally
+uint32_t signatureBlockSize(uint64_t basisSize) {
+    uint64_t blockSize = (uint64_t)sqrt((double)basisSize) & ~(uint64_t)7;
+    if (blockSize < DELTA_MIN_BLOCK) {
+        return DELTA_MIN_BLOCK;
+    }
+    return blockSize > DELTA_MAX_BLOCK ? DELTA_MAX_BLOCK : (uint32_t)blockSize;
+}
+
+/*
+* Name: signatureBuild
+* Parameteres: Signature* signature, const char* basis, uint64_t basisSize, uint32_t blockSize
+* Returns: int
+* Description: Receiver side: checksums and hashes every block of its copy.
+* Returns 0 on success, -1 for a bad block size or if the memory can't be
+* allocated.
+*/
+int signatureBuild(Signature* signature, const char* basis, uint64_t basisSize, uint32_t blockSize) {
+    if (signatureInit(signature, basisSize, blockSize) != 0) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < signature->blockCount; i++) {
+        uint64_t offset = i * blockSize;
+        uint64_t remaining = basisSize - offset;
+        uint32_t size = remaining < blockSize ? (uint32_t)remaining : blockSize;
+        signature->blocks[i].weak = weakChecksum(basis + offset, size);
+        signature->blocks[i].strong = hash64(basis + offset, size, 0);
+    }
+    signature->receivedBlocks = signature->blockCount;
+    return 0;
+}
+
+// Sender side: room for every block, none filled in yet
+int signatureInit(Signature* signature, uint64_t basisSize, uint32_t blockSize) {
+    memset(signature, 0, sizeof(Signature));
+    if (blockSize < DELTA_MIN_BLOCK || blockSize > DELTA_MAX_BLOCK) {
+        return -1;
+    }
+    signature->basisSize = basisSize;
+    signature->blockSize = blockSize;
+    signature->blockCount = (basisSize + blockSize - 1) / blockSize;
+    if (signature->blockCount > SIZE_MAX / sizeof(BlockSignature)) {
+        return -1;
+    }
+    signature->blocks = (BlockSignature*)malloc(signature->blockCount > 0 ? (size_t)signature->blockCount * sizeof(BlockSignature) : 1);
+    return signature->blocks ? 0 : -1;
+}
+
+// Blocks come in order; a run that doesn't continue the ones received so far is refused
+bool signatureAddBlocks(Signature* signature, uint64_t firstBlock, const BlockSignature* blocks, uint64_t count) {
+    if (!signature->blocks || firstBlock != signature->receivedBlocks || count > signature->blockCount - firstBlock) {
+        return false;
+    }
+    memcpy(signature->blocks + firstBlock, blocks, (size_t)count * sizeof(BlockSignature));
+    signature->receivedBlocks += count;
+    return true;
+}
+
+bool signatureComplete(const Signature* signature) {
+    return signature->blocks && signature->receivedBlocks == signature->blockCount;
+}
+
+void signatureFree(Signature* signature) {
+    free(signature->blocks);
+    memset(signature, 0, sizeof(Signature));
+}
+
+// The strong hash of the window is only worked out once a weak checksum matches, then kept for the other candidates
+static bool blockMatches(const BlockSignature* block, uint32_t weak, const char* window, uint32_t blockSize, uint64_t* strong, bool* hashed) {
+    if (block->weak != weak) {
+        return false;
+    }
+    if (!*hashed) {
+        *strong = hash64(window, blockSize, 0);
+        *hashed = true;
+    }
+    return block->strong == *strong;
+}
+
+// Adds a match, joined to the previous one when both files continue where it left off
+static int addMatch(DeltaCopy** matches, size_t* count, size_t* capacity, uint64_t offset, uint64_t basisOffset, uint64_t length) {
+    if (*count > 0) {
+        DeltaCopy* last = &(*matches)[*count - 1];
+        if (last->offset + last->length == offset && last->basisOffset + last->length == basisOffset) {
+            last->length += length;
+            return 0;
+        }
+    }
+    if (*count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 64;
+        DeltaCopy* larger = (DeltaCopy*)realloc(*matches, grown * sizeof(DeltaCopy));
+        if (!larger) {
+            return -1;
+        }
+        *matches = larger;
+        *capacity = grown;
+    }
+    DeltaCopy match = { offset, basisOffset, length };
+    (*matches)[(*count)++] = match;
+    return 0;
+}
+
+/*
+* Name: deltaCompute
+* Parameteres: const Signature* signature, const char* data, uint64_t size, uint32_t chunkSize, DeltaCopy** copies, size_t* copyCount
+* Returns: int
+* Description: Sender side: slides a block-sized window over the file and
+* looks its weak checksum up in the signature, confirming a hit with the
+* strong hash. After a match the block that follows it in the basis is tried
+* first, so unchanged stretches come out as one long match. Matches are then
+* trimmed to whole chunks, since the receiver checks each chunk against the
+* manifest on its own. *copies is allocated (free it), in file order. Returns
+* 0 on success, -1 if the memory can't be allocated.
+*/
+int deltaCompute(const Signature* signature, const char* data, uint64_t size, uint32_t chunkSize, DeltaCopy** copies, size_t* copyCount) {
+    *copies = NULL;
+    *copyCount = 0;
+    uint32_t blockSize = signature->blockSize;
+    uint64_t fullBlocks = signature->blockSize ? signature->basisSize / blockSize : 0;
+    if (chunkSize == 0 || !signatureComplete(signature)) {
+        return -1;
+    }
+
+    // Full blocks by weak checksum: a bucket for each power-of-two slot, chained through next
+    uint64_t bucketCount = 1;
+    while (bucketCount < fullBlocks) {
+        bucketCount <<= 1;
+    }
+    uint64_t* buckets = (uint64_t*)malloc((size_t)bucketCount * sizeof(uint64_t));
+    uint64_t* next = (uint64_t*)malloc(fullBlocks > 0 ? (size_t)fullBlocks * sizeof(uint64_t) : 1);
+    if (!buckets || !next) {
+        free(buckets);
+        free(next);
+        return -1;
+    }
+    for (uint64_t i = 0; i < bucketCount; i++) {
+        buckets[i] = NO_BLOCK;
+    }
+    for (uint64_t i = fullBlocks; i-- > 0;) {
+        uint64_t bucket = signature->blocks[i].weak & (bucketCount - 1);
+        next[i] = buckets[bucket];
+        buckets[bucket] = i;
+    }
+
+    DeltaCopy* matches = NULL;
+    size_t matchCount = 0, matchCapacity = 0;
+    int result = 0;
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t expected = NO_BLOCK;   // the basis block after the last match
+    uint64_t position = 0;
+    uint32_t s1 = 0, s2 = 0;
+    bool rolling = false;
+    while (fullBlocks > 0 && position + blockSize <= size) {
+        if (!rolling) {
+            weakStart(bytes + position, blockSize, &s1, &s2);
+            rolling = true;
+        }
+        uint32_t weak = weakValue(s1, s2);
+        uint64_t found = NO_BLOCK;
+        bool hashed = false;
+        uint64_t strong = 0;
+        if (expected < fullBlocks && blockMatches(&signature->blocks[expected], weak, data + position, blockSize, &strong, &hashed)) {
+            found = expected;
+        }
+        for (uint64_t candidate = buckets[weak & (bucketCount - 1)]; found == NO_BLOCK && candidate != NO_BLOCK; candidate = next[candidate]) {
+            if (candidate != expected && blockMatches(&signature->blocks[candidate], weak, data + position, blockSize, &strong, &hashed)) {
+                found = candidate;
+            }
+        }
+        if (found != NO_BLOCK) {
+            if (addMatch(&matches, &matchCount, &matchCapacity, position, found * blockSize, blockSize) != 0) {
+                result = -1;
+                break;
+            }
+            expected = found + 1;
+            position += blockSize;
+            rolling = false;
+            continue;
+        }
+        if (position + blockSize == size) {
+            break;
+        }
+        uint32_t out = bytes[position];
+        uint32_t in = bytes[position + blockSize];
+        s1 += in - out;
+        s2 += s1 - blockSize * out;
+        position++;
+    }
+
+    // The basis's short last block can only match the end of the file
+    uint64_t tail = signature->basisSize - fullBlocks * blockSize;
+    uint64_t covered = matchCount > 0 ? matches[matchCount - 1].offset + matches[matchCount - 1].length : 0;
+    if (result == 0 && tail > 0 && size >= tail && size - tail >= covered) {
+        const BlockSignature* last = &signature->blocks[signature->blockCount - 1];
+        if (last->weak == weakChecksum(data + size - tail, (uint32_t)tail) && last->strong == hash64(data + size - tail, (size_t)tail, 0)) {
+            result = addMatch(&matches, &matchCount, &matchCapacity, size - tail, fullBlocks * blockSize, tail);
+        }
+    }
+    free(buckets);
+    free(next);
+    if (result != 0) {
+        free(matches);
+        return -1;
+    }
+
+    // Whole chunks only: the ends of a match are sent with the chunks around them
+    size_t count = 0;
+    for (size_t i = 0; i < matchCount; i++) {
+        uint64_t start = (matches[i].offset + chunkSize - 1) / chunkSize * chunkSize;
+        uint64_t end = matches[i].offset + matches[i].length;
+        if (end != size) {
+            end = end / chunkSize * chunkSize;
+        }
+        if (end > start) {
+            DeltaCopy copy = { start, matches[i].basisOffset + (start - matches[i].offset), end - start };
+            matches[count++] = copy;
+        }
+    }
+    if (count == 0) {
+        free(matches);
+        matches = NULL;
+    }
+    *copies = matches;
+    *copyCount = count;
+    return 0;
+}
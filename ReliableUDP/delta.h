@@ -0,0 +1,53 @@
+/*
+ * FILE: delta.h
+ * PROJECT: Reliable UDP File Transfer
+ * PROGRAMMER: Manreet & Bhawanjeet
+ * FIRST VERSION: 17/10/2026
+ * DESCRIPTION:
+ * This header file declares the delta transfer (the rsync algorithm). The
+ * receiver describes the copy of the file it already has with a signature:
+ * a weak rolling checksum and a strong hash for every block. The sender rolls
+ * the weak checksum over its own file, byte by byte, to find those blocks at
+ * any offset, and only sends what the receiver can't copy from its old copy.
+ */
+#ifndef DELTA_H
+#define DELTA_H
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DELTA_MIN_BLOCK 700  // signature block size limits, in between it grows with the square root of the file
+#define DELTA_MAX_BLOCK (128 * 1024)
+
+// One block of the receiver's copy
+typedef struct {
+    uint32_t weak;      // rolling checksum, cheap to slide along the sender's file
+    uint64_t strong;    // XXH64, checked only when the weak checksum matches
+} BlockSignature;
+
+// Every block of the receiver's copy (the basis), the last one may be short
+typedef struct {
+    uint64_t basisSize;
+    uint32_t blockSize;
+    uint64_t blockCount;
+    uint64_t receivedBlocks;
+    BlockSignature* blocks;
+} Signature;
+
+// File bytes the receiver copies from its basis instead of having them sent
+typedef struct {
+    uint64_t offset;        // in the file being sent, on a chunk boundary
+    uint64_t basisOffset;
+    uint64_t length;        // whole chunks, or up to the end of the file
+} DeltaCopy;
+
+uint32_t signatureBlockSize(uint64_t basisSize);
+int signatureBuild(Signature* signature, const char* basis, uint64_t basisSize, uint32_t blockSize);
+int signatureInit(Signature* signature, uint64_t basisSize, uint32_t blockSize);
+bool signatureAddBlocks(Signature* signature, uint64_t firstBlock, const BlockSignature* blocks, uint64_t count);
+bool signatureComplete(const Signature* signature);
+void signatureFree(Signature* signature);
+int deltaCompute(const Signature* signature, const char* data, uint64_t size, uint32_t chunkSize, DeltaCopy** copies, size_t* copyCount);
+
+#endif
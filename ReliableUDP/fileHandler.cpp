@@ -5,51 +5,62 @@
  * FIRST VERSION: 15/02/2025
  * DESCRIPTION:
  * This source file implements file handling functions for the Reliable UDP
- * file transfer system. It includes functions to read and write files, generate
- * metadata packets, and perform integrity verification using CRC32.
+ * file transfer system. It includes functions to read, map and write files,
+ * stream received chunks to disk (in the background through io_uring where
+ * the kernel offers it), build and parse the transfer messages,
+ * track which chunks have arrived, keep the resume journal, and perform
+ * integrity verification using CRC32 (whole file) and CRC-32C (per data
+ * packet).
  */
 #include "fileHandler.h"
+#include "crc32.h"
+#include "IoRing.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <chrono>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #pragma warning(disable: 4996)
 
 
 #define PACKET_SIZE 1024
 #define CHECKSUM_SIZE 4 // CRC32 produces 4-byte checksum
-#define POLYNOMIAL 0xEDB88320  // Standard CRC-32 polynomial
 const int size = 256;
 
 
-
-static uint32_t crc32_table[size];
-//
-//Source: https://gist.github.com/timepp/1f678e200d9e0f2a043a9ec6b3690635
-
+// Kept for callers that want to build the tables up front; the CRC32 engine
+// also initializes itself on first use.
 void init_crc32_table(void) {
-    for (uint32_t i = 0; i < size; i++) {
-        uint32_t crc = i;
-        for (int j = 0; j < 8; j++) {
-            crc = (crc >> 1) ^ (crc & 1 ? POLYNOMIAL : 0);
-        }
-        crc32_table[i] = crc;
-    }
+    crc32Init();
 }
 
 uint32_t computeCRC32(const char* data, size_t size) {
-    uint32_t crc = 0xFFFFFFFF;
-    for (size_t i = 0; i < size; ++i) {
-        crc ^= (uint8_t)data[i];
-        for (int j = 0; j < 8; ++j) {
-            crc = (crc >> 1) ^ (0xEDB88320 * (crc & 1));
-        }
-    }
-    return ~crc;
+    return crc32Update(0, data, size);
 }
 
 int loadFile(const char* filename, char** buffer, size_t* size)
+{
+    return loadFileWithCRC(filename, buffer, size, NULL);
+}
+
+/*
+* Name: loadFileWithCRC
+* Parameteres: const char* filename, char** buffer, size_t* size, uint32_t* crc
+* Returns: int
+* Description: Loads the file into memory. When crc is not NULL the CRC32 is
+* computed block by block while reading, so the file is only walked once.
+*/
+int loadFileWithCRC(const char* filename, char** buffer, size_t* size, uint32_t* crc)
 {
     FILE* file = fopen(filename, "rb");
     if (!file) 
@@ -70,10 +81,584 @@ int loadFile(const char* filename, char** buffer, size_t* size)
         return -1;
     }
 
-    fread(*buffer, 1, *size, file);  // Read file
+    Crc32Context context;
+    crc32ContextInit(&context);
+    size_t offset = 0;
+    while (offset < *size)
+    {
+        size_t block = (*size - offset < FILE_BLOCK_SIZE) ? *size - offset : FILE_BLOCK_SIZE;
+        size_t read = fread(*buffer + offset, 1, block, file);  // Read file
+        if (read == 0)
+        {
+            break;
+        }
+        if (crc)
+        {
+            crc32ContextUpdate(&context, *buffer + offset, read);
+        }
+        offset += read;
+    }
     fclose(file); 
+    if (crc)
+    {
+        *crc = crc32ContextFinal(&context);
+    }
+    return 0;
+
+}
+
+/*
+* Name: mapFile
+* Parameteres: const char* filename, MappedFile* file
+* Returns: int
+* Description: Maps the whole file read-only instead of copying it into a
+* malloc'd buffer, so sending can start straight away and only the pages
+* near the send position need to be resident. The kernel is told the file
+* will be read sequentially; mappedFileAdvance keeps readahead going.
+*/
+int mapFile(const char* filename, MappedFile* file)
+{
+    memset(file, 0, sizeof(*file));
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        printf("Error opening file: %s\n", filename);
+        return -1;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(handle, &fileSize) || (unsigned long long)fileSize.QuadPart > (size_t)-1)
+    {
+        CloseHandle(handle);
+        return -1;
+    }
+    file->size = (size_t)fileSize.QuadPart;
+    file->fileHandle = handle;
+
+    if (file->size > 0)  // empty files can't be mapped
+    {
+        HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!mapping)
+        {
+            printf("Error mapping file: %s\n", filename);
+            CloseHandle(handle);
+            return -1;
+        }
+        file->data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!file->data)
+        {
+            printf("Error mapping file: %s\n", filename);
+            CloseHandle(mapping);
+            CloseHandle(handle);
+            return -1;
+        }
+        file->mappingHandle = mapping;
+    }
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("Error opening file");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (unsigned long long)st.st_size > (size_t)-1)
+    {
+        close(fd);
+        return -1;
+    }
+    file->size = (size_t)st.st_size;
+    file->fd = fd;
+
+    if (file->size > 0)  // empty files can't be mapped
+    {
+        void* data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            perror("Error mapping file");
+            close(fd);
+            return -1;
+        }
+        file->data = (const char*)data;
+        madvise(data, file->size, MADV_SEQUENTIAL);
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+#endif
+    mappedFileAdvance(file, 0);
+    return 0;
+}
+
+/*
+* Name: mappedFileAdvance
+* Parameteres: MappedFile* file, size_t offset
+* Returns: void
+* Description: Called as the sender moves through the file. Requests readahead
+* for the next window once the sender gets close to the end of the current one,
+* and hands back pages more than a window behind so memory use stays bounded.
+*/
+void mappedFileAdvance(MappedFile* file, size_t offset)
+{
+    if (!file->data)
+    {
+        return;
+    }
+#ifndef _WIN32
+    if (file->advisedOffset < file->size && offset + MAP_READAHEAD_WINDOW / 2 >= file->advisedOffset)
+    {
+        size_t start = file->advisedOffset;
+        if (offset > start)
+        {
+            start = offset - offset % MAP_READAHEAD_WINDOW;
+        }
+        size_t end = start + MAP_READAHEAD_WINDOW;
+        if (end > file->size)
+        {
+            end = file->size;
+        }
+        madvise((void*)(file->data + start), end - start, MADV_WILLNEED);
+        file->advisedOffset = end;
+    }
+
+    if (offset >= 2 * MAP_READAHEAD_WINDOW)
+    {
+        size_t release = offset - MAP_READAHEAD_WINDOW;
+        release -= release % MAP_READAHEAD_WINDOW;
+        if (release > file->releasedOffset)
+        {
+            // clean file-backed pages: the kernel reloads them if they are read again
+            madvise((void*)(file->data + file->releasedOffset), release - file->releasedOffset, MADV_DONTNEED);
+            file->releasedOffset = release;
+        }
+    }
+#else
+    file->advisedOffset = offset;  // FILE_FLAG_SEQUENTIAL_SCAN drives readahead on Windows
+#endif
+}
+
+void unmapFile(MappedFile* file)
+{
+#ifdef _WIN32
+    if (file->data)
+    {
+        UnmapViewOfFile(file->data);
+    }
+    if (file->mappingHandle)
+    {
+        CloseHandle(file->mappingHandle);
+    }
+    if (file->fileHandle)
+    {
+        CloseHandle(file->fileHandle);
+    }
+#else
+    if (file->data)
+    {
+        munmap((void*)file->data, file->size);
+    }
+    if (file->fd > 0)
+    {
+        close(file->fd);
+    }
+#endif
+    memset(file, 0, sizeof(*file));
+}
+
+// Modification time in seconds since 1970, the same on every platform
+int getFileModifiedTime(const char* filename, uint64_t* modifiedTime)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &attributes))
+    {
+        return -1;
+    }
+    uint64_t ticks = ((uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+    *modifiedTime = ticks / 10000000ULL - 11644473600ULL;  // 100ns ticks since 1601
+#else
+    struct stat info;
+    if (stat(filename, &info) != 0)
+    {
+        return -1;
+    }
+    *modifiedTime = (uint64_t)info.st_mtime;
+#endif
+    return 0;
+}
+
+// Renames from over to, replacing it if it exists (rename alone won't on Windows)
+int replaceFile(const char* from, const char* to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return rename(from, to);
+#endif
+}
+
+static int writeAt(FileSink* sink, uint64_t offset, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+#ifdef _WIN32
+        OVERLAPPED position = {};
+        position.Offset = (DWORD)offset;
+        position.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+        DWORD written = 0;
+        if (!WriteFile(sink->fileHandle, data, chunk, &written, &position) || written == 0)
+        {
+            return -1;
+        }
+#else
+        ssize_t written = pwrite(sink->fd, data, size, (off_t)offset);
+        if (written <= 0)
+        {
+            return -1;
+        }
+#endif
+        data += written;
+        offset += written;
+        size -= written;
+    }
+    return 0;
+}
+
+#if NET_IO_URING
+// Two batch buffers: one fills while the ring writes the other. The file is
+// registered with the ring, and so are the buffers if the memory lock limit
+// allows (each write then skips mapping them)
+struct SinkRing {
+    net::IoRing ring;
+    char* buffers[2];
+    int filling;            // the buffer sink->batch points to
+    bool fixedBuffers;      // buffers registered, written with IORING_OP_WRITE_FIXED
+    bool writing;           // the other buffer is being written
+    uint64_t writeOffset;
+    size_t writeSize;
+};
+
+static void sinkRingOpen(FileSink* sink)
+{
+    SinkRing* ring = new SinkRing();
+    ring->buffers[0] = sink->batch;
+    ring->buffers[1] = (char*)malloc(SINK_BATCH_SIZE);
+    if (!ring->buffers[1] || !ring->ring.Open(4) || !ring->ring.RegisterFiles(&sink->fd, 1))
+    {
+        free(ring->buffers[1]);
+        delete ring;
+        return;
+    }
+    iovec vectors[2] = { { ring->buffers[0], SINK_BATCH_SIZE }, { ring->buffers[1], SINK_BATCH_SIZE } };
+    ring->fixedBuffers = ring->ring.RegisterBuffers(vectors, 2);
+    ring->filling = 0;
+    ring->writing = false;
+    sink->ring = ring;
+}
+
+// Waits for the batch being written. What the kernel didn't write (a short
+// write) is finished with plain writes
+static int sinkRingWait(FileSink* sink)
+{
+    SinkRing* ring = sink->ring;
+    if (!ring->writing)
+    {
+        return 0;
+    }
+    ring->writing = false;
+    io_uring_cqe* completion;
+    while ((completion = ring->ring.PeekCompletion()) == NULL)
+    {
+        if (!ring->ring.Submit(1))
+        {
+            return -1;
+        }
+    }
+    int result = completion->res;
+    ring->ring.SeeCompletion();
+    if (result < 0)
+    {
+        return -1;
+    }
+    if ((size_t)result < ring->writeSize)
+    {
+        return writeAt(sink, ring->writeOffset + result, ring->buffers[ring->filling ^ 1] + result, ring->writeSize - result);
+    }
+    return 0;
+}
+
+// Hands the batch to the ring and goes on filling the other buffer, once the
+// write before it is done
+static int sinkRingWrite(FileSink* sink)
+{
+    SinkRing* ring = sink->ring;
+    int result = sinkRingWait(sink);
+    io_uring_sqe* submission = result == 0 ? ring->ring.GetSubmission() : NULL;
+    if (submission)
+    {
+        submission->opcode = ring->fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        submission->fd = 0;
+        submission->flags = IOSQE_FIXED_FILE;
+        submission->addr = (uint64_t)(uintptr_t)sink->batch;
+        submission->len = (uint32_t)sink->batchUsed;
+        submission->off = sink->batchOffset;
+        submission->buf_index = (uint16_t)ring->filling;
+        if (ring->ring.Submit())
+        {
+            ring->writing = true;
+            ring->writeOffset = sink->batchOffset;
+            ring->writeSize = sink->batchUsed;
+            ring->filling ^= 1;
+            sink->batch = ring->buffers[ring->filling];
+        }
+        else
+        {
+            result = -1;
+        }
+    }
+    else
+    {
+        result = -1;
+    }
+    sink->batchUsed = 0;
+    return result;
+}
+#endif
+
+// Waits until no write is left in the background
+static int fileSinkWait(FileSink* sink)
+{
+#if NET_IO_URING
+    if (sink->ring)
+    {
+        return sinkRingWait(sink);
+    }
+#endif
+    (void)sink;
+    return 0;
+}
+
+/*
+* Name: openFileSink
+* Parameteres: const char* filename, uint64_t fileSize, FileSink* sink, bool keepContents
+* Returns: int
+* Description: Creates the output file and reserves its full size on disk up
+* front, so a size the disk can't hold is rejected before any data arrives
+* and later writes don't fragment the file. Only one batch buffer of
+* SINK_BATCH_SIZE bytes is allocated, whatever the file size (two with
+* io_uring, which writes one while the other fills). With keepContents an
+* existing (partial) file is reopened as it is, to resume.
+*/
+int openFileSink(const char* filename, uint64_t fileSize, FileSink* sink, bool keepContents)
+{
+    memset(sink, 0, sizeof(*sink));
+    sink->fileSize = fileSize;
+    sink->batch = (char*)malloc(SINK_BATCH_SIZE);
+    if (!sink->batch)
+    {
+        return -1;
+    }
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(filename, GENERIC_WRITE, 0, NULL, keepContents ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        printf("Error opening file: %s\n", filename);
+        free(sink->batch);
+        sink->batch = NULL;
+        return -1;
+    }
+    sink->fileHandle = handle;
+
+    LARGE_INTEGER size;
+    size.QuadPart = (LONGLONG)fileSize;
+    if (!SetFilePointerEx(handle, size, NULL, FILE_BEGIN) || !SetEndOfFile(handle))
+    {
+        printf("Could not reserve %llu bytes for %s\n", (unsigned long long)fileSize, filename);
+        closeFileSink(sink);
+        return -1;
+    }
+#else
+    int fd = open(filename, O_WRONLY | O_CREAT | (keepContents ? 0 : O_TRUNC), 0644);
+    if (fd < 0)
+    {
+        perror("Error opening file");
+        free(sink->batch);
+        sink->batch = NULL;
+        return -1;
+    }
+    sink->fd = fd;
+
+    if (fileSize > 0)
+    {
+#if defined(__linux__)
+        int error = posix_fallocate(fd, 0, (off_t)fileSize);
+#else
+        int error = ftruncate(fd, (off_t)fileSize) == 0 ? 0 : -1;
+#endif
+        if (error != 0)
+        {
+            printf("Could not reserve %llu bytes for %s\n", (unsigned long long)fileSize, filename);
+            closeFileSink(sink);
+            return -1;
+        }
+    }
+#if NET_IO_URING
+    sinkRingOpen(sink);
+#endif
+#endif
+    return 0;
+}
+
+/*
+* Name: fileSinkWrite
+* Parameteres: FileSink* sink, uint64_t offset, const char* data, size_t size
+* Returns: int
+* Description: Places a chunk at its offset in the output file. Chunks that
+* continue the current batch are appended to it; the batch is written out
+* when it is full or when a chunk lands somewhere else.
+*/
+int fileSinkWrite(FileSink* sink, uint64_t offset, const char* data, size_t size)
+{
+    if (offset > sink->fileSize || size > sink->fileSize - offset)
+    {
+        return -1;  // outside the announced file
+    }
+    if (sink->batchUsed > 0 && offset != sink->batchOffset + sink->batchUsed)
+    {
+        if (fileSinkFlush(sink) != 0)
+        {
+            return -1;
+        }
+    }
+    if (size >= SINK_BATCH_SIZE)
+    {
+        if (fileSinkFlush(sink) != 0 || fileSinkWait(sink) != 0)
+        {
+            return -1;
+        }
+        return writeAt(sink, offset, data, size);
+    }
+    if (sink->batchUsed + size > SINK_BATCH_SIZE)
+    {
+        if (fileSinkFlush(sink) != 0)
+        {
+            return -1;
+        }
+    }
+    if (sink->batchUsed == 0)
+    {
+        sink->batchOffset = offset;
+    }
+    memcpy(sink->batch + sink->batchUsed, data, size);
+    sink->batchUsed += size;
     return 0;
+}
 
+/*
+* Name: fileSinkReserve
+* Parameteres: FileSink* sink, uint64_t offset, size_t size
+* Returns: char*
+* Description: Room in the batch for the size bytes at offset, so a chunk
+* can be decoded straight into the output instead of being copied there.
+* Nothing is written until fileSinkCommit; a chunk that turns out to be bad
+* is just never committed. Returns NULL if it is outside the file.
+*/
+char* fileSinkReserve(FileSink* sink, uint64_t offset, size_t size)
+{
+    if (offset > sink->fileSize || size > sink->fileSize - offset || size > SINK_BATCH_SIZE)
+    {
+        return NULL;
+    }
+    if (sink->batchUsed > 0 && (offset != sink->batchOffset + sink->batchUsed || sink->batchUsed + size > SINK_BATCH_SIZE))
+    {
+        if (fileSinkFlush(sink) != 0)
+        {
+            return NULL;
+        }
+    }
+    if (sink->batchUsed == 0)
+    {
+        sink->batchOffset = offset;
+    }
+    return sink->batch + sink->batchUsed;
+}
+
+// Adds the bytes decoded into the space from fileSinkReserve to the batch
+int fileSinkCommit(FileSink* sink, size_t size)
+{
+    if (sink->batchUsed + size > SINK_BATCH_SIZE)
+    {
+        return -1;
+    }
+    sink->batchUsed += size;
+    return 0;
+}
+
+// Writes the batch out. With io_uring the write only starts here, an error
+// shows up at the next flush (or sync, or close)
+int fileSinkFlush(FileSink* sink)
+{
+    if (sink->batchUsed == 0)
+    {
+        return 0;
+    }
+#if NET_IO_URING
+    if (sink->ring)
+    {
+        return sinkRingWrite(sink);
+    }
+#endif
+    int result = writeAt(sink, sink->batchOffset, sink->batch, sink->batchUsed);
+    sink->batchUsed = 0;
+    return result;
+}
+
+// Flushes the batch and waits until everything written so far is on disk
+int fileSinkSync(FileSink* sink)
+{
+    if (fileSinkFlush(sink) != 0 || fileSinkWait(sink) != 0)
+    {
+        return -1;
+    }
+#ifdef _WIN32
+    return FlushFileBuffers(sink->fileHandle) ? 0 : -1;
+#else
+    return fsync(sink->fd);
+#endif
+}
+
+int closeFileSink(FileSink* sink)
+{
+    int result = sink->batch ? fileSinkFlush(sink) : 0;
+    if (fileSinkWait(sink) != 0)
+    {
+        result = -1;
+    }
+#ifdef _WIN32
+    if (sink->fileHandle && !CloseHandle(sink->fileHandle))
+    {
+        result = -1;
+    }
+#else
+#if NET_IO_URING
+    if (sink->ring)
+    {
+        char* spare = sink->ring->buffers[sink->ring->filling ^ 1];
+        delete sink->ring;  // closes the ring before its buffers go
+        free(spare);
+    }
+#endif
+    if (sink->fd > 0 && close(sink->fd) != 0)
+    {
+        result = -1;
+    }
+#endif
+    free(sink->batch);
+    memset(sink, 0, sizeof(*sink));
+    return result;
 }
 
 /*
@@ -117,54 +702,726 @@ double calculateTransferSpeed(double startTime, double endTime, size_t fileSize)
 
     return speed;
 }
-//Creating a metadata packet
-void createMetadataPacket(const char* filename, size_t fileSize, uint32_t crc, bool isLast, char* packet, size_t* packetSize, size_t offset) {
-    FileMetadata metadata;
-    strncpy(metadata.filename, filename, sizeof(metadata.filename) - 1);
-    metadata.fileSize = fileSize;
-    metadata.crc = crc;
-    metadata.isLastPacket = isLast;
+static void writeLittleEndian(char* p, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        p[i] = (char)(value >> (i * 8));
+    }
+}
 
-    size_t totalMetadataSize = sizeof(FileMetadata);
-    size_t remainingSize = totalMetadataSize - offset;
-    size_t chunkSize = (remainingSize < size) ? remainingSize : size;
-    memcpy(packet, ((char*)&metadata) + offset, chunkSize);
-    *packetSize = chunkSize;
+static uint64_t readLittleEndian(const char* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)(unsigned char)p[i] << (i * 8);
+    }
+    return value;
 }
-//Get the metadata packet
-bool extractMetadataPacket(const char* packet, size_t bytesRead, FileMetadata* metadata, char* metadataBuffer, size_t* receivedMetaOffset) {
-    if (!packet || !metadata || !metadataBuffer || !receivedMetaOffset) {
-        return false;
+
+// Returns the MessageType in the first byte, or 0 for an empty packet
+int getMessageType(const char* packet, size_t bytesRead) {
+    if (!packet || bytesRead == 0) {
+        return 0;
     }
-    memcpy(metadataBuffer + *receivedMetaOffset, packet, bytesRead);
-    *receivedMetaOffset += bytesRead;
+    return (unsigned char)packet[0];
+}
 
-    // Check if we have received the full metadata structure
-    if (*receivedMetaOffset >= sizeof(FileMetadata)) {
-        memcpy(metadata, metadataBuffer, sizeof(FileMetadata));
-        *receivedMetaOffset = 0;
-        return true;
+// LEB128: seven bits per byte, low bits first, the top bit set on all but the last byte
+static size_t writeVarint(char* p, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        p[length++] = (char)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    p[length++] = (char)value;
+    return length;
+}
+
+// Reads a varint at *position, moving past it. False if it runs off the end or past 64 bits
+static bool readVarint(const char* packet, size_t size, size_t* position, uint64_t* value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && *position < size; shift += 7) {
+        unsigned char byte = (unsigned char)packet[(*position)++];
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
     }
     return false;
 }
-// Function to create a data packet
+
+/*
+* Name: createMetadataPacket
+* Parameteres: const FileMetadata* metadata, char* packet, size_t maxPacketSize
+* Returns: size_t
+* Description: Encodes the metadata (or, with isLastPacket set, the trailer)
+* as one message, see FileMetadata for the layout. Returns its size, or 0 if
+* the name is longer than METADATA_MAX_NAME or it doesn't fit maxPacketSize.
+*/
+size_t createMetadataPacket(const FileMetadata* metadata, char* packet, size_t maxPacketSize) {
+    if (metadata->filenameLength > METADATA_MAX_NAME || maxPacketSize < METADATA_MAX_SIZE) {
+        return 0;
+    }
+    size_t size = 0;
+    packet[size++] = MESSAGE_METADATA;
+    packet[size++] = METADATA_VERSION;
+    packet[size++] = (metadata->isLastPacket ? METADATA_FLAG_LAST : 0) | (metadata->deltaOffered ? METADATA_FLAG_DELTA : 0);
+    size += writeVarint(packet + size, metadata->fileSize);
+    writeLittleEndian(packet + size, metadata->crc, 4);
+    size += 4;
+    size += writeVarint(packet + size, metadata->chunkSize);
+    writeLittleEndian(packet + size, metadata->rootHash, 8);
+    size += 8;
+    size += writeVarint(packet + size, metadata->modifiedTime);
+    packet[size++] = (char)metadata->hashAlgorithm;
+    packet[size++] = (char)metadata->compression;
+    size += writeVarint(packet + size, metadata->filenameLength);
+    memcpy(packet + size, metadata->filename, metadata->filenameLength);
+    return size + metadata->filenameLength;
+}
+
+/*
+* Name: extractMetadataPacket
+* Parameteres: const char* packet, size_t bytesRead, FileMetadata* metadata
+* Returns: bool
+* Description: Decodes a metadata message. Nothing is copied: the file name
+* is left in the packet and metadata->filename points at it, so it is only
+* valid until the packet buffer is reused. Returns false for a truncated
+* message or another version.
+*/
+bool extractMetadataPacket(const char* packet, size_t bytesRead, FileMetadata* metadata) {
+    if (getMessageType(packet, bytesRead) != MESSAGE_METADATA || bytesRead < 3 ||
+        (unsigned char)packet[1] != METADATA_VERSION) {
+        return false;
+    }
+    FileMetadata decoded;
+    memset(&decoded, 0, sizeof(decoded));
+    decoded.version = (uint8_t)packet[1];
+    decoded.isLastPacket = (packet[2] & METADATA_FLAG_LAST) != 0;
+    decoded.deltaOffered = (packet[2] & METADATA_FLAG_DELTA) != 0;
+
+    size_t position = 3;
+    uint64_t chunkSize = 0;
+    uint64_t nameLength = 0;
+    if (!readVarint(packet, bytesRead, &position, &decoded.fileSize) || bytesRead - position < 4) {
+        return false;
+    }
+    decoded.crc = (uint32_t)readLittleEndian(packet + position, 4);
+    position += 4;
+    if (!readVarint(packet, bytesRead, &position, &chunkSize) || chunkSize > UINT32_MAX || bytesRead - position < 8) {
+        return false;
+    }
+    decoded.chunkSize = (uint32_t)chunkSize;
+    decoded.rootHash = readLittleEndian(packet + position, 8);
+    position += 8;
+    if (!readVarint(packet, bytesRead, &position, &decoded.modifiedTime) || bytesRead - position < 2) {
+        return false;
+    }
+    decoded.hashAlgorithm = (uint8_t)packet[position++];
+    decoded.compression = (uint8_t)packet[position++];
+    if (!readVarint(packet, bytesRead, &position, &nameLength) || nameLength > METADATA_MAX_NAME ||
+        nameLength > bytesRead - position) {
+        return false;
+    }
+    decoded.filename = packet + position;
+    decoded.filenameLength = (size_t)nameLength;
+    *metadata = decoded;
+    return true;
+}
+
+/*
+* Name: createManifestPacket
+* Parameteres: const Manifest* manifest, uint64_t firstLeaf, char* packet, size_t maxPacketSize, size_t* packetSize
+* Returns: uint64_t
+* Description: Fills a packet with as many leaves as fit, starting at
+* firstLeaf. Returns the number of leaves written, 0 if not even one fits.
+*/
+uint64_t createManifestPacket(const Manifest* manifest, uint64_t firstLeaf, char* packet, size_t maxPacketSize, size_t* packetSize) {
+    if (maxPacketSize < MANIFEST_HEADER_SIZE + sizeof(uint64_t)) {
+        *packetSize = 0;
+        return 0;
+    }
+    uint64_t count = (maxPacketSize - MANIFEST_HEADER_SIZE) / sizeof(uint64_t);
+    if (count > MANIFEST_MAX_LEAVES) {
+        count = MANIFEST_MAX_LEAVES;
+    }
+    if (count > manifest->chunkCount - firstLeaf) {
+        count = manifest->chunkCount - firstLeaf;
+    }
+    packet[0] = MESSAGE_MANIFEST;
+    writeLittleEndian(packet + 1, firstLeaf, 8);
+    for (uint64_t i = 0; i < count; i++) {
+        writeLittleEndian(packet + MANIFEST_HEADER_SIZE + i * sizeof(uint64_t), manifest->leaves[firstLeaf + i], 8);
+    }
+    *packetSize = MANIFEST_HEADER_SIZE + (size_t)count * sizeof(uint64_t);
+    return count;
+}
+
+bool extractManifestPacket(const char* packet, size_t bytesRead, Manifest* manifest) {
+    if (getMessageType(packet, bytesRead) != MESSAGE_MANIFEST || bytesRead < MANIFEST_HEADER_SIZE ||
+        (bytesRead - MANIFEST_HEADER_SIZE) % sizeof(uint64_t) != 0) {
+        return false;
+    }
+    uint64_t leaves[MANIFEST_MAX_LEAVES];
+    uint64_t count = (bytesRead - MANIFEST_HEADER_SIZE) / sizeof(uint64_t);
+    if (count > MANIFEST_MAX_LEAVES) {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        leaves[i] = readLittleEndian(packet + MANIFEST_HEADER_SIZE + i * sizeof(uint64_t), 8);
+    }
+    return manifestAddLeaves(manifest, readLittleEndian(packet + 1, 8), leaves, count);
+}
+
+// Function to create a data packet: type, the chunk's file offset and a CRC-32C over both plus the chunk, then the chunk
 size_t createDataPacket(const char* fileBuffer, size_t fileSize, size_t currentOffset, char* tempBuffer, size_t maxPacketSize, bool isLastPacket) {
     size_t remainingSize = fileSize - currentOffset;
-    size_t packetSize = (remainingSize < maxPacketSize) ? remainingSize : maxPacketSize;
+    size_t maxChunkSize = maxPacketSize - DATA_HEADER_SIZE;
+    size_t chunkSize = (remainingSize < maxChunkSize) ? remainingSize : maxChunkSize;
+
+    tempBuffer[0] = MESSAGE_DATA;
+    writeLittleEndian(tempBuffer + 1, currentOffset, 8);
+    memcpy(tempBuffer + DATA_HEADER_SIZE, fileBuffer + currentOffset, chunkSize);
+    uint32_t crc = crc32cUpdate(0, tempBuffer, 9);
+    crc = crc32cUpdate(crc, tempBuffer + DATA_HEADER_SIZE, chunkSize);
+    writeLittleEndian(tempBuffer + 9, crc, 4);
+    return DATA_HEADER_SIZE + chunkSize;  // Return the actual packet size
+}
+
+// Splits a data packet into its offset and chunk, the chunk is left in the packet (no copy).
+// Returns false if the packet is damaged (CRC-32C mismatch)
+bool extractDataPacket(const char* packet, size_t bytesRead, uint64_t* offset, const char** data, size_t* dataSize) {
+    if (getMessageType(packet, bytesRead) != MESSAGE_DATA || bytesRead <= DATA_HEADER_SIZE) {
+        return false;
+    }
+    uint32_t crc = crc32cUpdate(0, packet, 9);
+    crc = crc32cUpdate(crc, packet + DATA_HEADER_SIZE, bytesRead - DATA_HEADER_SIZE);
+    if (crc != (uint32_t)readLittleEndian(packet + 9, 4)) {
+        return false;
+    }
+    *offset = readLittleEndian(packet + 1, 8);
+    *data = packet + DATA_HEADER_SIZE;
+    *dataSize = bytesRead - DATA_HEADER_SIZE;
+    return true;
+}
+
+size_t createResendRequest(uint64_t offset, uint64_t length, char* packet) {
+    packet[0] = MESSAGE_RESEND;
+    writeLittleEndian(packet + 1, offset, 8);
+    writeLittleEndian(packet + 9, length, 8);
+    return RESEND_REQUEST_SIZE;
+}
+
+bool extractResendRequest(const char* packet, size_t bytesRead, uint64_t* offset, uint64_t* length) {
+    if (getMessageType(packet, bytesRead) != MESSAGE_RESEND || bytesRead != RESEND_REQUEST_SIZE) {
+        return false;
+    }
+    *offset = readLittleEndian(packet + 1, 8);
+    *length = readLittleEndian(packet + 9, 8);
+    return true;
+}
+
+size_t createResumePacket(uint64_t offset, char* packet) {
+    packet[0] = MESSAGE_RESUME;
+    writeLittleEndian(packet + 1, offset, 8);
+    return RESUME_PACKET_SIZE;
+}
+
+bool extractResumePacket(const char* packet, size_t bytesRead, uint64_t* offset) {
+    if (getMessageType(packet, bytesRead) != MESSAGE_RESUME || bytesRead != RESUME_PACKET_SIZE) {
+        return false;
+    }
+    *offset = readLittleEndian(packet + 1, 8);
+    return true;
+}
 
-    memcpy(tempBuffer, fileBuffer + currentOffset, packetSize);
-    return packetSize;  // Return the actual packet size
+/*
+* Name: createSignaturePacket
+* Parameteres: const Signature* signature, uint64_t firstBlock, char* packet, size_t maxPacketSize, size_t* packetSize
+* Returns: uint64_t
+* Description: Fills a packet with as many block signatures as fit, starting
+* at firstBlock. Every packet repeats the basis size and block size, so the
+* first one to arrive is enough to size the signature. Returns the number of
+* blocks written, 0 if not even one fits.
+*/
+uint64_t createSignaturePacket(const Signature* signature, uint64_t firstBlock, char* packet, size_t maxPacketSize, size_t* packetSize) {
+    if (maxPacketSize < SIGNATURE_HEADER_SIZE + SIGNATURE_ENTRY_SIZE) {
+        *packetSize = 0;
+        return 0;
+    }
+    uint64_t count = (maxPacketSize - SIGNATURE_HEADER_SIZE) / SIGNATURE_ENTRY_SIZE;
+    if (count > SIGNATURE_MAX_BLOCKS) {
+        count = SIGNATURE_MAX_BLOCKS;
+    }
+    if (count > signature->blockCount - firstBlock) {
+        count = signature->blockCount - firstBlock;
+    }
+    packet[0] = MESSAGE_SIGNATURE;
+    writeLittleEndian(packet + 1, signature->basisSize, 8);
+    writeLittleEndian(packet + 9, signature->blockSize, 4);
+    writeLittleEndian(packet + 13, firstBlock, 8);
+    for (uint64_t i = 0; i < count; i++) {
+        char* entry = packet + SIGNATURE_HEADER_SIZE + i * SIGNATURE_ENTRY_SIZE;
+        writeLittleEndian(entry, signature->blocks[firstBlock + i].weak, 4);
+        writeLittleEndian(entry + 4, signature->blocks[firstBlock + i].strong, 8);
+    }
+    *packetSize = SIGNATURE_HEADER_SIZE + (size_t)count * SIGNATURE_ENTRY_SIZE;
+    return count;
 }
 
+// The first packet sizes the signature, the rest must describe the same basis
+bool extractSignaturePacket(const char* packet, size_t bytesRead, Signature* signature) {
+    if (getMessageType(packet, bytesRead) != MESSAGE_SIGNATURE || bytesRead < SIGNATURE_HEADER_SIZE ||
+        (bytesRead - SIGNATURE_HEADER_SIZE) % SIGNATURE_ENTRY_SIZE != 0) {
+        return false;
+    }
+    uint64_t count = (bytesRead - SIGNATURE_HEADER_SIZE) / SIGNATURE_ENTRY_SIZE;
+    uint64_t basisSize = readLittleEndian(packet + 1, 8);
+    uint32_t blockSize = (uint32_t)readLittleEndian(packet + 9, 4);
+    if (count > SIGNATURE_MAX_BLOCKS) {
+        return false;
+    }
+    if (!signature->blocks && signatureInit(signature, basisSize, blockSize) != 0) {
+        signatureFree(signature);
+        return false;
+    }
+    if (basisSize != signature->basisSize || blockSize != signature->blockSize) {
+        return false;
+    }
+    BlockSignature blocks[SIGNATURE_MAX_BLOCKS];
+    for (uint64_t i = 0; i < count; i++) {
+        const char* entry = packet + SIGNATURE_HEADER_SIZE + i * SIGNATURE_ENTRY_SIZE;
+        blocks[i].weak = (uint32_t)readLittleEndian(entry, 4);
+        blocks[i].strong = readLittleEndian(entry + 4, 8);
+    }
+    return signatureAddBlocks(signature, readLittleEndian(packet + 13, 8), blocks, count);
+}
+
+size_t createCopyPacket(const DeltaCopy* copy, char* packet) {
+    packet[0] = MESSAGE_COPY;
+    writeLittleEndian(packet + 1, copy->offset, 8);
+    writeLittleEndian(packet + 9, copy->basisOffset, 8);
+    writeLittleEndian(packet + 17, copy->length, 8);
+    return COPY_PACKET_SIZE;
+}
+
+bool extractCopyPacket(const char* packet, size_t bytesRead, DeltaCopy* copy) {
+    if (getMessageType(packet, bytesRead) != MESSAGE_COPY || bytesRead != COPY_PACKET_SIZE) {
+        return false;
+    }
+    copy->offset = readLittleEndian(packet + 1, 8);
+    copy->basisOffset = readLittleEndian(packet + 9, 8);
+    copy->length = readLittleEndian(packet + 17, 8);
+    return true;
+}
+
+// Fragments needed for a block when each block message may be maxPacketSize bytes
+uint32_t blockFragmentCount(const EncodedBlock* block, size_t maxPacketSize) {
+    size_t fragmentSize = maxPacketSize - BLOCK_HEADER_SIZE;
+    return block->size == 0 ? 1 : (uint32_t)((block->size + fragmentSize - 1) / fragmentSize);
+}
 
-bool VerifyFile(const char* filename, uint32_t expectedCRC) {
-        char* buffer;
-        size_t fileSize;
-        if (loadFile(filename, &buffer, &fileSize) < 0) return false;
+/*
+* Name: createBlockPacket
+* Parameteres: const EncodedBlock* block, uint32_t index, char* packet, size_t maxPacketSize
+* Returns: size_t
+* Description: Builds block message number index: the header, then the next
+* maxPacketSize - BLOCK_HEADER_SIZE bytes of the encoded block. The CRC-32C
+* covers the whole message but its own field. Returns the message size, 0
+* if the fragments would be smaller than BLOCK_MIN_FRAGMENT.
+*/
+size_t createBlockPacket(const EncodedBlock* block, uint32_t index, char* packet, size_t maxPacketSize) {
+    size_t fragmentSize = maxPacketSize - BLOCK_HEADER_SIZE;
+    if (maxPacketSize < BLOCK_HEADER_SIZE + BLOCK_MIN_FRAGMENT || fragmentSize > 0xFFFF) {
+        return 0;
+    }
+    size_t start = (size_t)index * fragmentSize;
+    size_t size = block->size - start < fragmentSize ? block->size - start : fragmentSize;
 
-        uint32_t computedCRC = computeCRC32(buffer, fileSize);
-        free(buffer);
+    packet[0] = MESSAGE_BLOCK;
+    writeLittleEndian(packet + 1, block->offset, 8);
+    writeLittleEndian(packet + 13, (uint32_t)block->size | (block->compressed ? BLOCK_COMPRESSED_FLAG : 0), 4);
+    writeLittleEndian(packet + 17, index, 2);
+    writeLittleEndian(packet + 19, fragmentSize, 2);
+    memcpy(packet + BLOCK_HEADER_SIZE, block->data + start, size);
+    uint32_t crc = crc32cUpdate(0, packet, 9);
+    crc = crc32cUpdate(crc, packet + 13, BLOCK_HEADER_SIZE - 13 + size);
+    writeLittleEndian(packet + 9, crc, 4);
+    return BLOCK_HEADER_SIZE + size;
+}
+
+// Reads a block message without copying it. False if it is damaged or malformed
+bool extractBlockPacket(const char* packet, size_t bytesRead, BlockFragment* fragment) {
+    if (getMessageType(packet, bytesRead) != MESSAGE_BLOCK || bytesRead < BLOCK_HEADER_SIZE) {
+        return false;
+    }
+    uint32_t crc = crc32cUpdate(0, packet, 9);
+    crc = crc32cUpdate(crc, packet + 13, bytesRead - 13);
+    if (crc != (uint32_t)readLittleEndian(packet + 9, 4)) {
+        return false;
+    }
+    uint32_t encoded = (uint32_t)readLittleEndian(packet + 13, 4);
+    fragment->offset = readLittleEndian(packet + 1, 8);
+    fragment->encodedSize = encoded & ~BLOCK_COMPRESSED_FLAG;
+    fragment->compressed = (encoded & BLOCK_COMPRESSED_FLAG) != 0;
+    fragment->index = (uint16_t)readLittleEndian(packet + 17, 2);
+    fragment->fragmentSize = (uint16_t)readLittleEndian(packet + 19, 2);
+    fragment->data = packet + BLOCK_HEADER_SIZE;
+    fragment->size = bytesRead - BLOCK_HEADER_SIZE;
+    return true;
+}
+
+int blockAssemblerInit(BlockAssembler* assembler) {
+    memset(assembler, 0, sizeof(BlockAssembler));
+    assembler->slots = (AssemblySlot*)calloc(ASSEMBLY_SLOTS, sizeof(AssemblySlot));
+    if (!assembler->slots) {
+        return -1;
+    }
+    for (int i = 0; i < ASSEMBLY_SLOTS; i++) {
+        assembler->slots[i].data = (char*)malloc(COMPRESSION_BLOCK_SIZE);
+        if (!assembler->slots[i].data) {
+            blockAssemblerFree(assembler);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+* Name: blockAssemblerAdd
+* Parameteres: BlockAssembler* assembler, const BlockFragment* fragment, EncodedBlock* block
+* Returns: int
+* Description: Copies a fragment into the slot of its block. Returns 1 when
+* that completes the block (block then points into the slot until the next
+* call), 0 if more fragments are needed or it was a duplicate, and -1 for a
+* fragment that doesn't fit the block it claims. A block that can't get a
+* slot pushes out the one that has waited longest, its chunk is then simply
+* missing and asked for again after the trailer.
+*/
+int blockAssemblerAdd(BlockAssembler* assembler, const BlockFragment* fragment, EncodedBlock* block) {
+    if (fragment->encodedSize == 0 || fragment->encodedSize > COMPRESSION_BLOCK_SIZE || fragment->fragmentSize < BLOCK_MIN_FRAGMENT) {
+        return -1;
+    }
+    uint32_t fragmentCount = (fragment->encodedSize + fragment->fragmentSize - 1) / fragment->fragmentSize;
+    size_t start = (size_t)fragment->index * fragment->fragmentSize;
+    size_t expected = fragment->index + 1u == fragmentCount ? fragment->encodedSize - start : fragment->fragmentSize;
+    if (fragment->index >= fragmentCount || fragment->size != expected) {
+        return -1;
+    }
+
+    // Its block's slot, else a free one, else the stalest
+    AssemblySlot* slot = NULL;
+    AssemblySlot* oldest = NULL;
+    for (int i = 0; i < ASSEMBLY_SLOTS && !slot; i++) {
+        AssemblySlot* candidate = &assembler->slots[i];
+        if (candidate->inUse && candidate->offset == fragment->offset) {
+            slot = candidate;
+        }
+        else if (!oldest || (oldest->inUse && (!candidate->inUse || candidate->lastUsed < oldest->lastUsed))) {
+            oldest = candidate;
+        }
+    }
+    // A block sent again with another encoding starts over
+    if (slot && (slot->encodedSize != fragment->encodedSize || slot->fragmentSize != fragment->fragmentSize ||
+        slot->compressed != fragment->compressed)) {
+        slot->inUse = false;
+    }
+    if (!slot || !slot->inUse) {
+        slot = slot ? slot : oldest;
+        slot->offset = fragment->offset;
+        slot->encodedSize = fragment->encodedSize;
+        slot->fragmentSize = fragment->fragmentSize;
+        slot->fragmentCount = fragmentCount;
+        slot->receivedFragments = 0;
+        slot->compressed = fragment->compressed;
+        memset(slot->fragments, 0, sizeof(slot->fragments));
+        slot->inUse = true;
+    }
+    slot->lastUsed = ++assembler->clock;
 
-        return computedCRC == expectedCRC;
-    
+    uint64_t bit = 1ULL << (fragment->index & 63);
+    if (slot->fragments[fragment->index / 64] & bit) {
+        return 0;
+    }
+    slot->fragments[fragment->index / 64] |= bit;
+    memcpy(slot->data + start, fragment->data, fragment->size);
+    if (++slot->receivedFragments < slot->fragmentCount) {
+        return 0;
+    }
+    slot->inUse = false;
+    block->offset = slot->offset;
+    block->data = slot->data;
+    block->size = slot->encodedSize;
+    block->compressed = slot->compressed;
+    block->rawSize = 0;  // the receiver knows it from the block size and the file size
+    return 1;
+}
+
+void blockAssemblerFree(BlockAssembler* assembler) {
+    if (assembler->slots) {
+        for (int i = 0; i < ASSEMBLY_SLOTS; i++) {
+            free(assembler->slots[i].data);
+        }
+        free(assembler->slots);
+    }
+    memset(assembler, 0, sizeof(BlockAssembler));
+}
+
+
+/*
+* Name: chunkTrackerInit
+* Parameteres: ChunkTracker* tracker, uint64_t fileSize, uint32_t chunkSize
+* Returns: int
+* Description: Sets up an empty chunk bitmap for a file sent in chunkSize
+* pieces. Returns 0 on success, -1 if the memory can't be allocated.
+*/
+int chunkTrackerInit(ChunkTracker* tracker, uint64_t fileSize, uint32_t chunkSize)
+{
+    memset(tracker, 0, sizeof(ChunkTracker));
+    if (chunkSize == 0)
+    {
+        return -1;
+    }
+    tracker->fileSize = fileSize;
+    tracker->chunkSize = chunkSize;
+    tracker->chunkCount = (fileSize + chunkSize - 1) / chunkSize;
+    tracker->combineOp = crc32CombineGen(chunkSize);
+
+    size_t words = (size_t)((tracker->chunkCount + 63) / 64);
+    tracker->bitmap = (uint64_t*)calloc(words > 0 ? words : 1, sizeof(uint64_t));
+    tracker->pendingCRC = (uint32_t*)malloc(CHUNK_CRC_WINDOW * sizeof(uint32_t));
+    if (!tracker->bitmap || !tracker->pendingCRC)
+    {
+        chunkTrackerFree(tracker);
+        return -1;
+    }
+    return 0;
+}
+
+static bool chunkReceived(const ChunkTracker* tracker, uint64_t index)
+{
+    return (tracker->bitmap[index / 64] >> (index % 64)) & 1;
+}
+
+/*
+* Name: chunkTrackerAdd
+* Parameteres: ChunkTracker* tracker, uint64_t offset, const char* data, size_t size
+* Returns: int
+* Description: Marks the chunk at this offset as received and takes it into
+* the CRC. Returns 1 for a new chunk, 0 for one already received, and -1 if
+* the offset or size doesn't match a chunk of the file.
+*/
+int chunkTrackerAdd(ChunkTracker* tracker, uint64_t offset, const char* data, size_t size)
+{
+    if (offset % tracker->chunkSize != 0 || offset >= tracker->fileSize)
+    {
+        return -1;
+    }
+    uint64_t index = offset / tracker->chunkSize;
+    uint64_t remaining = tracker->fileSize - offset;
+    if (size != (remaining < tracker->chunkSize ? remaining : tracker->chunkSize))
+    {
+        return -1;
+    }
+    if (chunkReceived(tracker, index))
+    {
+        return 0;
+    }
+    tracker->bitmap[index / 64] |= (uint64_t)1 << (index % 64);
+    tracker->receivedChunks++;
+
+    if (tracker->crcOverflow)
+    {
+        return 1;
+    }
+    if (index - tracker->crcChunks >= CHUNK_CRC_WINDOW)
+    {
+        tracker->crcOverflow = true;  // too far ahead to keep its CRC around
+        return 1;
+    }
+    tracker->pendingCRC[index % CHUNK_CRC_WINDOW] = crc32Update(0, data, size);
+
+    // fold in every chunk that now follows on from the start of the file
+    while (tracker->crcChunks < tracker->chunkCount && chunkReceived(tracker, tracker->crcChunks))
+    {
+        uint64_t chunkOffset = tracker->crcChunks * tracker->chunkSize;
+        uint64_t chunkRemaining = tracker->fileSize - chunkOffset;
+        uint32_t chunkCRC = tracker->pendingCRC[tracker->crcChunks % CHUNK_CRC_WINDOW];
+        if (chunkRemaining >= tracker->chunkSize)
+        {
+            tracker->crc = crc32CombineOp(tracker->crc, chunkCRC, tracker->combineOp);
+        }
+        else
+        {
+            tracker->crc = crc32Combine(tracker->crc, chunkCRC, chunkRemaining);
+        }
+        tracker->crcChunks++;
+    }
+    return 1;
+}
+
+bool chunkTrackerComplete(const ChunkTracker* tracker)
+{
+    return tracker->receivedChunks == tracker->chunkCount;
+}
+
+/*
+* Name: chunkTrackerFindGap
+* Parameteres: const ChunkTracker* tracker, uint64_t from, uint64_t* offset, uint64_t* length
+* Returns: bool
+* Description: Finds the first run of missing chunks at or after byte offset
+* "from" and gives it as a byte range. Returns false if nothing is missing.
+*/
+bool chunkTrackerFindGap(const ChunkTracker* tracker, uint64_t from, uint64_t* offset, uint64_t* length)
+{
+    uint64_t index = (from + tracker->chunkSize - 1) / tracker->chunkSize;
+    while (index < tracker->chunkCount && chunkReceived(tracker, index))
+    {
+        index++;
+    }
+    if (index >= tracker->chunkCount)
+    {
+        return false;
+    }
+    uint64_t end = index;
+    while (end < tracker->chunkCount && !chunkReceived(tracker, end))
+    {
+        end++;
+    }
+    *offset = index * tracker->chunkSize;
+    uint64_t endOffset = end * tracker->chunkSize;
+    *length = (endOffset < tracker->fileSize ? endOffset : tracker->fileSize) - *offset;
+    return true;
+}
+
+/*
+* Name: chunkTrackerCRC
+* Parameteres: const ChunkTracker* tracker, uint32_t* crc
+* Returns: bool
+* Description: Gives the CRC of the whole file once every chunk is in.
+* Returns false if it couldn't be built on the fly. The file is not read
+* back then: every chunk was checked against the manifest as it arrived,
+* which is the integrity check, the CRC is only a cross-check on top.
+*/
+bool chunkTrackerCRC(const ChunkTracker* tracker, uint32_t* crc)
+{
+    if (tracker->crcOverflow || tracker->crcChunks != tracker->chunkCount)
+    {
+        return false;
+    }
+    *crc = tracker->crc;
+    return true;
+}
+
+/*
+* Name: journalSave
+* Parameteres: const char* filename, const FileMetadata* metadata, const ChunkTracker* tracker
+* Returns: int
+* Description: Writes the header and chunk bitmap to a temporary file and
+* renames it over the journal, so a crash leaves either the old journal or
+* the new one. The chunks it lists must already be synced to disk.
+*/
+int journalSave(const char* filename, const FileMetadata* metadata, const ChunkTracker* tracker)
+{
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.fileSize = metadata->fileSize;
+    header.modifiedTime = metadata->modifiedTime;
+    header.crc = metadata->crc;
+    header.chunkSize = tracker->chunkSize;
+    header.chunkCount = tracker->chunkCount;
+
+    char tempName[512];
+    snprintf(tempName, sizeof(tempName), "%s.tmp", filename);
+    FILE* file = fopen(tempName, "wb");
+    if (!file)
+    {
+        return -1;
+    }
+    size_t words = (size_t)((tracker->chunkCount + 63) / 64);
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        (words == 0 || fwrite(tracker->bitmap, sizeof(uint64_t), words, file) == words) &&
+        fflush(file) == 0;
+#ifdef _WIN32
+    written = written && _commit(_fileno(file)) == 0;
+#else
+    written = written && fsync(fileno(file)) == 0;
+#endif
+    if (fclose(file) != 0 || !written || replaceFile(tempName, filename) != 0)
+    {
+        remove(tempName);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* Name: journalLoad
+* Parameteres: const char* filename, const FileMetadata* metadata, ChunkTracker* tracker
+* Returns: int
+* Description: Marks the chunks a journal lists in a freshly initialized
+* tracker. Returns -1 if there is no journal or it belongs to another
+* version of the file (size, modification time or CRC differ), leaving the
+* tracker as it was. The journal may use another chunk size: a chunk then
+* counts only if the old chunks cover all of it. Resumed chunks were never
+* seen by this tracker, so it can't build the whole-file CRC on the fly.
+*/
+int journalLoad(const char* filename, const FileMetadata* metadata, ChunkTracker* tracker)
+{
+    FILE* file = fopen(filename, "rb");
+    if (!file)
+    {
+        return -1;
+    }
+    JournalHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+        header.fileSize != metadata->fileSize || header.modifiedTime != metadata->modifiedTime || header.crc != metadata->crc ||
+        header.chunkSize == 0 || header.chunkCount != (header.fileSize + header.chunkSize - 1) / header.chunkSize)
+    {
+        fclose(file);
+        return -1;
+    }
+    size_t words = (size_t)((header.chunkCount + 63) / 64);
+    uint64_t* saved = (uint64_t*)malloc(words > 0 ? words * sizeof(uint64_t) : 1);
+    if (!saved || (words > 0 && fread(saved, sizeof(uint64_t), words, file) != words))
+    {
+        free(saved);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    ChunkTracker old;
+    memset(&old, 0, sizeof(old));
+    old.chunkSize = header.chunkSize;
+    old.chunkCount = header.chunkCount;
+    old.bitmap = saved;
+
+    tracker->receivedChunks = 0;
+    for (uint64_t index = 0; index < tracker->chunkCount; index++)
+    {
+        uint64_t start = index * tracker->chunkSize;
+        uint64_t end = start + tracker->chunkSize < tracker->fileSize ? start + tracker->chunkSize : tracker->fileSize;
+        bool covered = true;
+        for (uint64_t oldIndex = start / old.chunkSize; covered && oldIndex <= (end - 1) / old.chunkSize; oldIndex++)
+        {
+            covered = chunkReceived(&old, oldIndex);
+        }
+        if (covered)
+        {
+            tracker->bitmap[index / 64] |= (uint64_t)1 << (index % 64);
+            tracker->receivedChunks++;
+        }
+    }
+    free(saved);
+    tracker->crcOverflow = tracker->receivedChunks > 0;
+    return 0;
+}
+
+void chunkTrackerFree(ChunkTracker* tracker)
+{
+    free(tracker->bitmap);
+    free(tracker->pendingCRC);
+    tracker->bitmap = NULL;
+    tracker->pendingCRC = NULL;
 }
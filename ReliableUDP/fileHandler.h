@@ -5,33 +5,227 @@
  * FIRST VERSION: 15/02/2025
  * DESCRIPTION:
  * This header file declares functions for file handling operations, including
- * loading, saving, metadata management, and integrity verification.
+ * loading, saving, memory-mapping, streaming writes (through io_uring where
+ * the kernel offers it), the transfer messages (metadata, manifest, data,
+ * compressed blocks, resend requests, resume offsets, delta signatures and
+ * copies), block reassembly, the resume journal, and integrity verification.
  */
 #ifndef FILE_HANDLER_H
 #define FILE_HANDLER_H
 #pragma once
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include "merkle.h"
+#include "compress.h"
+#include "delta.h"
 
 #define PACKET_SIZE 1024
 #define CHECKSUM_SIZE 4  // CRC32 checksum size
+#define FILE_BLOCK_SIZE (1024 * 1024)  // block size for streaming file reads
+#define MAP_READAHEAD_WINDOW (8 * 1024 * 1024)  // prefetch distance ahead of the sender
+#define SINK_BATCH_SIZE (1024 * 1024)  // received bytes buffered before each write
+#define METADATA_VERSION 1  // bumped when the layout changes in a way older readers can't skip
+#define METADATA_MAX_NAME 255  // longest file name the metadata carries
+// type, version, flags + varint fileSize + crc + varint chunkSize + rootHash + varint modifiedTime
+// + hash algorithm, compression + varint name length + name: 299 bytes with every field at its longest
+#define METADATA_MAX_SIZE (3 + 10 + 4 + 5 + 8 + 10 + 2 + 2 + METADATA_MAX_NAME)  // fits one datagram
+#define METADATA_FLAG_LAST 0x01  // the trailer: sent after the data, carries the final CRC
+#define METADATA_FLAG_DELTA 0x02  // the sender takes a signature of the receiver's old copy and answers with copies
+#define MANIFEST_HEADER_SIZE 9  // type + index of the first leaf
+#define MANIFEST_MAX_LEAVES 1024  // most leaves in one manifest packet
+#define DATA_HEADER_SIZE 13  // type + file offset + CRC-32C, in front of every data chunk
+#define RESEND_REQUEST_SIZE 17  // type + file offset + length
+#define RESUME_PACKET_SIZE 9  // type + file offset
+#define BLOCK_HEADER_SIZE 21  // type + block offset + CRC-32C + encoded size + fragment index + fragment size
+#define BLOCK_COMPRESSED_FLAG 0x80000000u  // top bit of the encoded size
+#define BLOCK_MIN_FRAGMENT 64  // smallest fragment, so a block is never cut into more than BLOCK_MAX_FRAGMENTS
+#define BLOCK_MAX_FRAGMENTS (COMPRESSION_BLOCK_SIZE / BLOCK_MIN_FRAGMENT)
+#define SIGNATURE_HEADER_SIZE 21  // type + basis size + block size + index of the first block
+#define SIGNATURE_ENTRY_SIZE 12  // weak checksum + strong hash
+#define SIGNATURE_MAX_BLOCKS 1024  // most blocks in one signature packet
+#define COPY_PACKET_SIZE 25  // type + file offset + basis offset + length
+#define MIN_PAYLOAD_SIZE (SIGNATURE_HEADER_SIZE + SIGNATURE_ENTRY_SIZE)  // smallest payload every batched message fits in with one entry
+#define ASSEMBLY_SLOTS 64  // blocks that may be partly received at the same time
+#define JOURNAL_MAGIC "RUDPJRN1"
+#define CHUNK_CRC_WINDOW 1024  // chunks that may arrive ahead of the first missing one and still be checksummed on the fly
 
+// First byte of every transfer message. Multi-byte fields are little endian
+typedef enum {
+    MESSAGE_METADATA = 1,   // encoded FileMetadata (the trailer too, with isLastPacket set)
+    MESSAGE_MANIFEST = 2,   // run of chunk hashes
+    MESSAGE_DATA = 3,       // file chunk at an offset
+    MESSAGE_RESEND = 4,     // receiver asks for a byte range again
+    MESSAGE_RESUME = 5,     // receiver's answer to the metadata: where the sender should start
+    MESSAGE_BLOCK = 6,      // piece of an encoded block (compressed transfers)
+    MESSAGE_SIGNATURE = 7,  // receiver's run of block signatures of its old copy (delta transfers)
+    MESSAGE_COPY = 8        // chunks the receiver takes from its old copy instead
+} MessageType;
+
+// How the manifest leaves are hashed
+typedef enum {
+    HASH_XXH64 = 1
+} HashAlgorithm;
+
+// How data chunks are encoded before they are sent
+typedef enum {
+    COMPRESSION_NONE = 0,   // one file chunk per data message
+    COMPRESSION_LZ = 1      // COMPRESSION_BLOCK_SIZE chunks, each compressed (or stored) and cut into block messages
+} CompressionType;
+
+// What the sender says about the file. On the wire it is one metadata message:
+//   type, version, flags, varint fileSize, crc (4), varint chunkSize,
+//   rootHash (8), varint modifiedTime, hash algorithm, compression,
+//   varint name length, name
+// Fixed-size fields are little endian, varints are LEB128. Fields added in a
+// later revision of the same version go at the end, older readers skip them.
 typedef struct {
-    char filename[256];  // Adjust size as needed
-    size_t fileSize;
+    uint8_t version;
+    uint64_t fileSize;
     uint32_t crc;
+    uint32_t chunkSize;  // file bytes per data packet (after the data header), picked by the sender from the path MTU
+    uint64_t rootHash;   // Merkle root of the chunk manifest
+    uint64_t modifiedTime;  // sender's file modification time (seconds since 1970), for resuming
+    uint8_t hashAlgorithm;  // HashAlgorithm of the manifest
+    uint8_t compression;    // CompressionType of the data chunks
+    const char* filename;   // not terminated; once decoded it points into the packet it came from
+    size_t filenameLength;
+    bool deltaOffered;      // METADATA_FLAG_DELTA
     bool isLastPacket;
 } FileMetadata;
 
+// Read-only view of a whole file mapped into memory
+typedef struct {
+    const char* data;     // NULL for an empty file
+    size_t size;
+    size_t advisedOffset;   // readahead requested up to here
+    size_t releasedOffset;  // pages before here have been handed back
+#ifdef _WIN32
+    void* fileHandle;
+    void* mappingHandle;
+#else
+    int fd;
+#endif
+} MappedFile;
+
+// Output file written chunk by chunk at explicit offsets
+typedef struct {
+    uint64_t fileSize;
+    char* batch;            // contiguous bytes waiting to be written
+    uint64_t batchOffset;   // file offset of batch[0]
+    size_t batchUsed;
+#ifdef _WIN32
+    void* fileHandle;
+#else
+    int fd;
+    struct SinkRing* ring;  // io_uring writing the last batch while the next one fills, NULL for plain writes
+#endif
+} FileSink;
+
+// Which chunks of the output file have arrived, in any order, one bit each.
+// The CRC is built as the run of chunks from the start of the file grows: a
+// chunk that lands early keeps its own CRC until the gap before it fills.
+typedef struct {
+    uint64_t fileSize;
+    uint32_t chunkSize;
+    uint64_t chunkCount;
+    uint64_t receivedChunks;
+    uint64_t* bitmap;       // bit set once the chunk is placed
+    uint64_t crcChunks;     // chunks folded into crc, all from the start of the file
+    uint32_t crc;           // CRC of the first crcChunks chunks
+    uint32_t combineOp;     // crc32CombineGen(chunkSize)
+    uint32_t* pendingCRC;   // CRCs of early chunks, CHUNK_CRC_WINDOW ring by chunk index
+    bool crcOverflow;       // a chunk came too far ahead (or was resumed), no CRC: the manifest alone vouches for the file
+} ChunkTracker;
+
+// One block message as received. data points into the packet
+typedef struct {
+    uint64_t offset;        // file offset of the block
+    uint32_t encodedSize;   // size of the whole encoded block
+    bool compressed;
+    uint16_t index;         // fragment number within the block
+    uint16_t fragmentSize;  // bytes in every fragment but the last
+    const char* data;
+    size_t size;
+} BlockFragment;
+
+// Receiver: blocks whose fragments are still coming in
+typedef struct {
+    uint64_t offset;
+    uint32_t encodedSize;
+    uint16_t fragmentSize;
+    uint32_t fragmentCount;
+    uint32_t receivedFragments;
+    uint64_t fragments[BLOCK_MAX_FRAGMENTS / 64];  // bit set once the fragment is in
+    uint64_t lastUsed;      // for evicting the stalest block when every slot is taken
+    bool compressed;
+    bool inUse;
+    char* data;             // COMPRESSION_BLOCK_SIZE bytes
+} AssemblySlot;
+
+typedef struct {
+    AssemblySlot* slots;    // ASSEMBLY_SLOTS
+    uint64_t clock;
+} BlockAssembler;
+
+// Start of a resume journal, followed by the chunk bitmap. It describes the
+// partial file next to it: which chunks are on disk, and which file they
+// belong to (size, modification time and CRC must all match to resume).
+typedef struct {
+    char magic[8];          // JOURNAL_MAGIC
+    uint64_t fileSize;
+    uint64_t modifiedTime;
+    uint32_t crc;
+    uint32_t chunkSize;     // chunk size of the bitmap, may differ from the next attempt's
+    uint64_t chunkCount;
+} JournalHeader;
+
 void init_crc32_table(void);
 uint32_t computeCRC32(const char* data, size_t size);
 int loadFile(const char* filename, char** buffer, size_t* size);
+int loadFileWithCRC(const char* filename, char** buffer, size_t* size, uint32_t* crc);
+int mapFile(const char* filename, MappedFile* file);
+void mappedFileAdvance(MappedFile* file, size_t offset);
+void unmapFile(MappedFile* file);
+int getFileModifiedTime(const char* filename, uint64_t* modifiedTime);
+int replaceFile(const char* from, const char* to);
+int openFileSink(const char* filename, uint64_t fileSize, FileSink* sink, bool keepContents);
+int fileSinkWrite(FileSink* sink, uint64_t offset, const char* data, size_t size);
+char* fileSinkReserve(FileSink* sink, uint64_t offset, size_t size);
+int fileSinkCommit(FileSink* sink, size_t size);
+int fileSinkFlush(FileSink* sink);
+int fileSinkSync(FileSink* sink);
+int closeFileSink(FileSink* sink);
 int saveFile(const char* filename, const char* buffer, size_t size);
 double calculateTransferSpeed(double startTime, double endTime, size_t fileSize);
-void createMetadataPacket(const char* filename, size_t fileSize, uint32_t crc, bool isLast, char* packet, size_t* packetSize, size_t offset);
-bool extractMetadataPacket(const char* packet, size_t bytesRead, FileMetadata* metadata, char* metadataBuffer, size_t* receivedMetaOffset);
+int getMessageType(const char* packet, size_t bytesRead);
+size_t createMetadataPacket(const FileMetadata* metadata, char* packet, size_t maxPacketSize);
+bool extractMetadataPacket(const char* packet, size_t bytesRead, FileMetadata* metadata);
+uint64_t createManifestPacket(const Manifest* manifest, uint64_t firstLeaf, char* packet, size_t maxPacketSize, size_t* packetSize);
+bool extractManifestPacket(const char* packet, size_t bytesRead, Manifest* manifest);
 size_t createDataPacket(const char* fileBuffer, size_t fileSize, size_t currentOffset, char* tempBuffer, size_t maxPacketSize, bool isLastPacket);
-
-bool VerifyFile(const char* filename, uint32_t expectedCRC);
+bool extractDataPacket(const char* packet, size_t bytesRead, uint64_t* offset, const char** data, size_t* dataSize);
+size_t createResendRequest(uint64_t offset, uint64_t length, char* packet);
+bool extractResendRequest(const char* packet, size_t bytesRead, uint64_t* offset, uint64_t* length);
+size_t createResumePacket(uint64_t offset, char* packet);
+bool extractResumePacket(const char* packet, size_t bytesRead, uint64_t* offset);
+uint64_t createSignaturePacket(const Signature* signature, uint64_t firstBlock, char* packet, size_t maxPacketSize, size_t* packetSize);
+bool extractSignaturePacket(const char* packet, size_t bytesRead, Signature* signature);
+size_t createCopyPacket(const DeltaCopy* copy, char* packet);
+bool extractCopyPacket(const char* packet, size_t bytesRead, DeltaCopy* copy);
+uint32_t blockFragmentCount(const EncodedBlock* block, size_t maxPacketSize);
+size_t createBlockPacket(const EncodedBlock* block, uint32_t index, char* packet, size_t maxPacketSize);
+bool extractBlockPacket(const char* packet, size_t bytesRead, BlockFragment* fragment);
+int blockAssemblerInit(BlockAssembler* assembler);
+int blockAssemblerAdd(BlockAssembler* assembler, const BlockFragment* fragment, EncodedBlock* block);
+void blockAssemblerFree(BlockAssembler* assembler);
+int chunkTrackerInit(ChunkTracker* tracker, uint64_t fileSize, uint32_t chunkSize);
+int chunkTrackerAdd(ChunkTracker* tracker, uint64_t offset, const char* data, size_t size);
+bool chunkTrackerComplete(const ChunkTracker* tracker);
+bool chunkTrackerFindGap(const ChunkTracker* tracker, uint64_t from, uint64_t* offset, uint64_t* length);
+bool chunkTrackerCRC(const ChunkTracker* tracker, uint32_t* crc);
+void chunkTrackerFree(ChunkTracker* tracker);
+int journalSave(const char* filename, const FileMetadata* metadata, const ChunkTracker* tracker);
+int journalLoad(const char* filename, const FileMetadata* metadata, ChunkTracker* tracker);
 
 #endif
@@ -0,0 +1,214 @@
+/*
+ * FILE: merkle.cpp
+ * PROJECT: Reliable UDP File Transfer
+ * PROGRAMMER: Manreet & Bhawanjeet
+ * FIRST VERSION: 17/10/2026
+ * DESCRIPTION:
+ * This source file implements the chunk manifest. Chunks are hashed with
+ * XXH64 (https://github.com/Cyan4973/xxHash), which runs at memory speed, so
+ * hashing the whole file before sending costs about as much as reading it.
+ */
+#include "merkle.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t Prime3 = 0x165667B19E3779F9ULL;
+static const uint64_t Prime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t Prime5 = 0x27D4EB2F165667C5ULL;
+
+static uint64_t rotateLeft(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// XXH64 reads little-endian words
+static uint64_t read64(const uint8_t* p) {
+    uint64_t value;
+    memcpy(&value, p, 8);
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+static uint64_t hashRound(uint64_t acc, uint64_t input) {
+    acc += input * Prime2;
+    acc = rotateLeft(acc, 31);
+    return acc * Prime1;
+}
+
+static uint64_t hashMerge(uint64_t acc, uint64_t value) {
+    acc ^= hashRound(0, value);
+    return acc * Prime1 + Prime4;
+}
+
+uint64_t hash64(const void* data, size_t size, uint64_t seed) {
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        uint64_t v1 = seed + Prime1 + Prime2;
+        uint64_t v2 = seed + Prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - Prime1;
+        const uint8_t* limit = end - 32;
+        do {
+            v1 = hashRound(v1, read64(p));
+            v2 = hashRound(v2, read64(p + 8));
+            v3 = hashRound(v3, read64(p + 16));
+            v4 = hashRound(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+        h = hashMerge(h, v1);
+        h = hashMerge(h, v2);
+        h = hashMerge(h, v3);
+        h = hashMerge(h, v4);
+    }
+    else {
+        h = seed + Prime5;
+    }
+    h += (uint64_t)size;
+
+    while (p + 8 <= end) {
+        h ^= hashRound(0, read64(p));
+        h = rotateLeft(h, 27) * Prime1 + Prime4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * Prime1;
+        h = rotateLeft(h, 23) * Prime2 + Prime3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p++) * Prime5;
+        h = rotateLeft(h, 11) * Prime1;
+    }
+
+    h ^= h >> 33;
+    h *= Prime2;
+    h ^= h >> 29;
+    h *= Prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t merkleParent(uint64_t left, uint64_t right) {
+    uint8_t pair[16];
+    for (int i = 0; i < 8; i++) {
+        pair[i] = (uint8_t)(left >> (i * 8));
+        pair[8 + i] = (uint8_t)(right >> (i * 8));
+    }
+    return hash64(pair, sizeof(pair), 0);
+}
+
+/*
+* Name: merkleRoot
+* Parameteres: const uint64_t* leaves, uint64_t count
+* Returns: uint64_t
+* Description: Folds the leaves level by level into a single root. No leaves
+* (an empty file) gives the hash of nothing.
+*/
+uint64_t merkleRoot(const uint64_t* leaves, uint64_t count) {
+    if (count == 0) {
+        return hash64(NULL, 0, 0);
+    }
+    uint64_t* level = (uint64_t*)malloc((size_t)count * sizeof(uint64_t));
+    if (!level) {
+        return 0;
+    }
+    memcpy(level, leaves, (size_t)count * sizeof(uint64_t));
+    while (count > 1) {
+        uint64_t parents = 0;
+        for (uint64_t i = 0; i + 1 < count; i += 2) {
+            level[parents++] = merkleParent(level[i], level[i + 1]);
+        }
+        if (count & 1) {
+            level[parents++] = level[count - 1];
+        }
+        count = parents;
+    }
+    uint64_t root = level[0];
+    free(level);
+    return root;
+}
+
+/*
+* Name: manifestBuild
+* Parameteres: Manifest* manifest, const char* data, uint64_t fileSize, uint32_t chunkSize
+* Returns: int
+* Description: Sender side: hashes every chunk of the file. Returns 0 on
+* success, -1 if the memory can't be allocated.
+*/
+int manifestBuild(Manifest* manifest, const char* data, uint64_t fileSize, uint32_t chunkSize) {
+    if (manifestInit(manifest, fileSize, chunkSize) != 0) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < manifest->chunkCount; i++) {
+        uint64_t offset = i * chunkSize;
+        uint64_t remaining = fileSize - offset;
+        manifest->leaves[i] = hash64(data + offset, (size_t)(remaining < chunkSize ? remaining : chunkSize), 0);
+    }
+    manifest->receivedLeaves = manifest->chunkCount;
+    return 0;
+}
+
+// Receiver side: room for every leaf, none filled in yet
+int manifestInit(Manifest* manifest, uint64_t fileSize, uint32_t chunkSize) {
+    memset(manifest, 0, sizeof(Manifest));
+    if (chunkSize == 0) {
+        return -1;
+    }
+    manifest->chunkSize = chunkSize;
+    manifest->chunkCount = (fileSize + chunkSize - 1) / chunkSize;
+    manifest->leaves = (uint64_t*)malloc(manifest->chunkCount > 0 ? (size_t)manifest->chunkCount * sizeof(uint64_t) : 1);
+    return manifest->leaves ? 0 : -1;
+}
+
+// Leaves come in order; a run that doesn't continue the ones received so far is refused
+bool manifestAddLeaves(Manifest* manifest, uint64_t firstLeaf, const uint64_t* leaves, uint64_t count) {
+    if (firstLeaf != manifest->receivedLeaves || count > manifest->chunkCount - firstLeaf) {
+        return false;
+    }
+    memcpy(manifest->leaves + firstLeaf, leaves, (size_t)count * sizeof(uint64_t));
+    manifest->receivedLeaves += count;
+    return true;
+}
+
+bool manifestComplete(const Manifest* manifest) {
+    return manifest->receivedLeaves == manifest->chunkCount;
+}
+
+uint64_t manifestRoot(const Manifest* manifest) {
+    return merkleRoot(manifest->leaves, manifest->chunkCount);
+}
+
+// True if the chunk at this offset hashes to its leaf
+bool manifestCheckChunk(const Manifest* manifest, uint64_t offset, const char* data, size_t size) {
+    if (offset % manifest->chunkSize != 0) {
+        return false;
+    }
+    uint64_t index = offset / manifest->chunkSize;
+    if (index >= manifest->receivedLeaves) {
+        return false;
+    }
+    return hash64(data, size, 0) == manifest->leaves[index];
+}
+
+void manifestFree(Manifest* manifest) {
+    free(manifest->leaves);
+    manifest->leaves = NULL;
+    manifest->chunkCount = 0;
+    manifest->receivedLeaves = 0;
+}
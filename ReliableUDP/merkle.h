@@ -0,0 +1,42 @@
+/*
+ * FILE: merkle.h
+ * PROJECT: Reliable UDP File Transfer
+ * PROGRAMMER: Manreet & Bhawanjeet
+ * FIRST VERSION: 17/10/2026
+ * DESCRIPTION:
+ * This header file declares the chunk manifest: a 64-bit hash of every chunk
+ * of a file (the leaves) and the Merkle root built over them. The sender
+ * announces the root in the metadata and sends the leaves before the data,
+ * so the receiver can check each chunk on its own as it arrives and only
+ * has to ask again for the chunks that failed.
+ */
+#ifndef MERKLE_H
+#define MERKLE_H
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    uint64_t chunkCount;
+    uint32_t chunkSize;
+    uint64_t* leaves;           // hash64 of every chunk, in file order
+    uint64_t receivedLeaves;    // receiver: leaves filled in so far (they arrive in order)
+} Manifest;
+
+// 64-bit non-cryptographic hash (XXH64). Same result on every platform.
+uint64_t hash64(const void* data, size_t size, uint64_t seed);
+
+// Root of the binary tree over the leaves: a parent is hash64 of its two
+// children, an odd node at the end of a level moves up unchanged.
+uint64_t merkleRoot(const uint64_t* leaves, uint64_t count);
+
+int manifestBuild(Manifest* manifest, const char* data, uint64_t fileSize, uint32_t chunkSize);
+int manifestInit(Manifest* manifest, uint64_t fileSize, uint32_t chunkSize);
+bool manifestAddLeaves(Manifest* manifest, uint64_t firstLeaf, const uint64_t* leaves, uint64_t count);
+bool manifestComplete(const Manifest* manifest);
+uint64_t manifestRoot(const Manifest* manifest);
+bool manifestCheckChunk(const Manifest* manifest, uint64_t offset, const char* data, size_t size);
+void manifestFree(Manifest* manifest);
+
+#endif
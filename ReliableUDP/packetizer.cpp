@@ -0,0 +1,229 @@
+/*
+ * FILE: packetizer.cpp
+ * PROJECT: Reliable UDP File Transfer
+ * PROGRAMMER: Manreet & Bhawanjeet
+ * FIRST VERSION: 17/10/2026
+ * DESCRIPTION:
+ * This source file implements the staged sender. Reader and packetizer each
+ * run on their own thread; the rings between the stages hold no lock, each
+ * side only moves its own index and reads the other's. The packets ring
+ * carries the send loop's buffers both ways: it lends empty ones ahead of the
+ * packetizer and takes them back filled.
+ */
+#include "packetizer.h"
+#include "fileHandler.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#define PAGE_SIZE_HINT 4096  // the reader touches one byte per page
+
+// Indices of a ring with one producer and one consumer. They only grow, a slot is index % capacity
+struct SpscRing {
+    uint64_t capacity;
+    std::atomic<uint64_t> head;  // next slot the consumer reads
+    char padding[64];            // keeps the two indices on separate cache lines
+    std::atomic<uint64_t> tail;  // next slot the producer writes
+};
+
+static void ringInit(SpscRing* ring, uint64_t capacity) {
+    ring->capacity = capacity;
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+}
+
+// Producer side: slots it may fill
+static uint64_t ringSpace(const SpscRing* ring) {
+    return ring->capacity - (ring->tail.load(std::memory_order_relaxed) - ring->head.load(std::memory_order_acquire));
+}
+
+// Producer side: publishes the slots filled, the consumer sees their contents
+static void ringPush(SpscRing* ring, uint64_t count) {
+    ring->tail.store(ring->tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+}
+
+// Consumer side: slots ready to read
+static uint64_t ringReady(const SpscRing* ring) {
+    return ring->tail.load(std::memory_order_acquire) - ring->head.load(std::memory_order_relaxed);
+}
+
+// Consumer side: hands the slots read back to the producer
+static void ringPop(SpscRing* ring, uint64_t count) {
+    ring->head.store(ring->head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+}
+
+// A stage with nothing to do spins briefly (the other side is usually just behind), then sleeps
+static void backoff(int* spins) {
+    if (++*spins < 64) {
+        std::this_thread::yield();
+    }
+    else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+struct PacketPipeline {
+    const char* fileData;
+    uint64_t fileSize;
+    uint64_t startOffset;
+    size_t packetSize;
+    uint64_t packetCount;
+    uint64_t taken;                    // packets the send loop released
+    SpscRing blocks;                   // reader -> packetizer: end offset of each block now in memory
+    uint64_t blockEnds[PACKETIZER_READ_AHEAD];
+    SpscRing packets;                  // packetizer -> send loop
+    std::atomic<uint64_t> supplied;    // send loop -> packetizer: slots up to here have a buffer to fill
+    char* buffers[PACKETIZER_PACKETS]; // the send loop's, at least packetSize bytes each
+    size_t sizes[PACKETIZER_PACKETS];
+    char touched;                      // what the reader read, so its loop isn't optimized away
+    std::atomic<bool> stopping;
+    std::thread reader;
+    std::thread packetizer;
+};
+
+// Touches every page of a block so the packetizer never waits on the disk, then passes the block on
+static void readerStage(PacketPipeline* pipeline) {
+    uint64_t offset = pipeline->startOffset;
+    int spins = 0;
+    while (offset < pipeline->fileSize && !pipeline->stopping.load(std::memory_order_relaxed)) {
+        if (ringSpace(&pipeline->blocks) == 0) {
+            backoff(&spins);
+            continue;
+        }
+        spins = 0;
+        uint64_t end = offset + PACKETIZER_READ_BLOCK < pipeline->fileSize ? offset + PACKETIZER_READ_BLOCK : pipeline->fileSize;
+        char sum = 0;
+        for (uint64_t page = offset; page < end; page += PAGE_SIZE_HINT) {
+            sum += pipeline->fileData[page];
+        }
+        pipeline->touched += sum;
+        pipeline->blockEnds[pipeline->blocks.tail.load(std::memory_order_relaxed) % PACKETIZER_READ_AHEAD] = end;
+        ringPush(&pipeline->blocks, 1);
+        offset = end;
+    }
+}
+
+// Packs each chunk once the reader has its block in memory, while there is room for the packet
+static void packetizerStage(PacketPipeline* pipeline) {
+    const uint64_t chunkSize = pipeline->packetSize - DATA_HEADER_SIZE;
+    uint64_t offset = pipeline->startOffset;
+    uint64_t resident = pipeline->startOffset;  // the file is in memory up to here
+    int spins = 0;
+    while (offset < pipeline->fileSize && !pipeline->stopping.load(std::memory_order_relaxed)) {
+        uint64_t end = offset + chunkSize < pipeline->fileSize ? offset + chunkSize : pipeline->fileSize;
+        if (end > resident) {
+            // One block at a time, so the reader stays only PACKETIZER_READ_AHEAD blocks ahead
+            if (ringReady(&pipeline->blocks) == 0) {
+                backoff(&spins);
+                continue;
+            }
+            resident = pipeline->blockEnds[pipeline->blocks.head.load(std::memory_order_relaxed) % PACKETIZER_READ_AHEAD];
+            ringPop(&pipeline->blocks, 1);
+            continue;
+        }
+        // Only into a buffer the send loop lent, never one it may still be reading
+        uint64_t tail = pipeline->packets.tail.load(std::memory_order_relaxed);
+        if (tail == pipeline->supplied.load(std::memory_order_acquire)) {
+            backoff(&spins);
+            continue;
+        }
+        spins = 0;
+        uint64_t slot = tail % PACKETIZER_PACKETS;
+        pipeline->sizes[slot] = createDataPacket(pipeline->fileData, (size_t)pipeline->fileSize, (size_t)offset,
+            pipeline->buffers[slot], pipeline->packetSize, end >= pipeline->fileSize);
+        ringPush(&pipeline->packets, 1);
+        offset = end;
+    }
+}
+
+/*
+* Name: packetizerCreate
+* Parameteres: const char* fileData, uint64_t fileSize, uint64_t startOffset, size_t packetSize
+* Returns: PacketPipeline*
+* Description: Starts the reader and packetizer threads on the chunks from
+* startOffset to the end of the file, packetSize bytes per packet (header
+* included). Nothing is packed until packetizerSupply lends the buffers.
+* Returns NULL if the packets can't hold any file data.
+*/
+PacketPipeline* packetizerCreate(const char* fileData, uint64_t fileSize, uint64_t startOffset, size_t packetSize) {
+    if (packetSize <= DATA_HEADER_SIZE || startOffset > fileSize) {
+        return NULL;
+    }
+    uint64_t chunkSize = packetSize - DATA_HEADER_SIZE;
+
+    PacketPipeline* pipeline = new PacketPipeline();
+    pipeline->fileData = fileData;
+    pipeline->fileSize = fileSize;
+    pipeline->startOffset = startOffset;
+    pipeline->packetSize = packetSize;
+    pipeline->packetCount = (fileSize - startOffset + chunkSize - 1) / chunkSize;
+    pipeline->taken = 0;
+    ringInit(&pipeline->blocks, PACKETIZER_READ_AHEAD);
+    ringInit(&pipeline->packets, PACKETIZER_PACKETS);
+    pipeline->supplied.store(0, std::memory_order_relaxed);
+    pipeline->stopping.store(false);
+    pipeline->reader = std::thread(readerStage, pipeline);
+    pipeline->packetizer = std::thread(packetizerStage, pipeline);
+    return pipeline;
+}
+
+// Buffers the packetizer can take now: free slots, but no more than there are packets left to fill
+int packetizerSpace(const PacketPipeline* pipeline) {
+    uint64_t lent = pipeline->supplied.load(std::memory_order_relaxed) - pipeline->packets.head.load(std::memory_order_relaxed);
+    uint64_t space = PACKETIZER_PACKETS - lent;
+    uint64_t unfilled = pipeline->packetCount - pipeline->taken - lent;
+    return (int)(space < unfilled ? space : unfilled);
+}
+
+// Lends count empty buffers (at most packetizerSpace), the packets are built in them in order
+void packetizerSupply(PacketPipeline* pipeline, char* const* buffers, int count) {
+    uint64_t supplied = pipeline->supplied.load(std::memory_order_relaxed);
+    for (int i = 0; i < count; i++) {
+        pipeline->buffers[(supplied + i) % PACKETIZER_PACKETS] = buffers[i];
+    }
+    pipeline->supplied.store(supplied + count, std::memory_order_release);
+}
+
+// The next packets in file order, up to maxCount. Waits for at least one unless all were released,
+// so it needs lent buffers. They stay the packetizer's until packetizerRelease
+int packetizerPeek(PacketPipeline* pipeline, char** packets, size_t* sizes, int maxCount) {
+    uint64_t ready;
+    int spins = 0;
+    while ((ready = ringReady(&pipeline->packets)) == 0) {
+        if (pipeline->taken >= pipeline->packetCount) {
+            return 0;
+        }
+        backoff(&spins);
+    }
+    int count = ready < (uint64_t)maxCount ? (int)ready : maxCount;
+    uint64_t head = pipeline->packets.head.load(std::memory_order_relaxed);
+    for (int i = 0; i < count; i++) {
+        uint64_t slot = (head + i) % PACKETIZER_PACKETS;
+        packets[i] = pipeline->buffers[slot];
+        sizes[i] = pipeline->sizes[slot];
+    }
+    return count;
+}
+
+// The first count packets from packetizerPeek have been committed, their buffers are the connection's now
+void packetizerRelease(PacketPipeline* pipeline, int count) {
+    ringPop(&pipeline->packets, (uint64_t)count);
+    pipeline->taken += count;
+}
+
+// Stops the threads. The buffers it still holds, filled or not, go to leftovers (up to PACKETIZER_PACKETS), returns how many
+int packetizerDestroy(PacketPipeline* pipeline, char** leftovers) {
+    if (!pipeline) {
+        return 0;
+    }
+    pipeline->stopping.store(true);
+    pipeline->reader.join();
+    pipeline->packetizer.join();
+    uint64_t head = pipeline->packets.head.load(std::memory_order_relaxed);
+    int count = (int)(pipeline->supplied.load(std::memory_order_relaxed) - head);
+    for (int i = 0; i < count; i++) {
+        leftovers[i] = pipeline->buffers[(head + i) % PACKETIZER_PACKETS];
+    }
+    delete pipeline;
+    return count;
+}
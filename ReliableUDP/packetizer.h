@@ -0,0 +1,36 @@
+/*
+ * FILE: packetizer.h
+ * PROJECT: Reliable UDP File Transfer
+ * PROGRAMMER: Manreet & Bhawanjeet
+ * FIRST VERSION: 17/10/2026
+ * DESCRIPTION:
+ * This header file declares the staged sender for uncompressed files. A reader
+ * thread brings the file in from disk ahead of the send position, a packetizer
+ * thread builds each data packet with its CRC-32C straight in a message
+ * buffer the send loop lent it from the connection, and the send loop only
+ * commits the finished packets. The stages are joined by single-producer,
+ * single-consumer rings; a full ring makes the stage before it wait, so the
+ * reader never runs far ahead of the network.
+ */
+#ifndef PACKETIZER_H
+#define PACKETIZER_H
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PACKETIZER_READ_BLOCK (256 * 1024)  // file bytes the reader brings in at a time
+#define PACKETIZER_READ_AHEAD 16            // blocks it may be ahead of the packetizer
+#define PACKETIZER_PACKETS 256              // buffers lent to the packetizer, finished or not
+
+// The threads packing the chunks after a starting offset, in order
+typedef struct PacketPipeline PacketPipeline;
+
+PacketPipeline* packetizerCreate(const char* fileData, uint64_t fileSize, uint64_t startOffset, size_t packetSize);
+int packetizerSpace(const PacketPipeline* pipeline);
+void packetizerSupply(PacketPipeline* pipeline, char* const* buffers, int count);
+int packetizerPeek(PacketPipeline* pipeline, char** packets, size_t* sizes, int maxCount);
+void packetizerRelease(PacketPipeline* pipeline, int count);
+int packetizerDestroy(PacketPipeline* pipeline, char** leftovers);
+
+#endif